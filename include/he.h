@@ -9,6 +9,17 @@
 #define HE_NONE 0
 #define HE_READABLE 1
 #define HE_WRITABLE 2
+#define HE_EXCLUSIVE 4
+#define HE_EDGE 8
+#define HE_ERROR 16
+
+#define HE_NOMORE -1
+
+#define HE_BACKEND_DEFAULT 0
+#define HE_BACKEND_EPOLL 1
+#define HE_BACKEND_URING 2
+
+#define HE_DEFAULT_MAX_EVENTS 1024
 
 #define HE_NOTUSED(V) ((void) V)
 
@@ -22,9 +33,18 @@ typedef void he_file_proc(struct he_event_loop *event_loop,
     int fd, void *client_data, int mask);
 typedef int he_update_proc(struct he_event_loop *event_loop, 
     void *client_data);
+typedef void he_post_proc(struct he_event_loop *event_loop, void *arg);
+typedef void he_hook_proc(struct he_event_loop *event_loop, void *client_data);
+struct he_timer;
+typedef long long he_timer_proc(struct he_event_loop *event_loop,
+    struct he_timer *timer, void *client_data);
 
+/* gen changes every time an fd stops being registered, so events fetched
+ * for an earlier registration of the same fd number can be told apart. */
 typedef struct he_file_event {
     int mask;
+    int ready;
+    unsigned int gen;
     he_file_proc *rfile_proc;
     he_file_proc *wfile_proc;
     void *client_data;
@@ -33,8 +53,17 @@ typedef struct he_file_event {
 typedef struct he_fired_event {
     int fd;
     int mask;
+    unsigned int gen;
 } he_fired_event;
 
+/* Identifies one registration of an fd: (gen << 32) | fd. */
+typedef unsigned long long he_handle;
+
+#define HE_HANDLE_NONE (~0ULL)
+#define HE_HANDLE(fd, gen) (((he_handle)(gen) << 32) | (unsigned int)(fd))
+#define HE_HANDLE_FD(h) ((int)((h) & 0xffffffff))
+#define HE_HANDLE_GEN(h) ((unsigned int)((h) >> 32))
+
 typedef struct he_update_info {
     long when_sec;
     long when_ms;
@@ -44,22 +73,112 @@ typedef struct he_update_info {
     void *client_data;
 } he_update_info;
 
+/* A timer lives in the loop's min-heap ordered by (when, seq). index is
+ * its slot in the heap, or -1 once it is deleted. The proc returns the
+ * delay in milliseconds until the next run, or HE_NOMORE to have the timer
+ * deleted; a he_reset_timer from the proc overrides the return value. */
+typedef struct he_timer {
+    long long when;
+    unsigned long long seq;
+    int index;
+    int flags;
+    he_timer_proc *proc;
+    void *client_data;
+} he_timer;
+
+/* A unit of work handed to a loop from any thread. Tasks passed to
+ * he_post_task are owned by the caller and may be freed from their proc.
+ * drop, if set, runs instead of proc for a posted task still queued when
+ * the loop is deleted, so the owner can release it; leave it NULL (e.g.
+ * by zeroing the task) when there is nothing to release. The same struct
+ * is used for he_defer; a task must not sit in both queues at once. */
+typedef struct he_task {
+    struct he_task *next;
+    he_post_proc *proc;
+    he_post_proc *drop;
+    void *arg;
+    int flags;
+} he_task;
+
+struct he_post_queue;
+struct he_api;
+struct he_pool;
+struct he_loop_stats;
+
+/* events is indexed by fd and grows on demand when a file event is created
+ * for an fd >= setsize. fired only holds what one poll call returns and is
+ * bounded by maxevents independently of the fd table. ctl_errors counts
+ * deferred interest changes the backend failed to apply. */
 typedef struct he_event_loop {
+    int maxfd;
     int setsize;
+    int maxevents;
     he_file_event *events;
     he_fired_event *fired;
     he_update_info ui;
+    he_timer **timers;
+    int timers_count;
+    int timers_size;
+    unsigned long long timers_seq;
+    struct he_post_queue *post;
+    he_task *defer_head;
+    he_task *defer_tail;
+    he_task *defer_running;
+    he_hook_proc *before_sleep;
+    void *before_sleep_data;
+    he_hook_proc *after_poll;
+    void *after_poll_data;
+    int *ready;
+    int nready;
+    int ready_size;
+    int default_mask;
+    struct he_pool *pool;
+    struct he_loop_stats *stats;
+    long long busy_poll_usec;
+    unsigned long long busy_hits;
+    unsigned long long busy_sleeps;
+    unsigned long long ctl_errors;
+    int cpu;
+    int numa_node;
+    int pinned;
     int stop;
+    const struct he_api *api;
     void *apidata;
 } he_event_loop;
 
 he_event_loop *he_create_event_loop(int setsize, long long update_ms,
     he_update_proc *proc, void *client_data);
+he_event_loop *he_create_event_loop_backend(int setsize, long long update_ms,
+    he_update_proc *proc, void *client_data, int backend);
 void he_delete_event_loop(he_event_loop *event_loop);
+const char *he_get_backend_name(he_event_loop *event_loop);
+int he_resize_setsize(he_event_loop *event_loop, int setsize);
+int he_set_max_events(he_event_loop *event_loop, int maxevents);
+void he_set_busy_poll(he_event_loop *event_loop, long long usec);
+int he_set_thread_affinity(const int *cpus, int ncpus);
+int he_get_cpu_node(int cpu);
+void he_loop_update_cpu(he_event_loop *event_loop);
+int he_pin_loop(he_event_loop *event_loop, const int *cpus, int ncpus);
 void he_stop(he_event_loop *event_loop);
 int he_create_file_event(he_event_loop *event_loop, int fd, int mask,
     he_file_proc *proc, void *client_data);
 void he_delete_file_event(he_event_loop *event_loop, int fd, int mask);
+he_handle he_get_file_handle(he_event_loop *event_loop, int fd);
+int he_handle_valid(he_event_loop *event_loop, he_handle handle);
+int he_set_file_ready(he_event_loop *event_loop, int fd, int mask);
+void he_set_edge_triggered(he_event_loop *event_loop, int enable);
+he_timer *he_create_timer(he_event_loop *event_loop, long long ms,
+    he_timer_proc *proc, void *client_data);
+void he_delete_timer(he_event_loop *event_loop, he_timer *timer);
+int he_reset_timer(he_event_loop *event_loop, he_timer *timer, long long ms);
+int he_post(he_event_loop *event_loop, he_post_proc *proc, void *arg);
+int he_post_task(he_event_loop *event_loop, he_task *task);
+int he_defer(he_event_loop *event_loop, he_task *task);
+void he_cancel_defer(he_event_loop *event_loop, he_task *task);
+void he_set_before_sleep(he_event_loop *event_loop, he_hook_proc *proc,
+    void *client_data);
+void he_set_after_poll(he_event_loop *event_loop, he_hook_proc *proc,
+    void *client_data);
 int he_process_events(he_event_loop *event_loop);
 void he_main(he_event_loop *event_loop);
 
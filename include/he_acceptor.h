@@ -0,0 +1,59 @@
+#ifndef HE_ACCEPTOR_H
+#define HE_ACCEPTOR_H
+
+#include "he.h"
+#include "hnet.h"
+
+#define HE_ACCEPT_BURST 32
+#define HE_ACCEPT_MIN_BUDGET 64
+#define HE_ACCEPT_MAX_BUDGET 1024
+#define HE_ACCEPT_PAUSE_MS 50
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct he_acceptor;
+struct sockaddr_storage;
+
+/* fds[i] was accepted from addrs[i]. The fds are nonblocking and
+ * close-on-exec and belong to the proc; the arrays are only valid for the
+ * duration of the call. */
+typedef void he_accept_proc(struct he_acceptor *acceptor, int *fds,
+    struct sockaddr_storage *addrs, int count, void *client_data);
+
+/* A listening socket drained with accept4. Accepted fds get the sockopts
+ * profile and are handed to the proc in bursts of up to HE_ACCEPT_BURST.
+ * At most budget fds are accepted per loop iteration: the budget doubles
+ * up to max_budget while the backlog is not drained and halves down to
+ * min_budget when it drains easily, so a connection storm cannot stall
+ * the other fds of the loop. Running out of fds or memory pauses accepting
+ * for HE_ACCEPT_PAUSE_MS; pauses counts those. */
+typedef struct he_acceptor {
+    he_event_loop *event_loop;
+    int fd;
+    int flags;
+    hnet_sockopts opts;
+    int budget;
+    int min_budget;
+    int max_budget;
+    int fds[HE_ACCEPT_BURST];
+    struct sockaddr_storage *addrs;
+    unsigned long long accepted;
+    unsigned long long errors;
+    unsigned long long pauses;
+    he_timer *pause_timer;
+    he_accept_proc *proc;
+    void *client_data;
+} he_acceptor;
+
+he_acceptor *he_create_acceptor(he_event_loop *event_loop, int fd,
+    const hnet_sockopts *opts, he_accept_proc *proc, void *client_data);
+void he_acceptor_set_budget(he_acceptor *acceptor, int min_budget, int max_budget);
+void he_acceptor_close(he_acceptor *acceptor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef HE_CLIENT_H
+#define HE_CLIENT_H
+
+#include "he.h"
+#include "he_conn.h"
+
+#define HE_CLIENT_ROUND_ROBIN 0
+#define HE_CLIENT_LEAST_PENDING 1
+
+#define HE_CLIENT_DISCONNECTED 0
+#define HE_CLIENT_CONNECTING 1
+#define HE_CLIENT_CONNECTED 2
+#define HE_CLIENT_BACKOFF 3
+
+#define HE_CLIENT_CONNECT_TIMEOUT 3000
+#define HE_CLIENT_BACKOFF_MIN 100
+#define HE_CLIENT_BACKOFF_MAX 30000
+#define HE_CLIENT_RESOLVE_TTL 30000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct he_client_pool;
+struct he_resolver;
+
+/* Called when slot index changes state. conn is the slot's connection
+ * when state is HE_CLIENT_CONNECTED and NULL otherwise; err is the errno
+ * that ended the previous connection or attempt, if any, EHOSTUNREACH when
+ * host did not resolve. */
+typedef void he_client_state_proc(struct he_client_pool *pool, int index,
+    he_conn *conn, int state, int err, void *client_data);
+
+typedef struct he_client_slot {
+    struct he_client_pool *pool;
+    int index;
+    int state;
+    int fd;
+    he_conn *conn;
+    he_timer *timer;
+    he_task retry_task;
+    int attempts;
+    long long connected_at;
+    unsigned long long connects;
+    unsigned long long failures;
+} he_client_slot;
+
+/* size persistent connections to host:port. A slot whose connect fails,
+ * times out or whose connection is closed by the peer is reconnected
+ * after an exponential backoff with jitter between backoff_min and
+ * backoff_max milliseconds. he_client_pool_get picks one of the connected
+ * slots by policy. */
+typedef struct he_client_pool {
+    he_event_loop *event_loop;
+    char *host;
+    int port;
+    struct he_resolver *resolver;
+    int size;
+    he_client_slot *slots;
+    int policy;
+    int next;
+    int nconnected;
+    long long connect_timeout;
+    long long backoff_min;
+    long long backoff_max;
+    unsigned int seed;
+    he_conn_proc *read_proc;
+    he_client_state_proc *state_proc;
+    void *client_data;
+} he_client_pool;
+
+he_client_pool *he_create_client_pool(he_event_loop *event_loop, const char *host,
+    int port, int size, he_conn_proc *read_proc, he_client_state_proc *state_proc,
+    void *client_data);
+void he_delete_client_pool(he_client_pool *pool);
+void he_client_pool_set_policy(he_client_pool *pool, int policy);
+void he_client_pool_set_timeouts(he_client_pool *pool, long long connect_timeout,
+    long long backoff_min, long long backoff_max);
+he_conn *he_client_pool_get(he_client_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
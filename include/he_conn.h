@@ -0,0 +1,95 @@
+#ifndef HE_CONN_H
+#define HE_CONN_H
+
+#include <stddef.h>
+
+#include "he.h"
+
+#define HE_CONN_READ_MIN 4096
+#define HE_CONN_CHUNK_SIZE 16384
+#define HE_CONN_ZEROCOPY_MIN 10240
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct he_conn;
+struct he_pool;
+struct iovec;
+
+typedef void he_conn_proc(struct he_conn *conn, void *client_data);
+typedef void he_conn_close_proc(struct he_conn *conn, int err, void *client_data);
+typedef void he_conn_free_proc(void *buf, void *arg);
+
+/* One segment of the output queue, bytes [pos, len) of data are still
+ * unsent. Chunks and the input buffer are allocated from the loop's
+ * he_pool. A chunk with a free_proc references a caller buffer queued by
+ * he_conn_write_zc; zc_refs counts its zerocopy sends not yet reported
+ * complete by the kernel. */
+typedef struct he_chunk {
+    struct he_chunk *next;
+    char *data;
+    size_t pos;
+    size_t len;
+    size_t size;
+    int zc_refs;
+    he_conn_free_proc *free_proc;
+    void *free_arg;
+} he_chunk;
+
+/* A buffered stream connection. Input is kept in [rpos, wpos) of ibuf and
+ * stays there until the read proc consumes it. Output that cannot be
+ * written right away is queued in chunks and flushed with writev when the
+ * fd becomes writable. With coalescing on, every write is queued and the
+ * queue is flushed once per loop iteration from flush_task. */
+typedef struct he_conn {
+    he_event_loop *event_loop;
+    struct he_pool *pool;
+    int fd;
+    int flags;
+    char *ibuf;
+    size_t rpos;
+    size_t wpos;
+    size_t isize;
+    he_chunk *ohead;
+    he_chunk *otail;
+    size_t olen;
+    size_t low_water;
+    size_t high_water;
+    size_t zc_threshold;
+    unsigned int zc_seq;
+    unsigned int zc_base;
+    unsigned int zc_ring_size;
+    he_chunk **zc_ring;
+    he_timer *zc_timer;
+    long long zc_linger;
+    he_task flush_task;
+    he_conn_proc *read_proc;
+    he_conn_proc *high_water_proc;
+    he_conn_proc *low_water_proc;
+    he_conn_close_proc *close_proc;
+    void *client_data;
+} he_conn;
+
+he_conn *he_create_conn(he_event_loop *event_loop, int fd, he_conn_proc *read_proc,
+    he_conn_close_proc *close_proc, void *client_data);
+void he_conn_set_water_marks(he_conn *conn, size_t low_water, size_t high_water,
+    he_conn_proc *high_water_proc, he_conn_proc *low_water_proc);
+int he_conn_set_reading(he_conn *conn, int enable);
+void he_conn_set_coalesce(he_conn *conn, int enable);
+char *he_conn_input(he_conn *conn, size_t *len);
+void he_conn_consume(he_conn *conn, size_t len);
+int he_conn_reserve_input(he_conn *conn, size_t len);
+int he_conn_write(he_conn *conn, const void *buf, size_t len);
+int he_conn_writev(he_conn *conn, const struct iovec *iov, int iovcnt);
+int he_conn_enable_zerocopy(he_conn *conn, size_t threshold);
+int he_conn_write_zc(he_conn *conn, const void *buf, size_t len,
+    he_conn_free_proc *free_proc, void *arg);
+size_t he_conn_pending(he_conn *conn);
+void he_conn_close(he_conn *conn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
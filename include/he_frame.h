@@ -0,0 +1,56 @@
+#ifndef HE_FRAME_H
+#define HE_FRAME_H
+
+#include <stddef.h>
+
+#include "he.h"
+#include "he_conn.h"
+
+#define HE_FRAME_BIG_ENDIAN 0
+#define HE_FRAME_LITTLE_ENDIAN 1
+
+#define HE_FRAME_BATCH 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A frame payload inside the connection's input buffer. */
+typedef struct he_frame_view {
+    const char *data;
+    size_t len;
+} he_frame_view;
+
+/* Gets every complete frame of one read at once. The views point into the
+ * input buffer and are only valid until the proc returns. */
+typedef void he_frame_proc(he_conn *conn, he_frame_view *frames, int count,
+    void *client_data);
+
+/* Length-prefixed framing over he_conn: a header_size byte length in
+ * byte_order followed by that many payload bytes. Frames are parsed in
+ * place, never copied; a partial frame stays in the input buffer until the
+ * rest arrives. The view array is scratch space reused by every call, so
+ * one codec can serve all the conns of a loop. */
+typedef struct he_frame_codec {
+    int header_size;
+    int byte_order;
+    size_t max_frame;
+    he_frame_view *views;
+    int views_size;
+    unsigned long long frames;
+    unsigned long long batches;
+} he_frame_codec;
+
+he_frame_codec *he_create_frame_codec(int header_size, int byte_order,
+    size_t max_frame);
+void he_delete_frame_codec(he_frame_codec *codec);
+int he_frame_read(he_frame_codec *codec, he_conn *conn, he_frame_proc *proc,
+    void *client_data);
+int he_frame_write(he_frame_codec *codec, he_conn *conn, const void *buf,
+    size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef HE_GROUP_H
+#define HE_GROUP_H
+
+#include "he.h"
+
+#define HE_GROUP_REUSEPORT 0
+#define HE_GROUP_EXCLUSIVE 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct he_group_thread;
+
+/* cpus, when set, holds the ncpus CPUs the loops are spread over (see
+ * he_create_loop_group_cpus). */
+typedef struct he_loop_group {
+    int nloops;
+    he_event_loop **loops;
+    struct he_group_thread *threads;
+    int *listeners;
+    int nlisteners;
+    int running;
+    int *cpus;
+    int ncpus;
+} he_loop_group;
+
+he_loop_group *he_create_loop_group(int nloops, int setsize, long long update_ms,
+    he_update_proc *proc, void *client_data);
+he_loop_group *he_create_loop_group_cpus(int nloops, int setsize, long long update_ms,
+    he_update_proc *proc, void *client_data, const int *cpus, int ncpus);
+void he_delete_loop_group(he_loop_group *group);
+he_event_loop *he_loop_group_get(he_loop_group *group, int index);
+int he_loop_group_tcp_server(char *err, he_loop_group *group, int port,
+    char *bindaddr, int backlog, int mode, he_file_proc *proc, void *client_data);
+int he_loop_group_start(he_loop_group *group);
+void he_loop_group_stop(he_loop_group *group);
+void he_loop_group_join(he_loop_group *group);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef HE_POOL_H
+#define HE_POOL_H
+
+#include <stddef.h>
+
+#include "he.h"
+
+#define HE_POOL_HUGEPAGE (1<<0)
+
+#define HE_POOL_MIN_SHIFT 9
+#define HE_POOL_MAX_SHIFT 16
+#define HE_POOL_CLASSES (HE_POOL_MAX_SHIFT - HE_POOL_MIN_SHIFT + 1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct he_pool_block {
+    struct he_pool_block *next;
+} he_pool_block;
+
+typedef struct he_pool_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long oversize;
+    size_t resident;
+    size_t in_use;
+} he_pool_stats;
+
+/* Size-class allocator for network buffers, 512B to 64KB in powers of
+ * two. Blocks are carved from large mmap'ed regions and recycled through
+ * per-class free lists; they are only returned to the system when the
+ * pool is deleted. A pool belongs to one loop and takes no locks. With
+ * node >= 0 new regions prefer that NUMA node. */
+typedef struct he_pool {
+    int flags;
+    int node;
+    he_pool_block *free[HE_POOL_CLASSES];
+    char *cur;
+    char *end;
+    void **regions;
+    size_t *region_sizes;
+    int nregions;
+    int regions_size;
+    he_pool_stats stats;
+} he_pool;
+
+he_pool *he_create_pool(int flags);
+void he_delete_pool(he_pool *pool);
+void *he_pool_alloc(he_pool *pool, size_t size, size_t *usable);
+void *he_pool_realloc(he_pool *pool, void *ptr, size_t oldsize, size_t size,
+    size_t *usable);
+void he_pool_free(he_pool *pool, void *ptr, size_t size);
+void he_pool_get_stats(he_pool *pool, he_pool_stats *stats);
+void he_pool_set_node(he_pool *pool, int node);
+int he_init_loop_pool(he_event_loop *event_loop, int flags);
+he_pool *he_get_loop_pool(he_event_loop *event_loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef HE_RESOLVER_H
+#define HE_RESOLVER_H
+
+#include "he.h"
+
+#define HE_RESOLVE_MAX_ADDRS 8
+#define HE_RESOLVE_CACHE_BUCKETS 256
+#define HE_RESOLVE_CACHE_MAX 4096
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct he_resolver;
+struct sockaddr_storage;
+
+/* err is 0 or a getaddrinfo EAI_* code. addrs carry the requested port and
+ * are only valid for the duration of the call. */
+typedef void he_resolve_proc(struct he_resolver *resolver, int err,
+    const struct sockaddr_storage *addrs, int naddrs, void *client_data);
+
+struct he_resolve_entry;
+struct he_resolve_queue;
+struct he_resolve_req;
+
+/* Runs getaddrinfo on nthreads helper threads and hands the results back
+ * to event_loop through he_post_task, so the loop never blocks on the
+ * system resolver. Successful lookups are cached for ttl_ms; the cache and
+ * all callbacks belong to the loop thread. deferred lists the answers
+ * queued with he_defer. Delete the resolver before its loop. */
+typedef struct he_resolver {
+    he_event_loop *event_loop;
+    int nthreads;
+    struct he_resolve_queue *queue;
+    struct he_resolve_req *deferred;
+    int pending;
+    int closing;
+    long long ttl_ms;
+    struct he_resolve_entry **cache;
+    int cache_count;
+    unsigned long long hits;
+    unsigned long long misses;
+} he_resolver;
+
+he_resolver *he_create_resolver(he_event_loop *event_loop, int nthreads, long long ttl_ms);
+void he_delete_resolver(he_resolver *resolver);
+int he_resolve(he_resolver *resolver, const char *host, int port, int family,
+    he_resolve_proc *proc, void *client_data);
+void he_resolver_flush_cache(he_resolver *resolver);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef HE_STATS_H
+#define HE_STATS_H
+
+#include "he.h"
+
+/* Log-linear buckets: values below HE_HIST_SUB are exact, every power of
+ * two above is split into HE_HIST_SUB linear steps (about 6% error), up
+ * to 2^HE_HIST_MAX_BITS. Larger values land in the last bucket. */
+#define HE_HIST_SUB_BITS 4
+#define HE_HIST_SUB (1 << HE_HIST_SUB_BITS)
+#define HE_HIST_MAX_BITS 40
+#define HE_HIST_BUCKETS ((HE_HIST_MAX_BITS - HE_HIST_SUB_BITS + 1) * HE_HIST_SUB)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct he_hist {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long min;
+    unsigned long long max;
+    unsigned long long buckets[HE_HIST_BUCKETS];
+} he_hist;
+
+/* A callback that ran for at least the slow threshold. fd is -1 for
+ * timers and deferred tasks; exactly one of the proc fields is set. */
+typedef struct he_slow_event {
+    int fd;
+    int mask;
+    he_file_proc *file_proc;
+    he_timer_proc *timer_proc;
+    he_post_proc *task_proc;
+    void *client_data;
+    long long usec;
+} he_slow_event;
+
+typedef void he_slow_proc(he_event_loop *event_loop, const he_slow_event *ev,
+    void *client_data);
+
+/* Times are in microseconds. poll_wait is the time spent in the backend
+ * poll call, callback the run time of every file event, timer and
+ * deferred task, timer_lateness how long after its deadline a timer ran.
+ * The loop only pays for a NULL check while stats are disabled. */
+typedef struct he_loop_stats {
+    unsigned long long iterations;
+    unsigned long long events;
+    unsigned long long callbacks;
+    unsigned long long slow_callbacks;
+    he_hist poll_wait;
+    he_hist callback;
+    he_hist events_per_wakeup;
+    he_hist timer_lateness;
+    long long slow_usec;
+    he_slow_proc *slow_proc;
+    void *slow_data;
+} he_loop_stats;
+
+long long he_ustime(void);
+void he_hist_record(he_hist *hist, unsigned long long value);
+unsigned long long he_hist_percentile(const he_hist *hist, double percentile);
+void he_hist_reset(he_hist *hist);
+void he_hist_merge(he_hist *dst, const he_hist *src);
+
+int he_enable_stats(he_event_loop *event_loop, int enable);
+he_loop_stats *he_get_stats(he_event_loop *event_loop);
+void he_reset_stats(he_event_loop *event_loop);
+int he_set_slow_threshold(he_event_loop *event_loop, long long usec,
+    he_slow_proc *proc, void *client_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
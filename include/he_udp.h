@@ -0,0 +1,90 @@
+#ifndef HE_UDP_H
+#define HE_UDP_H
+
+#include <stddef.h>
+
+#include "he.h"
+
+#define HE_UDP_MAX_ROUNDS 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct he_udp;
+struct he_pool;
+struct mmsghdr;
+struct iovec;
+struct sockaddr_storage;
+
+/* msgs[i].msg_len bytes of msgs[i].msg_hdr.msg_iov[0].iov_base were
+ * received from msgs[i].msg_hdr.msg_name. The batch is only valid for the
+ * duration of the call. */
+typedef void he_udp_proc(struct he_udp *udp, struct mmsghdr *msgs, int count,
+    void *client_data);
+
+/* A batched UDP endpoint. Reads are drained with recvmmsg into vlen
+ * preallocated slots of bufsize bytes each. Outgoing datagrams are copied
+ * into a second set of slots and sent with one sendmmsg per iteration,
+ * from a deferred task that runs before the loop sleeps. */
+typedef struct he_udp {
+    he_event_loop *event_loop;
+    struct he_pool *pool;
+    int fd;
+    int flags;
+    unsigned int vlen;
+    size_t bufsize;
+    struct mmsghdr *rmsgs;
+    struct iovec *riovs;
+    struct sockaddr_storage *raddrs;
+    struct mmsghdr *wmsgs;
+    struct iovec *wiovs;
+    struct sockaddr_storage *waddrs;
+    unsigned int wcount;
+    he_task flush_task;
+    unsigned long long send_errors;
+    he_udp_proc *read_proc;
+    void *client_data;
+} he_udp;
+
+struct he_udp_peer;
+
+/* Connected he_udp endpoints keyed by destination address, at most capacity
+ * of them. The least recently used one is flushed and closed to make room
+ * for a new destination. read_proc receives the replies of every peer. */
+typedef struct he_udp_cache {
+    he_event_loop *event_loop;
+    int capacity;
+    int count;
+    unsigned int vlen;
+    size_t bufsize;
+    struct he_udp_peer **table;
+    unsigned int table_size;
+    struct he_udp_peer *lru_head;
+    struct he_udp_peer *lru_tail;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    he_udp_proc *read_proc;
+    void *client_data;
+} he_udp_cache;
+
+he_udp *he_create_udp(he_event_loop *event_loop, int fd, unsigned int vlen,
+    size_t bufsize, he_udp_proc *read_proc, void *client_data);
+void he_udp_close(he_udp *udp);
+int he_udp_send(he_udp *udp, const void *buf, size_t len,
+    const struct sockaddr_storage *sa);
+int he_udp_flush(he_udp *udp);
+he_udp_cache *he_create_udp_cache(he_event_loop *event_loop, int capacity,
+    unsigned int vlen, size_t bufsize, he_udp_proc *read_proc, void *client_data);
+void he_delete_udp_cache(he_udp_cache *cache);
+he_udp *he_udp_cache_get(he_udp_cache *cache, const struct sockaddr_storage *sa);
+int he_udp_cache_send(he_udp_cache *cache, const struct sockaddr_storage *sa,
+    const void *buf, size_t len);
+void he_udp_cache_flush(he_udp_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
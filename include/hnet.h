@@ -10,6 +10,9 @@
 #define HNET_NONE 0
 #define HNET_IP_ONLY (1<<0)
 
+#define HNET_GSO_MAX_SEGS 64
+#define HNET_MAX_PASS_FDS 16
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,26 +21,65 @@ struct addrinfo;
 struct sockaddr_storage;
 struct mmsghdr;
 struct iovec;
+struct msghdr;
+
+/* Options applied to every accepted socket by hnet_apply_sockopts. Zero
+ * leaves the corresponding option untouched; keepalive is the probe
+ * interval in seconds, busy_poll the SO_BUSY_POLL time in microseconds. */
+typedef struct hnet_sockopts {
+    int nodelay;
+    int keepalive;
+    int recv_buffer;
+    int send_buffer;
+    int busy_poll;
+    int prefer_busy_poll;
+} hnet_sockopts;
 
 int hnet_tcp_nonblock_connect(char *err, char *addr, int port);
+int hnet_tcp_nonblock_connect_addr(char *err, const struct sockaddr_storage *sa);
 int hnet_tcp_server(char *err, int port, char *bindaddr, int backlog, int reuse_port);
 int hnet_tcp6_server(char *err, int port, char *bindaddr, int backlog, int reuse_port);
 int hnet_tcp_accept(char *err, int serversock, struct sockaddr_storage *sa);
+int hnet_tcp_accept4(char *err, int serversock, struct sockaddr_storage *sa, int flags);
+int hnet_apply_sockopts(char *err, int fd, const hnet_sockopts *opts);
 int hnet_nonblock(char *err, int fd);
 int hnet_enable_tcp_nodelay(char *err, int fd);
 int hnet_send_timeout(char *err, int fd, long long ms);
 int hnet_keep_alive(char *err, int fd, int interval);
 int hnet_set_recv_buffer(char *err, int fd, int buffsize);
 int hnet_set_send_buffer(char *err, int fd, int buffsize);
+int hnet_set_busy_poll(char *err, int fd, int usec);
+int hnet_set_prefer_busy_poll(char *err, int fd, int enable, int budget);
 int hnet_get_sock_error(int fd);
 int hnet_udp_server(char *err, int port, char *bindaddr, int reuse_port);
 int hnet_udp6_server(char *err, int port, char *bindaddr, int reuse_port);
+int hnet_udp_connect(char *err, const struct sockaddr_storage *sa);
 int hnet_udp_nonblock_sendto(char *err, char *addr, int port, void *buf, size_t len, ssize_t *written);
 ssize_t hnet_recvfrom(int fd, void *buf, size_t len, struct sockaddr_storage *sa);
 ssize_t hnet_sendto(int fd, void *buf, size_t len, struct sockaddr_storage *sa);
 void hnet_set_mmsghdr(void *bufs, size_t len, unsigned int vlen, 
     struct sockaddr_storage *sas, struct mmsghdr *msgs, struct iovec *iovecs);
+void hnet_reset_mmsghdr(struct mmsghdr *msgs, unsigned int vlen);
 int hnet_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen);
+int hnet_recvmmsg_flags(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags);
+int hnet_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags);
+int hnet_set_udp_segment(char *err, int fd, int gso_size);
+int hnet_enable_udp_gro(char *err, int fd);
+ssize_t hnet_send_gso(int fd, const void *buf, size_t len, int gso_size,
+    struct sockaddr_storage *sa);
+ssize_t hnet_recv_gro(int fd, void *buf, size_t len, struct sockaddr_storage *sa,
+    int *gso_size);
+int hnet_get_gro_size(struct msghdr *msg);
+int hnet_enable_zerocopy(char *err, int fd);
+ssize_t hnet_send_zerocopy(int fd, const void *buf, size_t len);
+int hnet_read_zerocopy(int fd, unsigned int *lo, unsigned int *hi, int *copied);
+int hnet_unix_server(char *err, const char *path, mode_t perm, int backlog);
+int hnet_unix_dgram_server(char *err, const char *path, mode_t perm);
+int hnet_unix_accept(char *err, int serversock, int flags);
+int hnet_unix_nonblock_connect(char *err, const char *path);
+int hnet_unix_dgram_connect(char *err, const char *path);
+ssize_t hnet_send_fds(int fd, const void *buf, size_t len, const int *fds, int nfds);
+ssize_t hnet_recv_fds(int fd, void *buf, size_t len, int *fds, int *nfds);
 void hnet_get_ip_port(struct sockaddr_storage *sa, char *ip, size_t ip_len, int *port);
 
 #ifdef __cplusplus
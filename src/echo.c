@@ -8,11 +8,14 @@
 #include <unistd.h>
 
 #include "he.h"
+#include "he_acceptor.h"
+#include "he_client.h"
+#include "he_conn.h"
 #include "hnet.h"
 
 #define UNUSED(V) ((void) V)
 #define NET_IP_STR_LEN 46
-#define MAX_ACCEPTS_PER_CALL 1000
+#define ECHO_UNIX_PATH "/tmp/hevent-echo.sock"
 
 static long long time_in_milliseconds(void) 
 {
@@ -38,109 +41,76 @@ static void free_fd(he_event_loop *el, int fd)
     close(fd);
 }
 
-static void write_tcp_handler(he_event_loop *el, int fd, void *privdata, int mask) 
+static void close_tcp_proc(he_conn *conn, int err, void *privdata)
 {
-    UNUSED(el);
-    UNUSED(mask);
+    UNUSED(conn);
     UNUSED(privdata);
-    printf("%d write_tcp_handler\n", fd);
+
+    if (err) {
+        printf("Reading from client: %s\n", strerror(err));
+    } else {
+        printf("Client closed connection\n");
+    }
 }
 
-static void read_tcp_handler(he_event_loop *el, int fd, void *privdata, int mask) 
+static void read_tcp_proc(he_conn *conn, void *privdata)
 {
-    int nread, nwritten;
-    char buf[4096];
-    UNUSED(el);
-    UNUSED(mask);
+    size_t len;
+    char *buf = he_conn_input(conn, &len);
     UNUSED(privdata);
 
-    nread = read(fd, buf, 4096);
-    if (nread == -1) {
-        if (errno == EAGAIN) {
-            return;
-        } else {
-            printf("Reading from client: %s\n", strerror(errno));
-            free_fd(el, fd);
-        }
-    } else if (nread == 0) {
-        printf("Client closed connection\n");
-        free_fd(el, fd);
-    } else {
-        buf[nread - 1] = '\0';
-        printf("read %s\n", buf);
-        nwritten = write(fd, buf, nread);
-        if (nwritten == -1) {
-            if (errno == EAGAIN) {
-                he_create_file_event(el, fd, HE_WRITABLE, write_tcp_handler, NULL);
-            } else {
-                printf("Error writing to client: %s\n", strerror(errno));
-                free_fd(el, fd);
-            }
-        } else if (nwritten >= 0) {
-            if (nwritten < nread) {
-                he_create_file_event(el, fd, HE_WRITABLE, write_tcp_handler, NULL);
-            }
-        }
+    printf("read %.*s\n", (int)len, buf);
+    if (he_conn_write(conn, buf, len) == HE_ERR) {
+        printf("Error writing to client\n");
+        return;
     }
+    he_conn_consume(conn, len);
 }
 
-static void accept_tcp_handler(he_event_loop *el, int fd, void *privdata, int mask) 
+static void accept_tcp_proc(he_acceptor *acceptor, int *fds,
+    struct sockaddr_storage *addrs, int count, void *privdata)
 {
-    int cport, cfd, max = MAX_ACCEPTS_PER_CALL;
+    int i, cport;
     char cip[NET_IP_STR_LEN];
-    char neterr[HNET_ERR_LEN];
-    struct sockaddr_storage sa;
-    UNUSED(el);
-    UNUSED(mask);
     UNUSED(privdata);
 
-    while(max--) {
-        cfd = hnet_tcp_accept(neterr, fd, &sa);
-        if (cfd == HNET_ERR) {
-            if (errno != EWOULDBLOCK)
-                printf("Accepting client connection: %s\n", neterr);
-            return;
-        }
-        hnet_get_ip_port(&sa, cip, sizeof(cip), &cport);
+    for (i = 0; i < count; i++) {
+        hnet_get_ip_port(&addrs[i], cip, sizeof(cip), &cport);
         printf("Accepted %s:%d\n", cip, cport);
-        hnet_nonblock(neterr, cfd);
-        hnet_enable_tcp_nodelay(neterr, cfd);
-        hnet_keep_alive(neterr, cfd, 300);
-        if (he_create_file_event(el, cfd, HE_READABLE, read_tcp_handler, NULL) == HE_ERR) {
-            close(cfd);
+        if (he_create_conn(acceptor->event_loop, fds[i], read_tcp_proc,
+            close_tcp_proc, NULL) == NULL) {
+            close(fds[i]);
         }
     }
 }
 
-static void connect_tcp_handler(he_event_loop *el, int fd, void *privdata, int mask) 
+static void accept_unix_proc(he_acceptor *acceptor, int *fds,
+    struct sockaddr_storage *addrs, int count, void *privdata)
 {
-    int sockerr, nwrite = 0;
-    char neterr[HNET_ERR_LEN];
+    int i;
+    UNUSED(addrs);
     UNUSED(privdata);
-    UNUSED(mask);
 
-    he_delete_file_event(el, fd, HE_WRITABLE);
-    sockerr = hnet_get_sock_error(fd);
-    if (sockerr) {
-        printf("client hnet_get_sock_error: %s\n", strerror(sockerr));
-        close(fd);
-        return;
+    for (i = 0; i < count; i++) {
+        printf("Accepted unix client\n");
+        if (he_create_conn(acceptor->event_loop, fds[i], read_tcp_proc,
+            close_tcp_proc, NULL) == NULL) {
+            close(fds[i]);
+        }
     }
-    hnet_enable_tcp_nodelay(neterr, fd);
-    hnet_keep_alive(neterr, fd, 300);
-    if (he_create_file_event(el, fd, HE_READABLE, read_tcp_handler, NULL) == HE_ERR) {
-        close(fd);
+}
 
-        // reconnect
-        return;
-    }
-    nwrite = write(fd, "hello", 6);
-    if (nwrite < 0) {
-        if (errno == EAGAIN) {
-            // rewrite
-            return;
-        }
-        // reconnect
+static void client_state_proc(he_client_pool *pool, int index, he_conn *conn,
+    int state, int err, void *privdata)
+{
+    UNUSED(pool);
+    UNUSED(privdata);
+
+    if (state == HE_CLIENT_CONNECTED) {
+        printf("client %d connected\n", index);
+        he_conn_write(conn, "hello", 6);
+    } else if (state == HE_CLIENT_BACKOFF) {
+        printf("client %d disconnected: %s, reconnecting\n", index, strerror(err));
     }
 }
 
@@ -188,6 +158,7 @@ int main(int argc, char **argv)
     int s, fd;
     ssize_t written;
     char neterr[HNET_ERR_LEN];
+    hnet_sockopts opts = {1, 300, 0, 0};
 
     if (argc != 3) {
         printf("echo argc != 3\n");
@@ -205,20 +176,15 @@ int main(int argc, char **argv)
                 printf("Could not create server TCP listening socket %s", neterr);
                 exit(1);
             }
-            hnet_nonblock(NULL, s);
-            if (he_create_file_event(el, s, HE_READABLE, accept_tcp_handler, NULL) == HE_ERR) {
+            if (he_create_acceptor(el, s, &opts, accept_tcp_proc, NULL) == NULL) {
                 printf("Unrecoverable error creating server.ipfd file event\n");
                 exit(1);
             }
         } else if (!strcasecmp(argv[2], "client")) {
             printf("echo tcp client\n");
-            fd = hnet_tcp_nonblock_connect(neterr, "127.0.0.1", 8888);
-            if (fd == HNET_ERR) {
-                printf("Could not connect socket %s", neterr);
-                exit(1);
-            }
-            if (he_create_file_event(el, fd, HE_WRITABLE, connect_tcp_handler, NULL) == HE_ERR) {
-                printf("Unrecoverable error creating client.ipfd file event\n");
+            if (he_create_client_pool(el, "127.0.0.1", 8888, 1, read_tcp_proc,
+                client_state_proc, NULL) == NULL) {
+                printf("Could not create client pool: %s\n", strerror(errno));
                 exit(1);
             }
         }
@@ -245,6 +211,32 @@ int main(int argc, char **argv)
                 exit(1);
             }
         }
+    } else if (!strcasecmp(argv[1], "unix")) {
+        if (!strcasecmp(argv[2], "server")) {
+            printf("echo unix server\n");
+            unlink(ECHO_UNIX_PATH);
+            if ((s = hnet_unix_server(neterr, ECHO_UNIX_PATH, 0700, 511)) == HNET_ERR) {
+                printf("Could not create server unix listening socket %s", neterr);
+                exit(1);
+            }
+            if (he_create_acceptor(el, s, NULL, accept_unix_proc, NULL) == NULL) {
+                printf("Unrecoverable error creating server.ipfd file event\n");
+                exit(1);
+            }
+        } else if (!strcasecmp(argv[2], "client")) {
+            he_conn *conn;
+
+            printf("echo unix client\n");
+            if ((fd = hnet_unix_nonblock_connect(neterr, ECHO_UNIX_PATH)) == HNET_ERR) {
+                printf("Could not connect to %s: %s\n", ECHO_UNIX_PATH, neterr);
+                exit(1);
+            }
+            if ((conn = he_create_conn(el, fd, read_tcp_proc, close_tcp_proc, NULL)) == NULL) {
+                printf("Could not create client connection: %s\n", strerror(errno));
+                exit(1);
+            }
+            he_conn_write(conn, "hello", 6);
+        }
     }
     he_main(el);
     he_delete_event_loop(el);
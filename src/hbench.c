@@ -0,0 +1,624 @@
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "he.h"
+#include "he_acceptor.h"
+#include "he_conn.h"
+#include "he_udp.h"
+#include "he_stats.h"
+#include "hnet.h"
+
+#define UNUSED(V) ((void) V)
+
+#define BENCH_TICK_MS 1
+#define BENCH_UDP_VLEN 64
+#define BENCH_UDP_MAX_SIZE 65000
+/* An unanswered datagram older than this (usec) is counted as lost. */
+#define BENCH_UDP_TIMEOUT 200000
+#define BENCH_BACKLOG 4096
+
+typedef struct bench_config {
+    char *host;
+    int port;
+    int udp;
+    int server;
+    int embedded;
+    int conns;
+    int threads;
+    size_t size;
+    int pipeline;
+    long long rate;
+    int duration;
+    int backend;
+    int coalesce;
+    int busy_poll;
+    struct sockaddr_storage addr;
+} bench_config;
+
+struct bench_worker;
+
+typedef struct bench_flow {
+    struct bench_worker *worker;
+    int fd;
+    he_conn *conn;
+    he_udp *udp;
+    int outstanding;
+    long long last_active;
+} bench_flow;
+
+/* One loop and thread. A client worker drives nflows connections or UDP
+ * flows, a server worker echoes everything it receives. Each message
+ * starts with the time it was (or was meant to be) sent, so latency is
+ * measured from the echoed copy without per-message state. */
+typedef struct bench_worker {
+    pthread_t tid;
+    bench_config *cfg;
+    he_event_loop *el;
+    int listener;
+    he_acceptor *acceptor;
+    he_udp *server_udp;
+    bench_flow *flows;
+    int nflows;
+    int connected;
+    int next;
+    double rate;
+    long long start;
+    long long end;
+    long long last_expire;
+    unsigned long long scheduled;
+    unsigned long long sent;
+    unsigned long long received;
+    unsigned long long errors;
+    unsigned long long lost;
+    char *msg;
+    he_hist latency;
+} bench_worker;
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: hbench [options]\n"
+        "  -H <host>      server address (default 127.0.0.1)\n"
+        "  -p <port>      server port (default 8889)\n"
+        "  -c <conns>     connections or UDP flows (default 100)\n"
+        "  -t <threads>   loops/threads on each side (default 1)\n"
+        "  -d <size>      message size in bytes, at least 8 (default 64)\n"
+        "  -P <depth>     messages in flight per connection (default 1)\n"
+        "  -r <rate>      total messages per second, 0 for closed loop (default 0)\n"
+        "  -T <seconds>   test duration (default 10)\n"
+        "  -b <backend>   epoll or uring (default: build default)\n"
+        "  -u             UDP instead of TCP\n"
+        "  -C             coalesce writes once per loop iteration\n"
+        "  -B <usec>      busy-poll the loops and sockets for up to usec\n"
+        "  -s             only run the echo server\n"
+        "  -e             run the echo server in this process as well\n");
+    exit(1);
+}
+
+/* ---------------------------- Echo server ---------------------------- */
+
+static void server_read_proc(he_conn *conn, void *privdata)
+{
+    size_t len;
+    char *buf = he_conn_input(conn, &len);
+    UNUSED(privdata);
+
+    if (he_conn_write(conn, buf, len) == HE_ERR) return;
+    he_conn_consume(conn, len);
+}
+
+static void server_accept_proc(he_acceptor *acceptor, int *fds,
+    struct sockaddr_storage *addrs, int count, void *privdata)
+{
+    bench_worker *w = privdata;
+    he_conn *conn;
+    int i;
+    UNUSED(addrs);
+
+    for (i = 0; i < count; i++) {
+        conn = he_create_conn(acceptor->event_loop, fds[i], server_read_proc,
+            NULL, w);
+        if (conn == NULL) {
+            close(fds[i]);
+            continue;
+        }
+        if (w->cfg->coalesce) he_conn_set_coalesce(conn, 1);
+    }
+}
+
+static void server_udp_proc(he_udp *udp, struct mmsghdr *msgs, int count,
+    void *privdata)
+{
+    int i;
+    UNUSED(privdata);
+
+    for (i = 0; i < count; i++)
+        he_udp_send(udp, msgs[i].msg_hdr.msg_iov[0].iov_base, msgs[i].msg_len,
+            msgs[i].msg_hdr.msg_name);
+}
+
+static int server_setup(bench_worker *w)
+{
+    bench_config *cfg = w->cfg;
+    hnet_sockopts opts = {1, 0, 0, 0, cfg->busy_poll, 0};
+    char neterr[HNET_ERR_LEN];
+
+    if (cfg->udp) {
+        if ((w->listener = hnet_udp_server(neterr, cfg->port, NULL, 1)) == HNET_ERR ||
+            hnet_nonblock(neterr, w->listener) == HNET_ERR) {
+            fprintf(stderr, "Could not create UDP server socket: %s\n", neterr);
+            return -1;
+        }
+        w->server_udp = he_create_udp(w->el, w->listener, BENCH_UDP_VLEN,
+            BENCH_UDP_MAX_SIZE, server_udp_proc, w);
+        if (w->server_udp == NULL) {
+            fprintf(stderr, "Could not create UDP endpoint: %s\n", strerror(errno));
+            return -1;
+        }
+    } else {
+        if ((w->listener = hnet_tcp_server(neterr, cfg->port, NULL,
+            BENCH_BACKLOG, 1)) == HNET_ERR) {
+            fprintf(stderr, "Could not create TCP server socket: %s\n", neterr);
+            return -1;
+        }
+        w->acceptor = he_create_acceptor(w->el, w->listener, &opts,
+            server_accept_proc, w);
+        if (w->acceptor == NULL) {
+            fprintf(stderr, "Could not create acceptor: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------ Client ------------------------------ */
+
+static void bench_record(bench_worker *w, long long latency)
+{
+    w->received++;
+    he_hist_record(&w->latency, latency > 0 ? latency : 0);
+}
+
+static void bench_send(bench_flow *flow, long long stamp)
+{
+    bench_worker *w = flow->worker;
+    int ret;
+
+    memcpy(w->msg, &stamp, sizeof(stamp));
+    if (w->cfg->udp)
+        ret = he_udp_send(flow->udp, w->msg, w->cfg->size, NULL);
+    else
+        ret = he_conn_write(flow->conn, w->msg, w->cfg->size);
+    if (ret == HE_ERR) {
+        w->errors++;
+        return;
+    }
+    flow->outstanding++;
+    w->sent++;
+}
+
+static void bench_tcp_read(he_conn *conn, void *privdata)
+{
+    bench_flow *flow = privdata;
+    bench_worker *w = flow->worker;
+    size_t len, off, size = w->cfg->size;
+    char *buf = he_conn_input(conn, &len);
+    long long now = he_ustime(), stamp;
+    int n = 0;
+
+    for (off = 0; off + size <= len; off += size) {
+        memcpy(&stamp, buf + off, sizeof(stamp));
+        bench_record(w, now - stamp);
+        n++;
+    }
+    he_conn_consume(conn, off);
+    flow->outstanding -= n;
+    if (w->cfg->rate) return;
+    while (n-- && flow->conn) bench_send(flow, he_ustime());
+}
+
+static void bench_tcp_close(he_conn *conn, int err, void *privdata)
+{
+    bench_flow *flow = privdata;
+    UNUSED(conn);
+    UNUSED(err);
+
+    flow->conn = NULL;
+    flow->fd = -1;
+    flow->worker->errors++;
+    flow->worker->connected--;
+}
+
+static void bench_connect_handler(he_event_loop *el, int fd, void *privdata, int mask)
+{
+    bench_flow *flow = privdata;
+    bench_worker *w = flow->worker;
+    int i;
+    UNUSED(mask);
+
+    he_delete_file_event(el, fd, HE_WRITABLE);
+    if (hnet_get_sock_error(fd) != 0 ||
+        (flow->conn = he_create_conn(el, fd, bench_tcp_read, bench_tcp_close,
+        flow)) == NULL) {
+        close(fd);
+        flow->fd = -1;
+        w->errors++;
+        return;
+    }
+    hnet_enable_tcp_nodelay(NULL, fd);
+    if (w->cfg->busy_poll) hnet_set_busy_poll(NULL, fd, w->cfg->busy_poll);
+    if (w->cfg->coalesce) he_conn_set_coalesce(flow->conn, 1);
+    w->connected++;
+    if (w->cfg->rate) return;
+    for (i = 0; i < w->cfg->pipeline && flow->conn; i++)
+        bench_send(flow, he_ustime());
+}
+
+static void bench_udp_read(he_udp *udp, struct mmsghdr *msgs, int count,
+    void *privdata)
+{
+    bench_flow *flow = privdata;
+    bench_worker *w = flow->worker;
+    long long now = he_ustime(), stamp;
+    int i, n = 0;
+    UNUSED(udp);
+
+    for (i = 0; i < count; i++) {
+        if (msgs[i].msg_len < sizeof(stamp)) continue;
+        memcpy(&stamp, msgs[i].msg_hdr.msg_iov[0].iov_base, sizeof(stamp));
+        bench_record(w, now - stamp);
+        n++;
+    }
+    /* Replies to datagrams already counted as lost do not free a slot. */
+    if (n > flow->outstanding) n = flow->outstanding;
+    flow->outstanding -= n;
+    flow->last_active = now;
+    if (w->cfg->rate) return;
+    while (n--) bench_send(flow, he_ustime());
+}
+
+static bench_flow *bench_next_flow(bench_worker *w)
+{
+    int i;
+
+    for (i = 0; i < w->nflows; i++) {
+        bench_flow *flow = &w->flows[w->next];
+
+        w->next = (w->next + 1) % w->nflows;
+        if (flow->conn || flow->udp) return flow;
+    }
+    return NULL;
+}
+
+/* Open-loop mode: messages are stamped with the time they were due, not
+ * the time they went out, so a stalled loop shows up as latency instead
+ * of being hidden by sending less. */
+static void bench_schedule(bench_worker *w, long long now)
+{
+    unsigned long long due = (unsigned long long)((now - w->start) * w->rate / 1e6);
+    bench_flow *flow;
+
+    while (w->scheduled < due) {
+        long long stamp = w->start + (long long)(w->scheduled * 1e6 / w->rate);
+
+        w->scheduled++;
+        if ((flow = bench_next_flow(w)) != NULL) bench_send(flow, stamp);
+    }
+}
+
+static void bench_udp_expire(bench_worker *w, long long now)
+{
+    int i, j;
+
+    if (now - w->last_expire < BENCH_UDP_TIMEOUT / 2) return;
+    w->last_expire = now;
+    for (i = 0; i < w->nflows; i++) {
+        bench_flow *flow = &w->flows[i];
+
+        if (flow->udp == NULL || flow->outstanding == 0) continue;
+        if (now - flow->last_active < BENCH_UDP_TIMEOUT) continue;
+        w->lost += flow->outstanding;
+        flow->outstanding = 0;
+        flow->last_active = now;
+        if (w->cfg->rate) continue;
+        for (j = 0; j < w->cfg->pipeline; j++) bench_send(flow, now);
+    }
+}
+
+static long long bench_tick(he_event_loop *el, he_timer *timer, void *privdata)
+{
+    bench_worker *w = privdata;
+    long long now = he_ustime();
+    UNUSED(timer);
+
+    if (now - w->start >= w->cfg->duration * 1000000LL) {
+        w->end = now;
+        he_stop(el);
+        return HE_NOMORE;
+    }
+    if (w->rate > 0 && w->connected) bench_schedule(w, now);
+    if (w->cfg->udp) bench_udp_expire(w, now);
+    return BENCH_TICK_MS;
+}
+
+static int client_setup(bench_worker *w)
+{
+    bench_config *cfg = w->cfg;
+    char neterr[HNET_ERR_LEN];
+    int i, j;
+
+    if ((w->flows = calloc(w->nflows, sizeof(bench_flow))) == NULL ||
+        (w->msg = calloc(1, cfg->size)) == NULL)
+        return -1;
+    memset(w->msg, 'x', cfg->size);
+    for (i = 0; i < w->nflows; i++) {
+        bench_flow *flow = &w->flows[i];
+
+        flow->worker = w;
+        if (cfg->udp) {
+            if ((flow->fd = hnet_udp_connect(neterr, &cfg->addr)) == HNET_ERR) {
+                fprintf(stderr, "UDP connect: %s\n", neterr);
+                return -1;
+            }
+            if (cfg->busy_poll) hnet_set_busy_poll(NULL, flow->fd, cfg->busy_poll);
+            flow->udp = he_create_udp(w->el, flow->fd, BENCH_UDP_VLEN, cfg->size,
+                bench_udp_read, flow);
+            if (flow->udp == NULL) {
+                close(flow->fd);
+                return -1;
+            }
+            w->connected++;
+            for (j = 0; j < cfg->pipeline && !cfg->rate; j++)
+                bench_send(flow, he_ustime());
+        } else {
+            if ((flow->fd = hnet_tcp_nonblock_connect_addr(neterr, &cfg->addr))
+                == HNET_ERR) {
+                fprintf(stderr, "TCP connect: %s\n", neterr);
+                return -1;
+            }
+            if (he_create_file_event(w->el, flow->fd, HE_WRITABLE,
+                bench_connect_handler, flow) == HE_ERR) {
+                close(flow->fd);
+                return -1;
+            }
+        }
+    }
+    if (he_create_timer(w->el, BENCH_TICK_MS, bench_tick, w) == NULL) return -1;
+    return 0;
+}
+
+static void client_cleanup(bench_worker *w)
+{
+    int i;
+
+    for (i = 0; w->flows && i < w->nflows; i++) {
+        bench_flow *flow = &w->flows[i];
+
+        if (flow->udp) {
+            he_udp_close(flow->udp);
+        } else if (flow->conn) {
+            he_conn_close(flow->conn);
+        } else if (flow->fd > 0) {
+            he_delete_file_event(w->el, flow->fd, HE_WRITABLE);
+            close(flow->fd);
+        }
+    }
+    free(w->flows);
+    free(w->msg);
+}
+
+/* ------------------------------- Main ------------------------------- */
+
+static void *bench_thread(void *arg)
+{
+    bench_worker *w = arg;
+
+    w->start = he_ustime();
+    w->last_expire = w->start;
+    he_main(w->el);
+    return NULL;
+}
+
+static bench_worker *bench_start(bench_config *cfg, int server)
+{
+    bench_worker *workers;
+    int i;
+
+    if ((workers = calloc(cfg->threads, sizeof(bench_worker))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < cfg->threads; i++) {
+        bench_worker *w = &workers[i];
+
+        w->cfg = cfg;
+        w->listener = -1;
+        w->el = he_create_event_loop_backend(1024, 1000000, NULL, NULL, cfg->backend);
+        if (w->el == NULL) {
+            fprintf(stderr, "Failed creating the event loop: %s\n", strerror(errno));
+            exit(1);
+        }
+        he_set_busy_poll(w->el, cfg->busy_poll);
+        if (server) {
+            if (server_setup(w) == -1) exit(1);
+        } else {
+            w->nflows = cfg->conns / cfg->threads + (i < cfg->conns % cfg->threads);
+            w->rate = (double)cfg->rate / cfg->threads;
+            if (w->nflows == 0) continue;
+            if (client_setup(w) == -1) {
+                fprintf(stderr, "Client setup failed: %s\n", strerror(errno));
+                exit(1);
+            }
+        }
+    }
+    for (i = 0; i < cfg->threads; i++) {
+        if (!server && workers[i].nflows == 0) continue;
+        if (pthread_create(&workers[i].tid, NULL, bench_thread, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start thread\n");
+            exit(1);
+        }
+    }
+    return workers;
+}
+
+static void bench_report(bench_config *cfg, bench_worker *workers)
+{
+    unsigned long long sent = 0, received = 0, errors = 0, lost = 0;
+    unsigned long long busy_hits = 0, busy_sleeps = 0;
+    long long start = 0, end = 0;
+    double secs;
+    he_hist *latency = calloc(1, sizeof(he_hist));
+    int i;
+
+    if (latency == NULL) return;
+    for (i = 0; i < cfg->threads; i++) {
+        bench_worker *w = &workers[i];
+
+        if (w->nflows == 0) continue;
+        sent += w->sent;
+        received += w->received;
+        errors += w->errors;
+        lost += w->lost;
+        busy_hits += w->el->busy_hits;
+        busy_sleeps += w->el->busy_sleeps;
+        he_hist_merge(latency, &w->latency);
+        if (start == 0 || w->start < start) start = w->start;
+        if (w->end > end) end = w->end;
+    }
+    secs = (end - start) / 1e6;
+    printf("%s %s: %d %s, %d threads, %zu byte messages, ",
+        he_get_backend_name(workers[0].el), cfg->udp ? "udp" : "tcp",
+        cfg->conns, cfg->udp ? "flows" : "connections", cfg->threads, cfg->size);
+    if (cfg->rate)
+        printf("%lld msg/s offered%s\n", cfg->rate, cfg->coalesce ? ", coalesced" : "");
+    else
+        printf("pipeline %d%s\n", cfg->pipeline, cfg->coalesce ? ", coalesced" : "");
+    printf("duration %.2fs, sent %llu, received %llu, errors %llu, lost %llu\n",
+        secs, sent, received, errors, lost);
+    printf("throughput %.0f msg/s, %.2f MB/s\n", received / secs,
+        received * cfg->size / secs / (1024 * 1024));
+    printf("latency usec: min %llu avg %.1f p50 %llu p99 %llu p99.9 %llu max %llu\n",
+        latency->min, latency->count ? (double)latency->sum / latency->count : 0,
+        he_hist_percentile(latency, 50), he_hist_percentile(latency, 99),
+        he_hist_percentile(latency, 99.9), latency->max);
+    if (cfg->busy_poll)
+        printf("busy poll %d usec: %llu spin hits, %llu sleeps\n", cfg->busy_poll,
+            busy_hits, busy_sleeps);
+    free(latency);
+}
+
+static void bench_resolve(bench_config *cfg)
+{
+    struct addrinfo hints, *info;
+    char port[16];
+    int rv;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = cfg->udp ? SOCK_DGRAM : SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", cfg->port);
+    if ((rv = getaddrinfo(cfg->host, port, &hints, &info)) != 0) {
+        fprintf(stderr, "Could not resolve %s: %s\n", cfg->host, gai_strerror(rv));
+        exit(1);
+    }
+    memcpy(&cfg->addr, info->ai_addr, info->ai_addrlen);
+    freeaddrinfo(info);
+}
+
+/* Thousands of connections need more than the usual 1024 fds. */
+static void bench_raise_nofile(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bench_config cfg;
+    bench_worker *servers = NULL, *clients;
+    int opt, i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.host = "127.0.0.1";
+    cfg.port = 8889;
+    cfg.conns = 100;
+    cfg.threads = 1;
+    cfg.size = 64;
+    cfg.pipeline = 1;
+    cfg.duration = 10;
+    cfg.backend = HE_BACKEND_DEFAULT;
+    while ((opt = getopt(argc, argv, "H:p:c:t:d:P:r:T:b:B:uCse")) != -1) {
+        switch (opt) {
+        case 'H': cfg.host = optarg; break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'c': cfg.conns = atoi(optarg); break;
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'd': cfg.size = strtoul(optarg, NULL, 10); break;
+        case 'P': cfg.pipeline = atoi(optarg); break;
+        case 'r': cfg.rate = strtoll(optarg, NULL, 10); break;
+        case 'T': cfg.duration = atoi(optarg); break;
+        case 'b':
+            if (!strcasecmp(optarg, "epoll")) cfg.backend = HE_BACKEND_EPOLL;
+            else if (!strcasecmp(optarg, "uring")) cfg.backend = HE_BACKEND_URING;
+            else usage();
+            break;
+        case 'u': cfg.udp = 1; break;
+        case 'C': cfg.coalesce = 1; break;
+        case 'B': cfg.busy_poll = atoi(optarg); break;
+        case 's': cfg.server = 1; break;
+        case 'e': cfg.embedded = 1; break;
+        default: usage();
+        }
+    }
+    if (cfg.conns <= 0 || cfg.threads <= 0 || cfg.pipeline <= 0 ||
+        cfg.duration <= 0 || cfg.rate < 0 || cfg.busy_poll < 0 ||
+        cfg.size < sizeof(long long) ||
+        (cfg.udp && cfg.size > BENCH_UDP_MAX_SIZE))
+        usage();
+
+    signal(SIGPIPE, SIG_IGN);
+    bench_raise_nofile();
+    if (cfg.server || cfg.embedded) servers = bench_start(&cfg, 1);
+    if (cfg.server) {
+        for (i = 0; i < cfg.threads; i++) pthread_join(servers[i].tid, NULL);
+        return 0;
+    }
+
+    bench_resolve(&cfg);
+    clients = bench_start(&cfg, 0);
+    for (i = 0; i < cfg.threads; i++)
+        if (clients[i].nflows) pthread_join(clients[i].tid, NULL);
+    bench_report(&cfg, clients);
+    for (i = 0; i < cfg.threads; i++) {
+        client_cleanup(&clients[i]);
+        he_delete_event_loop(clients[i].el);
+    }
+    free(clients);
+
+    if (servers) {
+        for (i = 0; i < cfg.threads; i++) he_stop(servers[i].el);
+        for (i = 0; i < cfg.threads; i++) pthread_join(servers[i].tid, NULL);
+        for (i = 0; i < cfg.threads; i++) {
+            if (servers[i].acceptor) he_acceptor_close(servers[i].acceptor);
+            if (servers[i].server_udp) he_udp_close(servers[i].server_udp);
+            he_delete_event_loop(servers[i].el);
+        }
+        free(servers);
+    }
+    return 0;
+}
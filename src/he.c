@@ -1,3 +1,5 @@
+#include "fmacros.h"
+
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -7,9 +9,42 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <ctype.h>
 
 #include "he.h"
+#include "he_pool.h"
+#include "he_stats.h"
+
+/* Readiness backend. add_event/del_event receive the fd's mask before the
+ * change is applied to event_loop->events. resize is called before the
+ * loop's own tables change and must leave the backend untouched if it
+ * fails. */
+typedef struct he_api {
+    const char *name;
+    int (*create)(he_event_loop *event_loop);
+    void (*free)(he_event_loop *event_loop);
+    int (*add_event)(he_event_loop *event_loop, int fd, int mask);
+    void (*del_event)(he_event_loop *event_loop, int fd, int delmask);
+    int (*poll)(he_event_loop *event_loop, int timeout);
+    int (*resize)(he_event_loop *event_loop, int setsize, int maxevents);
+} he_api;
+
 #include "he_epoll.c"
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HE_HAVE_URING
+#include "he_uring.c"
+#endif
+#endif
+
+#ifndef HE_DEFAULT_BACKEND
+#define HE_DEFAULT_BACKEND HE_BACKEND_EPOLL
+#endif
 
 static void he_get_time(long *seconds, long *milliseconds)
 {
@@ -20,6 +55,14 @@ static void he_get_time(long *seconds, long *milliseconds)
     *milliseconds = tv.tv_usec / 1000;
 }
 
+static long long he_mstime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void he_add_milliseconds_to_now(long long milliseconds, long *sec, long *ms) 
 {
     long cur_sec, cur_ms, when_sec, when_ms;
@@ -35,26 +78,345 @@ static void he_add_milliseconds_to_now(long long milliseconds, long *sec, long *
     *ms = when_ms;
 }
 
+#define HE_POST_BATCH 1024
+#define HE_TASK_ALLOC (1<<0)
+#define HE_TASK_DEFERRED (1<<1)
+
+/* Intrusive multi-producer/single-consumer queue (Vyukov). Producers only
+ * swap head; the loop thread owns tail. The eventfd wakes epoll_wait and
+ * pending collapses bursts of posts into a single write. */
+typedef struct he_post_queue {
+    he_task *head;
+    he_task *tail;
+    he_task stub;
+    int pending;
+    int efd;
+} he_post_queue;
+
+static void he_post_push(he_post_queue *q, he_task *task)
+{
+    he_task *prev;
+
+    __atomic_store_n(&task->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->head, task, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+static he_task *he_post_pop(he_post_queue *q)
+{
+    he_task *tail = q->tail;
+    he_task *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (next == NULL) return NULL;
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    /* A producer is between its head swap and linking prev->next; it will
+     * wake the loop again once done. */
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) return NULL;
+    he_post_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void he_post_wakeup(he_post_queue *q)
+{
+    uint64_t one = 1;
+    ssize_t nwritten;
+
+    nwritten = write(q->efd, &one, sizeof(one));
+    HE_NOTUSED(nwritten);
+}
+
+static int he_process_posted(he_event_loop *event_loop)
+{
+    he_post_queue *q = event_loop->post;
+    he_task *task;
+    int processed = 0;
+
+    while (processed < HE_POST_BATCH && (task = he_post_pop(q)) != NULL) {
+        he_post_proc *proc = task->proc;
+        void *arg = task->arg;
+
+        if (task->flags & HE_TASK_ALLOC) free(task);
+        proc(event_loop, arg);
+        processed++;
+    }
+    if (processed == HE_POST_BATCH) {
+        __atomic_store_n(&q->pending, 1, __ATOMIC_SEQ_CST);
+        he_post_wakeup(q);
+    }
+    return processed;
+}
+
+static void he_post_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask)
+{
+    he_post_queue *q = client_data;
+    uint64_t value;
+    ssize_t nread;
+    HE_NOTUSED(mask);
+
+    nread = read(fd, &value, sizeof(value));
+    HE_NOTUSED(nread);
+    __atomic_store_n(&q->pending, 0, __ATOMIC_SEQ_CST);
+    he_process_posted(event_loop);
+}
+
+static int he_post_create(he_event_loop *event_loop)
+{
+    he_post_queue *q;
+
+    if ((q = malloc(sizeof(*q))) == NULL) return HE_ERR;
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+    q->pending = 0;
+    if ((q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        free(q);
+        return HE_ERR;
+    }
+    event_loop->post = q;
+    if (he_create_file_event(event_loop, q->efd, HE_READABLE,
+        he_post_handler, q) == HE_ERR) {
+        close(q->efd);
+        free(q);
+        event_loop->post = NULL;
+        return HE_ERR;
+    }
+    return HE_OK;
+}
+
+static void he_post_free(he_event_loop *event_loop)
+{
+    he_post_queue *q = event_loop->post;
+    he_task *task;
+
+    while ((task = he_post_pop(q)) != NULL) {
+        if (task->flags & HE_TASK_ALLOC) free(task);
+        else if (task->drop) task->drop(event_loop, task->arg);
+    }
+    he_delete_file_event(event_loop, q->efd, HE_READABLE);
+    close(q->efd);
+    free(q);
+}
+
+static void he_post_enqueue(he_post_queue *q, he_task *task)
+{
+    he_post_push(q, task);
+    if (__atomic_exchange_n(&q->pending, 1, __ATOMIC_SEQ_CST) == 0)
+        he_post_wakeup(q);
+}
+
+int he_post_task(he_event_loop *event_loop, he_task *task)
+{
+    task->flags = 0;
+    he_post_enqueue(event_loop->post, task);
+    return HE_OK;
+}
+
+int he_post(he_event_loop *event_loop, he_post_proc *proc, void *arg)
+{
+    he_task *task;
+
+    if ((task = malloc(sizeof(*task))) == NULL) return HE_ERR;
+    task->proc = proc;
+    task->drop = NULL;
+    task->arg = arg;
+    task->flags = HE_TASK_ALLOC;
+    he_post_enqueue(event_loop->post, task);
+    return HE_OK;
+}
+
+/* Accounts a callback that started at start (he_ustime). The callback
+ * itself may have turned stats off. */
+static void he_stats_callback(he_event_loop *event_loop, he_slow_event *ev,
+    long long start)
+{
+    he_loop_stats *stats = event_loop->stats;
+
+    if (stats == NULL) return;
+    ev->usec = he_ustime() - start;
+    stats->callbacks++;
+    he_hist_record(&stats->callback, ev->usec);
+    if (stats->slow_usec && ev->usec >= stats->slow_usec) {
+        stats->slow_callbacks++;
+        if (stats->slow_proc) stats->slow_proc(event_loop, ev, stats->slow_data);
+    }
+}
+
+/* Deferred tasks run once per iteration, before the loop goes to sleep,
+ * so work queued by every handler of a pass (typically output) can be
+ * done in one go. Queueing is loop-thread only; a task already queued is
+ * not queued twice. */
+int he_defer(he_event_loop *event_loop, he_task *task)
+{
+    if (task->flags & HE_TASK_DEFERRED) return HE_OK;
+    task->flags = HE_TASK_DEFERRED;
+    task->next = NULL;
+    if (event_loop->defer_tail)
+        event_loop->defer_tail->next = task;
+    else
+        event_loop->defer_head = task;
+    event_loop->defer_tail = task;
+    return HE_OK;
+}
+
+static int he_defer_unlink(he_task **head, he_task **tail, he_task *task)
+{
+    he_task *prev = NULL, *t;
+
+    for (t = *head; t; prev = t, t = t->next) {
+        if (t != task) continue;
+        if (prev) prev->next = t->next; else *head = t->next;
+        if (tail && *tail == t) *tail = prev;
+        return 1;
+    }
+    return 0;
+}
+
+/* Must be called before freeing a task that may still be queued. */
+void he_cancel_defer(he_event_loop *event_loop, he_task *task)
+{
+    if (!(task->flags & HE_TASK_DEFERRED)) return;
+    if (!he_defer_unlink(&event_loop->defer_head, &event_loop->defer_tail, task))
+        he_defer_unlink(&event_loop->defer_running, NULL, task);
+    task->flags &= ~HE_TASK_DEFERRED;
+}
+
+/* Only runs what was queued before the call; tasks deferred by a running
+ * proc wait for the next iteration, which then does not block. */
+static int he_process_deferred(he_event_loop *event_loop)
+{
+    he_task *task;
+    int processed = 0;
+
+    event_loop->defer_running = event_loop->defer_head;
+    event_loop->defer_head = event_loop->defer_tail = NULL;
+    while ((task = event_loop->defer_running) != NULL) {
+        event_loop->defer_running = task->next;
+        task->flags &= ~HE_TASK_DEFERRED;
+        if (event_loop->stats) {
+            he_slow_event ev = { -1, HE_NONE, NULL, NULL, task->proc, task->arg, 0 };
+            long long start = he_ustime();
+
+            task->proc(event_loop, task->arg);
+            he_stats_callback(event_loop, &ev, start);
+        } else {
+            task->proc(event_loop, task->arg);
+        }
+        processed++;
+    }
+    return processed;
+}
+
+void he_set_before_sleep(he_event_loop *event_loop, he_hook_proc *proc,
+    void *client_data)
+{
+    event_loop->before_sleep = proc;
+    event_loop->before_sleep_data = client_data;
+}
+
+void he_set_after_poll(he_event_loop *event_loop, he_hook_proc *proc,
+    void *client_data)
+{
+    event_loop->after_poll = proc;
+    event_loop->after_poll_data = client_data;
+}
+
+static const he_api *he_get_api(int backend)
+{
+    if (backend == HE_BACKEND_DEFAULT) backend = HE_DEFAULT_BACKEND;
+    switch (backend) {
+    case HE_BACKEND_EPOLL:
+        return &he_epoll_api;
+#ifdef HE_HAVE_URING
+    case HE_BACKEND_URING:
+        return &he_uring_api;
+#endif
+    default:
+        return NULL;
+    }
+}
+
 he_event_loop *he_create_event_loop(int setsize, long long update_ms,
     he_update_proc *proc, void *client_data) 
 {
-    he_event_loop *event_loop;
+    return he_create_event_loop_backend(setsize, update_ms, proc, client_data,
+        HE_BACKEND_DEFAULT);
+}
+
+he_event_loop *he_create_event_loop_backend(int setsize, long long update_ms,
+    he_update_proc *proc, void *client_data, int backend)
+{
+    he_event_loop *event_loop = NULL;
+    const he_api *api;
     int i;
 
+    if ((api = he_get_api(backend)) == NULL) {
+        errno = ENOSYS;
+        return NULL;
+    }
+    if (setsize < 1) setsize = 1;
     if ((event_loop = malloc(sizeof(*event_loop))) == NULL) goto err;
+    event_loop->maxevents = setsize < HE_DEFAULT_MAX_EVENTS ?
+        setsize : HE_DEFAULT_MAX_EVENTS;
     event_loop->events = malloc(sizeof(he_file_event) * setsize);
-    event_loop->fired = malloc(sizeof(he_fired_event) * setsize);
+    event_loop->fired = malloc(sizeof(he_fired_event) * event_loop->maxevents);
     if (event_loop->events == NULL || event_loop->fired == NULL) goto err;
     he_add_milliseconds_to_now(update_ms, &event_loop->ui.when_sec, &event_loop->ui.when_ms);
     event_loop->ui.update_ms = update_ms;
     event_loop->ui.last_time = time(NULL);
     event_loop->ui.proc = proc;
     event_loop->ui.client_data = client_data;
+    event_loop->timers = NULL;
+    event_loop->timers_count = 0;
+    event_loop->timers_size = 0;
+    event_loop->timers_seq = 0;
+    event_loop->post = NULL;
+    event_loop->defer_head = NULL;
+    event_loop->defer_tail = NULL;
+    event_loop->defer_running = NULL;
+    event_loop->before_sleep = NULL;
+    event_loop->before_sleep_data = NULL;
+    event_loop->after_poll = NULL;
+    event_loop->after_poll_data = NULL;
+    event_loop->ready = NULL;
+    event_loop->nready = 0;
+    event_loop->ready_size = 0;
+    event_loop->default_mask = HE_NONE;
+    event_loop->pool = NULL;
+    event_loop->stats = NULL;
+    event_loop->busy_poll_usec = 0;
+    event_loop->busy_hits = 0;
+    event_loop->busy_sleeps = 0;
+    event_loop->ctl_errors = 0;
+    event_loop->pinned = 0;
+    he_loop_update_cpu(event_loop);
+    event_loop->maxfd = -1;
     event_loop->setsize = setsize;
     event_loop->stop = 0;
-    if (he_api_create(event_loop) == -1) goto err;
-    for (i = 0; i < setsize; i++)
+    event_loop->api = api;
+    if (api->create(event_loop) == -1) goto err;
+    for (i = 0; i < setsize; i++) {
         event_loop->events[i].mask = HE_NONE;
+        event_loop->events[i].ready = HE_NONE;
+        event_loop->events[i].gen = 0;
+    }
+    if (he_post_create(event_loop) == HE_ERR) {
+        api->free(event_loop);
+        goto err;
+    }
     return event_loop;
 
 err:
@@ -68,42 +430,556 @@ err:
 
 void he_delete_event_loop(he_event_loop *event_loop) 
 {
-    he_api_free(event_loop);
+    int i;
+
+    for (i = 0; i < event_loop->timers_count; i++)
+        free(event_loop->timers[i]);
+    free(event_loop->timers);
+    he_post_free(event_loop);
+    event_loop->api->free(event_loop);
+    free(event_loop->ready);
+    if (event_loop->pool) he_delete_pool(event_loop->pool);
+    free(event_loop->stats);
     free(event_loop->events);
     free(event_loop->fired);
     free(event_loop);
 }
 
+/* Pins the calling thread to the given CPUs. Memory the thread touches
+ * first afterwards is placed on their NUMA node by the kernel. */
+int he_set_thread_affinity(const int *cpus, int ncpus)
+{
+    cpu_set_t set;
+    int i;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < ncpus; i++)
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+    if (CPU_COUNT(&set) == 0) {
+        errno = EINVAL;
+        return HE_ERR;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) return HE_ERR;
+    return HE_OK;
+}
+
+/* NUMA node of cpu as reported by sysfs, -1 if unknown. */
+int he_get_cpu_node(int cpu)
+{
+    char path[64];
+    DIR *dir;
+    struct dirent *de;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(path)) == NULL) return -1;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strncmp(de->d_name, "node", 4) && isdigit((unsigned char)de->d_name[4])) {
+            node = atoi(de->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/* Records the CPU the calling thread runs on, and its node, in cpu and
+ * numa_node. Done when the loop is created and when it starts running; a
+ * loop whose thread is not pinned may move afterwards. */
+void he_loop_update_cpu(he_event_loop *event_loop)
+{
+    event_loop->cpu = sched_getcpu();
+    event_loop->numa_node = event_loop->cpu >= 0 ?
+        he_get_cpu_node(event_loop->cpu) : -1;
+}
+
+/* Pins the calling thread, which must be the one running event_loop, to
+ * cpus and binds the loop's buffer pool to the node it then runs on. The fd table and
+ * fired array stay where they were first touched, so for full locality
+ * create the loop from an already pinned thread (see
+ * he_create_loop_group_cpus). */
+int he_pin_loop(he_event_loop *event_loop, const int *cpus, int ncpus)
+{
+    if (he_set_thread_affinity(cpus, ncpus) == HE_ERR) return HE_ERR;
+    event_loop->pinned = 1;
+    he_loop_update_cpu(event_loop);
+    if (event_loop->pool) he_pool_set_node(event_loop->pool, event_loop->numa_node);
+    return HE_OK;
+}
+
+const char *he_get_backend_name(he_event_loop *event_loop)
+{
+    return event_loop->api->name;
+}
+
+/* Resize the fd table. Fails with EBUSY if an fd >= setsize is still
+ * registered. Tables also grow by themselves as file events are created,
+ * so this is only needed to preallocate or to give memory back. */
+int he_resize_setsize(he_event_loop *event_loop, int setsize)
+{
+    he_file_event *events;
+    int i;
+
+    if (setsize == event_loop->setsize) return HE_OK;
+    if (setsize < 1 || event_loop->maxfd >= setsize) {
+        errno = setsize < 1 ? EINVAL : EBUSY;
+        return HE_ERR;
+    }
+    if (event_loop->api->resize(event_loop, setsize, event_loop->maxevents) == -1)
+        return HE_ERR;
+    events = realloc(event_loop->events, sizeof(he_file_event) * setsize);
+    if (events == NULL) {
+        /* A failed shrink keeps the larger table, which is still valid. */
+        if (setsize < event_loop->setsize) {
+            event_loop->setsize = setsize;
+            return HE_OK;
+        }
+        return HE_ERR;
+    }
+    for (i = event_loop->setsize; i < setsize; i++) {
+        events[i].mask = HE_NONE;
+        events[i].ready = HE_NONE;
+        events[i].gen = 0;
+    }
+    event_loop->events = events;
+    event_loop->setsize = setsize;
+    return HE_OK;
+}
+
+/* Bound the number of events returned by one poll call. Must not be
+ * called from a file event handler. */
+int he_set_max_events(he_event_loop *event_loop, int maxevents)
+{
+    he_fired_event *fired;
+
+    if (maxevents < 1) {
+        errno = EINVAL;
+        return HE_ERR;
+    }
+    if (maxevents == event_loop->maxevents) return HE_OK;
+    fired = realloc(event_loop->fired, sizeof(he_fired_event) * maxevents);
+    if (fired == NULL) return HE_ERR;
+    event_loop->fired = fired;
+    if (event_loop->api->resize(event_loop, event_loop->setsize, maxevents) == -1) {
+        if (maxevents > event_loop->maxevents) return HE_ERR;
+    }
+    event_loop->maxevents = maxevents;
+    return HE_OK;
+}
+
+static int he_grow_setsize(he_event_loop *event_loop, int fd)
+{
+    int setsize = event_loop->setsize;
+
+    while (setsize <= fd) {
+        if (setsize > INT_MAX / 2) {
+            setsize = fd + 1;
+            break;
+        }
+        setsize *= 2;
+    }
+    return he_resize_setsize(event_loop, setsize);
+}
+
 void he_stop(he_event_loop *event_loop) 
 {
-    event_loop->stop = 1;
+    __atomic_store_n(&event_loop->stop, 1, __ATOMIC_RELEASE);
+    he_post_wakeup(event_loop->post);
 }
 
 int he_create_file_event(he_event_loop *event_loop, int fd, int mask,
     he_file_proc *proc, void *client_data)
 {
-    if (fd >= event_loop->setsize) {
+    he_file_event *fe;
+    int added;
+
+    if (fd < 0) {
         errno = ERANGE;
         return HE_ERR;
     }
-    he_file_event *fe = &event_loop->events[fd];
+    if (fd >= event_loop->setsize && he_grow_setsize(event_loop, fd) == HE_ERR)
+        return HE_ERR;
+    fe = &event_loop->events[fd];
 
-    if (he_api_add_event(event_loop, fd, mask) == -1)
+    if (fe->mask == HE_NONE) mask |= event_loop->default_mask;
+    added = mask & ~fe->mask & (HE_READABLE|HE_WRITABLE);
+    if (event_loop->api->add_event(event_loop, fd, mask) == -1)
         return HE_ERR;
+    /* The kernel only reports an edge on a state change, so a direction
+     * enabled on a live edge-triggered fd is dispatched once right away
+     * and its handler drains it until EAGAIN as usual. */
+    if ((fe->mask & HE_EDGE) && added)
+        he_set_file_ready(event_loop, fd, added);
     fe->mask |= mask;
     if (mask & HE_READABLE) fe->rfile_proc = proc;
     if (mask & HE_WRITABLE) fe->wfile_proc = proc;
     fe->client_data = client_data;
+    if (fd > event_loop->maxfd) event_loop->maxfd = fd;
     return HE_OK;
 }
 
 void he_delete_file_event(he_event_loop *event_loop, int fd, int mask)
 {
-    if (fd >= event_loop->setsize) return;
+    if (fd < 0 || fd >= event_loop->setsize) return;
     he_file_event *fe = &event_loop->events[fd];
     if (fe->mask == HE_NONE) return;
-    he_api_del_event(event_loop, fd, mask);
+    event_loop->api->del_event(event_loop, fd, mask);
     fe->mask = fe->mask & (~mask);
+    if ((fe->mask & (HE_READABLE|HE_WRITABLE)) == HE_NONE) {
+        fe->mask = HE_NONE;
+        fe->ready = HE_NONE;
+        fe->gen++;
+        if (fd == event_loop->maxfd) {
+            int j;
+
+            for (j = event_loop->maxfd - 1; j >= 0; j--)
+                if (event_loop->events[j].mask != HE_NONE) break;
+            event_loop->maxfd = j;
+        }
+    }
+}
+
+/* Returns the handle of the current registration of fd, or
+ * HE_HANDLE_NONE if nothing is registered for it. */
+he_handle he_get_file_handle(he_event_loop *event_loop, int fd)
+{
+    if (fd < 0 || fd >= event_loop->setsize) return HE_HANDLE_NONE;
+    if (event_loop->events[fd].mask == HE_NONE) return HE_HANDLE_NONE;
+    return HE_HANDLE(fd, event_loop->events[fd].gen);
+}
+
+/* True while the registration the handle was taken from is alive, even if
+ * the fd number has been closed and reused in the meantime. */
+int he_handle_valid(he_event_loop *event_loop, he_handle handle)
+{
+    int fd = HE_HANDLE_FD(handle);
+
+    if (handle == HE_HANDLE_NONE) return 0;
+    if (fd < 0 || fd >= event_loop->setsize) return 0;
+    return event_loop->events[fd].mask != HE_NONE &&
+        event_loop->events[fd].gen == HE_HANDLE_GEN(handle);
+}
+
+#define HE_TIMER_FIRING (1<<0)
+#define HE_TIMER_DELETED (1<<1)
+#define HE_TIMER_RESET (1<<2)
+
+static int he_timer_before(he_timer *a, he_timer *b)
+{
+    if (a->when != b->when) return a->when < b->when;
+    return a->seq < b->seq;
+}
+
+static void he_timer_set(he_event_loop *event_loop, int index, he_timer *timer)
+{
+    event_loop->timers[index] = timer;
+    timer->index = index;
+}
+
+static void he_timer_sift_up(he_event_loop *event_loop, int index)
+{
+    he_timer *timer = event_loop->timers[index];
+
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+
+        if (!he_timer_before(timer, event_loop->timers[parent])) break;
+        he_timer_set(event_loop, index, event_loop->timers[parent]);
+        index = parent;
+    }
+    he_timer_set(event_loop, index, timer);
+}
+
+static void he_timer_sift_down(he_event_loop *event_loop, int index)
+{
+    he_timer *timer = event_loop->timers[index];
+    int count = event_loop->timers_count;
+
+    while (1) {
+        int child = index * 2 + 1;
+
+        if (child >= count) break;
+        if (child + 1 < count &&
+            he_timer_before(event_loop->timers[child + 1], event_loop->timers[child]))
+            child++;
+        if (!he_timer_before(event_loop->timers[child], timer)) break;
+        he_timer_set(event_loop, index, event_loop->timers[child]);
+        index = child;
+    }
+    he_timer_set(event_loop, index, timer);
+}
+
+static int he_timer_insert(he_event_loop *event_loop, he_timer *timer)
+{
+    if (event_loop->timers_count == event_loop->timers_size) {
+        int size = event_loop->timers_size ? event_loop->timers_size * 2 : 64;
+        he_timer **timers = realloc(event_loop->timers, sizeof(he_timer*) * size);
+
+        if (timers == NULL) return HE_ERR;
+        event_loop->timers = timers;
+        event_loop->timers_size = size;
+    }
+    timer->seq = event_loop->timers_seq++;
+    he_timer_set(event_loop, event_loop->timers_count++, timer);
+    he_timer_sift_up(event_loop, timer->index);
+    return HE_OK;
+}
+
+static void he_timer_remove(he_event_loop *event_loop, he_timer *timer)
+{
+    int index = timer->index;
+    he_timer *last;
+
+    if (index == -1) return;
+    timer->index = -1;
+    last = event_loop->timers[--event_loop->timers_count];
+    if (last == timer) return;
+    he_timer_set(event_loop, index, last);
+    if (index > 0 && he_timer_before(last, event_loop->timers[(index - 1) / 2]))
+        he_timer_sift_up(event_loop, index);
+    else
+        he_timer_sift_down(event_loop, index);
+}
+
+/* Moves a timer that is in the heap to its new deadline in place, so
+ * unlike a remove and insert it can never fail. The new seq keeps a timer
+ * rescheduled from its own proc out of the current timer pass. */
+static void he_timer_update(he_event_loop *event_loop, he_timer *timer, long long when)
+{
+    int index = timer->index;
+
+    timer->when = when;
+    timer->seq = event_loop->timers_seq++;
+    if (index > 0 && he_timer_before(timer, event_loop->timers[(index - 1) / 2]))
+        he_timer_sift_up(event_loop, index);
+    else
+        he_timer_sift_down(event_loop, index);
+}
+
+he_timer *he_create_timer(he_event_loop *event_loop, long long ms,
+    he_timer_proc *proc, void *client_data)
+{
+    he_timer *timer;
+
+    if ((timer = malloc(sizeof(*timer))) == NULL) return NULL;
+    timer->when = he_mstime() + (ms > 0 ? ms : 0);
+    timer->index = -1;
+    timer->flags = 0;
+    timer->proc = proc;
+    timer->client_data = client_data;
+    if (he_timer_insert(event_loop, timer) == HE_ERR) {
+        free(timer);
+        return NULL;
+    }
+    return timer;
+}
+
+void he_delete_timer(he_event_loop *event_loop, he_timer *timer)
+{
+    he_timer_remove(event_loop, timer);
+    if (timer->flags & HE_TIMER_FIRING) {
+        timer->flags |= HE_TIMER_DELETED;
+        return;
+    }
+    free(timer);
+}
+
+/* A reset from the timer's own proc wins over the proc's return value. */
+int he_reset_timer(he_event_loop *event_loop, he_timer *timer, long long ms)
+{
+    if (timer->flags & HE_TIMER_DELETED) return HE_ERR;
+    he_timer_update(event_loop, timer, he_mstime() + (ms > 0 ? ms : 0));
+    if (timer->flags & HE_TIMER_FIRING) timer->flags |= HE_TIMER_RESET;
+    return HE_OK;
+}
+
+static long long he_timers_timeout(he_event_loop *event_loop, long long ms)
+{
+    long long delta;
+
+    if (event_loop->timers_count == 0) return ms;
+    delta = event_loop->timers[0]->when - he_mstime();
+    if (delta < 0) delta = 0;
+    return delta < ms ? delta : ms;
+}
+
+/* Only timers scheduled before this pass started are run, so a timer that
+ * re-arms itself with a zero delay waits for the next iteration instead of
+ * spinning here forever. A firing timer stays in the heap, so re-arming it
+ * needs no allocation and cannot fail. */
+static int he_process_timers(he_event_loop *event_loop)
+{
+    int processed = 0;
+    long long now = he_mstime(), ms;
+    unsigned long long maxseq = event_loop->timers_seq;
+
+    while (event_loop->timers_count) {
+        he_timer *timer = event_loop->timers[0];
+
+        if (timer->when > now || timer->seq >= maxseq) break;
+        timer->flags |= HE_TIMER_FIRING;
+        if (event_loop->stats) {
+            he_slow_event ev = { -1, HE_NONE, NULL, timer->proc, NULL,
+                timer->client_data, 0 };
+            long long start = he_ustime();
+
+            if (start > timer->when * 1000)
+                he_hist_record(&event_loop->stats->timer_lateness,
+                    start - timer->when * 1000);
+            ms = timer->proc(event_loop, timer, timer->client_data);
+            he_stats_callback(event_loop, &ev, start);
+        } else {
+            ms = timer->proc(event_loop, timer, timer->client_data);
+        }
+        timer->flags &= ~HE_TIMER_FIRING;
+        processed++;
+        if (timer->flags & HE_TIMER_DELETED) {
+            free(timer);
+        } else if (timer->flags & HE_TIMER_RESET) {
+            timer->flags &= ~HE_TIMER_RESET;
+        } else if (ms == HE_NOMORE) {
+            he_timer_remove(event_loop, timer);
+            free(timer);
+        } else {
+            he_timer_update(event_loop, timer, he_mstime() + (ms > 0 ? ms : 0));
+        }
+    }
+    return processed;
+}
+
+/* Queue fd for dispatch on the next iteration without waiting for the
+ * kernel. Edge-triggered handlers that stop before EAGAIN, e.g. to bound
+ * the work done per wakeup, use it to be called again. */
+int he_set_file_ready(he_event_loop *event_loop, int fd, int mask)
+{
+    he_file_event *fe;
+
+    if (fd < 0 || fd >= event_loop->setsize) {
+        errno = ERANGE;
+        return HE_ERR;
+    }
+    fe = &event_loop->events[fd];
+    mask &= HE_READABLE|HE_WRITABLE;
+    if (fe->ready == HE_NONE) {
+        if (event_loop->nready == event_loop->ready_size) {
+            int size = event_loop->ready_size ? event_loop->ready_size * 2 : 64;
+            int *ready = realloc(event_loop->ready, sizeof(int) * size);
+
+            if (ready == NULL) return HE_ERR;
+            event_loop->ready = ready;
+            event_loop->ready_size = size;
+        }
+        event_loop->ready[event_loop->nready++] = fd;
+    }
+    fe->ready |= mask;
+    return HE_OK;
+}
+
+void he_set_edge_triggered(he_event_loop *event_loop, int enable)
+{
+    event_loop->default_mask = enable ? HE_EDGE : HE_NONE;
+}
+
+/* Events are only delivered to the registration they were fetched for:
+ * if a handler earlier in the pass closed fd and a new socket got the same
+ * number, gen no longer matches and the stale event is dropped. */
+static void he_call_file_proc(he_event_loop *event_loop, he_file_proc *proc,
+    int fd, void *client_data, int mask)
+{
+    he_slow_event ev = { fd, mask, proc, NULL, NULL, client_data, 0 };
+    long long start;
+
+    if (event_loop->stats == NULL) {
+        proc(event_loop, fd, client_data, mask);
+        return;
+    }
+    start = he_ustime();
+    proc(event_loop, fd, client_data, mask);
+    he_stats_callback(event_loop, &ev, start);
+}
+
+static void he_dispatch(he_event_loop *event_loop, int fd, int mask, unsigned int gen)
+{
+    he_file_event *fe;
+    int fired = 0;
+
+    /* A handler earlier in this pass may have shrunk the table. */
+    if (fd >= event_loop->setsize) return;
+    fe = &event_loop->events[fd];
+    if (fe->gen != gen) return;
+
+    fe->ready &= ~mask;
+    if (fe->mask & mask & HE_READABLE) {
+        he_call_file_proc(event_loop, fe->rfile_proc, fd, fe->client_data, mask);
+        fired++;
+        /* The handler may have grown the fd table or replaced the fd. */
+        fe = &event_loop->events[fd];
+        if (fe->gen != gen) return;
+    }
+    if (fe->mask & mask & HE_WRITABLE) {
+        if (!fired || fe->wfile_proc != fe->rfile_proc) {
+            he_call_file_proc(event_loop, fe->wfile_proc, fd, fe->client_data, mask);
+            fired++;
+        }
+    }
+}
+
+/* Entries queued by handlers while this runs wait for the next pass. */
+static int he_process_ready(he_event_loop *event_loop)
+{
+    int j, n = event_loop->nready, processed = 0;
+
+    for (j = 0; j < n; j++) {
+        int fd = event_loop->ready[j];
+        int mask;
+
+        if (fd >= event_loop->setsize) continue;
+        mask = event_loop->events[fd].ready;
+        if (mask == HE_NONE) continue;
+        he_dispatch(event_loop, fd, mask, event_loop->events[fd].gen);
+        processed++;
+    }
+    if (n == 0) return 0;
+    event_loop->nready -= n;
+    memmove(event_loop->ready, event_loop->ready + n,
+        sizeof(int) * event_loop->nready);
+    return processed;
+}
+
+/* Busy-poll mode: instead of sleeping, poll without a timeout until
+ * something fires or usec have passed, then block for what is left of
+ * timeout. Trades a core for not paying the wakeup latency. busy_hits
+ * counts polls that found events while spinning, busy_sleeps the times
+ * the budget ran out and the loop blocked. 0 turns it off. */
+void he_set_busy_poll(he_event_loop *event_loop, long long usec)
+{
+    event_loop->busy_poll_usec = usec > 0 ? usec : 0;
+}
+
+static int he_busy_poll(he_event_loop *event_loop, long long ms)
+{
+    long long start = he_ustime(), now, spent;
+    long long budget = event_loop->busy_poll_usec;
+    int numevents;
+
+    if (budget > ms * 1000) budget = ms * 1000;
+    do {
+        if ((numevents = event_loop->api->poll(event_loop, 0)) != 0) {
+            event_loop->busy_hits++;
+            return numevents;
+        }
+        if (__atomic_load_n(&event_loop->stop, __ATOMIC_ACQUIRE)) return 0;
+        now = he_ustime();
+    } while (now - start < budget);
+    event_loop->busy_sleeps++;
+    spent = (now - start) / 1000;
+    return event_loop->api->poll(event_loop, ms > spent ? ms - spent : 0);
+}
+
+static int he_poll(he_event_loop *event_loop, long long ms)
+{
+    if (event_loop->busy_poll_usec && ms > 0) return he_busy_poll(event_loop, ms);
+    return event_loop->api->poll(event_loop, ms);
 }
 
 static int he_process_update(he_event_loop *event_loop) 
@@ -128,8 +1004,13 @@ int he_process_events(he_event_loop *event_loop)
     int processed = 0, numevents;
     int j;
     long now_sec, now_ms;
-    time_t now = time(NULL);
+    time_t now;
 
+    processed += he_process_deferred(event_loop);
+    if (event_loop->before_sleep)
+        event_loop->before_sleep(event_loop, event_loop->before_sleep_data);
+
+    now = time(NULL);
     if (now < event_loop->ui.last_time) {
         event_loop->ui.when_sec = 0;
         event_loop->ui.when_ms = 0;
@@ -141,36 +1022,45 @@ int he_process_events(he_event_loop *event_loop)
         (event_loop->ui.when_sec - now_sec) * 1000 +
         event_loop->ui.when_ms - now_ms;
     if (ms < 0) ms = 0;
+    ms = he_timers_timeout(event_loop, ms);
+    if (event_loop->nready || event_loop->defer_head) ms = 0;
+
+    if (event_loop->stats) {
+        he_loop_stats *stats = event_loop->stats;
+        long long start = he_ustime();
 
-    numevents = he_api_poll(event_loop, ms);
+        numevents = he_poll(event_loop, ms);
+        stats->iterations++;
+        stats->events += numevents;
+        he_hist_record(&stats->poll_wait, he_ustime() - start);
+        he_hist_record(&stats->events_per_wakeup, numevents);
+    } else {
+        numevents = he_poll(event_loop, ms);
+    }
+    if (event_loop->after_poll)
+        event_loop->after_poll(event_loop, event_loop->after_poll_data);
 
     processed += he_process_update(event_loop);
 
     for (j = 0; j < numevents; j++) {
-        he_file_event *fe = &event_loop->events[event_loop->fired[j].fd];
-        int mask = event_loop->fired[j].mask;
-        int fd = event_loop->fired[j].fd;
-        int fired = 0;
-
-        if (fe->mask & mask & HE_READABLE) {
-            fe->rfile_proc(event_loop, fd, fe->client_data, mask);
-            fired++;
-        }
-        if (fe->mask & mask & HE_WRITABLE) {
-            if (!fired || fe->wfile_proc != fe->rfile_proc) {
-                fe->wfile_proc(event_loop, fd, fe->client_data, mask);
-                fired++;
-            }
-        }
+        he_dispatch(event_loop, event_loop->fired[j].fd, event_loop->fired[j].mask,
+            event_loop->fired[j].gen);
         processed++;
     }
+    processed += he_process_ready(event_loop);
+
+    processed += he_process_timers(event_loop);
 
     return processed;
 }
 
+/* The stop flag is cleared when he_main returns, not on entry, so a
+ * he_stop from another thread that lands before the loop thread gets here
+ * is not lost. */
 void he_main(he_event_loop *event_loop) {
-    event_loop->stop = 0;
-    while (!event_loop->stop) {
+    he_loop_update_cpu(event_loop);
+    while (!__atomic_load_n(&event_loop->stop, __ATOMIC_ACQUIRE)) {
         he_process_events(event_loop);
     }
+    __atomic_store_n(&event_loop->stop, 0, __ATOMIC_RELEASE);
 }
@@ -0,0 +1,169 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "he.h"
+#include "he_acceptor.h"
+#include "hnet.h"
+
+#define HE_ACCEPTOR_IN_CALLBACK (1<<0)
+#define HE_ACCEPTOR_CLOSED (1<<1)
+
+static void he_acceptor_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask);
+
+static void he_acceptor_free(he_acceptor *acceptor)
+{
+    free(acceptor->addrs);
+    free(acceptor);
+}
+
+static long long he_acceptor_resume_proc(he_event_loop *event_loop,
+    he_timer *timer, void *client_data)
+{
+    he_acceptor *acceptor = client_data;
+    HE_NOTUSED(timer);
+
+    if (he_create_file_event(event_loop, acceptor->fd, HE_READABLE,
+        he_acceptor_handler, acceptor) == HE_ERR)
+        return HE_ACCEPT_PAUSE_MS;
+    acceptor->pause_timer = NULL;
+    /* The backlog queued while paused raises no new edge. */
+    he_set_file_ready(event_loop, acceptor->fd, HE_READABLE);
+    return HE_NOMORE;
+}
+
+/* Out of fds or memory the listener stays readable, so left registered a
+ * level-triggered loop would spin on failing accepts. Stop watching it for
+ * HE_ACCEPT_PAUSE_MS and then drain what queued up meanwhile. Without a
+ * timer it stays registered and is retried on the next wakeup. */
+static void he_acceptor_pause(he_acceptor *acceptor)
+{
+    he_event_loop *event_loop = acceptor->event_loop;
+
+    acceptor->pause_timer = he_create_timer(event_loop, HE_ACCEPT_PAUSE_MS,
+        he_acceptor_resume_proc, acceptor);
+    if (acceptor->pause_timer == NULL) return;
+    he_delete_file_event(event_loop, acceptor->fd, HE_READABLE);
+    acceptor->pauses++;
+}
+
+/* Hand a burst to the proc. Returns HE_ERR if the proc closed the
+ * acceptor, which must not be touched afterwards by the caller except to
+ * free it. */
+static int he_acceptor_deliver(he_acceptor *acceptor, int count)
+{
+    acceptor->accepted += count;
+    acceptor->proc(acceptor, acceptor->fds, acceptor->addrs, count,
+        acceptor->client_data);
+    return (acceptor->flags & HE_ACCEPTOR_CLOSED) ? HE_ERR : HE_OK;
+}
+
+static void he_acceptor_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask)
+{
+    he_acceptor *acceptor = client_data;
+    int cfd, count = 0, total = 0, drained = 0, starved = 0;
+    HE_NOTUSED(mask);
+
+    acceptor->flags |= HE_ACCEPTOR_IN_CALLBACK;
+    while (total < acceptor->budget) {
+        cfd = hnet_tcp_accept4(NULL, fd, &acceptor->addrs[count],
+            SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (cfd == HNET_ERR) {
+            if (errno == EAGAIN) {
+                drained = 1;
+                break;
+            }
+            acceptor->errors++;
+            /* The peer gave up before we got to it, keep draining. */
+            if (errno == ECONNABORTED || errno == EPROTO) continue;
+            /* Out of fds or memory. */
+            drained = starved = 1;
+            break;
+        }
+        total++;
+        if (hnet_apply_sockopts(NULL, cfd, &acceptor->opts) == HNET_ERR) {
+            acceptor->errors++;
+            close(cfd);
+            continue;
+        }
+        acceptor->fds[count++] = cfd;
+        if (count == HE_ACCEPT_BURST) {
+            if (he_acceptor_deliver(acceptor, count) == HE_ERR) goto closed;
+            count = 0;
+        }
+    }
+    if (count && he_acceptor_deliver(acceptor, count) == HE_ERR) goto closed;
+    acceptor->flags &= ~HE_ACCEPTOR_IN_CALLBACK;
+
+    if (starved) {
+        he_acceptor_pause(acceptor);
+    } else if (!drained) {
+        if (acceptor->budget < acceptor->max_budget)
+            acceptor->budget = acceptor->budget * 2 > acceptor->max_budget ?
+                acceptor->max_budget : acceptor->budget * 2;
+        he_set_file_ready(event_loop, fd, HE_READABLE);
+    } else if (total < acceptor->budget / 4 && acceptor->budget > acceptor->min_budget) {
+        acceptor->budget = acceptor->budget / 2 < acceptor->min_budget ?
+            acceptor->min_budget : acceptor->budget / 2;
+    }
+    return;
+
+closed:
+    he_acceptor_free(acceptor);
+}
+
+/* Takes ownership of the listening socket fd. opts may be NULL to accept
+ * with the kernel defaults. */
+he_acceptor *he_create_acceptor(he_event_loop *event_loop, int fd,
+    const hnet_sockopts *opts, he_accept_proc *proc, void *client_data)
+{
+    he_acceptor *acceptor;
+
+    if ((acceptor = calloc(1, sizeof(*acceptor))) == NULL) return NULL;
+    if ((acceptor->addrs = calloc(HE_ACCEPT_BURST, sizeof(*acceptor->addrs))) == NULL)
+        goto err;
+    acceptor->event_loop = event_loop;
+    acceptor->fd = fd;
+    if (opts) acceptor->opts = *opts;
+    acceptor->min_budget = HE_ACCEPT_MIN_BUDGET;
+    acceptor->max_budget = HE_ACCEPT_MAX_BUDGET;
+    acceptor->budget = acceptor->min_budget;
+    acceptor->proc = proc;
+    acceptor->client_data = client_data;
+    if (hnet_nonblock(NULL, fd) == HNET_ERR) goto err;
+    if (he_create_file_event(event_loop, fd, HE_READABLE,
+        he_acceptor_handler, acceptor) == HE_ERR)
+        goto err;
+    return acceptor;
+
+err:
+    he_acceptor_free(acceptor);
+    return NULL;
+}
+
+void he_acceptor_set_budget(he_acceptor *acceptor, int min_budget, int max_budget)
+{
+    if (min_budget < 1) min_budget = 1;
+    if (max_budget < min_budget) max_budget = min_budget;
+    acceptor->min_budget = min_budget;
+    acceptor->max_budget = max_budget;
+    if (acceptor->budget < min_budget) acceptor->budget = min_budget;
+    if (acceptor->budget > max_budget) acceptor->budget = max_budget;
+}
+
+/* Stops accepting and closes the listening socket. */
+void he_acceptor_close(he_acceptor *acceptor)
+{
+    if (acceptor->flags & HE_ACCEPTOR_CLOSED) return;
+    if (acceptor->pause_timer) he_delete_timer(acceptor->event_loop, acceptor->pause_timer);
+    he_delete_file_event(acceptor->event_loop, acceptor->fd, HE_READABLE);
+    close(acceptor->fd);
+    acceptor->flags |= HE_ACCEPTOR_CLOSED;
+    if (!(acceptor->flags & HE_ACCEPTOR_IN_CALLBACK)) he_acceptor_free(acceptor);
+}
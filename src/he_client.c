@@ -0,0 +1,314 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "he.h"
+#include "he_conn.h"
+#include "he_client.h"
+#include "he_resolver.h"
+#include "hnet.h"
+
+static long long he_client_timer_proc(he_event_loop *event_loop, he_timer *timer,
+    void *client_data);
+
+static void he_client_notify(he_client_slot *slot, int err)
+{
+    he_client_pool *pool = slot->pool;
+
+    if (pool->state_proc)
+        pool->state_proc(pool, slot->index, slot->conn, slot->state, err,
+            pool->client_data);
+}
+
+static int he_client_set_timer(he_client_slot *slot, long long ms)
+{
+    he_event_loop *event_loop = slot->pool->event_loop;
+
+    if (slot->timer) he_delete_timer(event_loop, slot->timer);
+    slot->timer = he_create_timer(event_loop, ms, he_client_timer_proc, slot);
+    return slot->timer ? HE_OK : HE_ERR;
+}
+
+/* Full jitter over the upper half of the exponential delay, so a restart
+ * of the upstream does not get every client back at the same instant. */
+static long long he_client_backoff(he_client_slot *slot)
+{
+    he_client_pool *pool = slot->pool;
+    long long delay = pool->backoff_min;
+    int i;
+
+    for (i = 0; i < slot->attempts && delay < pool->backoff_max; i++) delay *= 2;
+    if (delay > pool->backoff_max) delay = pool->backoff_max;
+    pool->seed = pool->seed * 1103515245 + 12345;
+    return delay / 2 + (long long)((pool->seed >> 16) % (unsigned int)(delay / 2 + 1));
+}
+
+static long long he_client_mstime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void he_client_fail(he_client_slot *slot, int err)
+{
+    he_client_pool *pool = slot->pool;
+
+    if (slot->fd != -1) {
+        he_delete_file_event(pool->event_loop, slot->fd, HE_READABLE|HE_WRITABLE);
+        close(slot->fd);
+        slot->fd = -1;
+    }
+    if (slot->state == HE_CLIENT_CONNECTED) {
+        pool->nconnected--;
+        /* Only a connection that stayed up for a while proves the upstream
+         * healthy again; one dropped right after the handshake keeps
+         * backing off. */
+        if (he_client_mstime() - slot->connected_at >= pool->backoff_max)
+            slot->attempts = 0;
+    }
+    slot->conn = NULL;
+    slot->failures++;
+    slot->state = HE_CLIENT_BACKOFF;
+    /* Without a timer the slot would never reconnect: retry on the next
+     * loop iteration instead. */
+    if (he_client_set_timer(slot, he_client_backoff(slot)) == HE_ERR)
+        he_defer(pool->event_loop, &slot->retry_task);
+    slot->attempts++;
+    he_client_notify(slot, err);
+}
+
+static void he_client_read_proc(he_conn *conn, void *client_data)
+{
+    he_client_pool *pool = ((he_client_slot *)client_data)->pool;
+
+    pool->read_proc(conn, pool->client_data);
+}
+
+static void he_client_close_proc(he_conn *conn, int err, void *client_data)
+{
+    he_client_slot *slot = client_data;
+    HE_NOTUSED(conn);
+
+    /* he_conn closes the fd itself. */
+    slot->fd = -1;
+    he_client_fail(slot, err);
+}
+
+static void he_client_connect_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask)
+{
+    he_client_slot *slot = client_data;
+    he_client_pool *pool = slot->pool;
+    int sockerr;
+    HE_NOTUSED(mask);
+
+    he_delete_file_event(event_loop, fd, HE_WRITABLE);
+    if ((sockerr = hnet_get_sock_error(fd)) != 0) {
+        he_client_fail(slot, sockerr);
+        return;
+    }
+    hnet_enable_tcp_nodelay(NULL, fd);
+    slot->conn = he_create_conn(event_loop, fd, he_client_read_proc,
+        he_client_close_proc, slot);
+    if (slot->conn == NULL) {
+        he_client_fail(slot, errno);
+        return;
+    }
+    if (slot->timer) {
+        he_delete_timer(event_loop, slot->timer);
+        slot->timer = NULL;
+    }
+    slot->state = HE_CLIENT_CONNECTED;
+    slot->connected_at = he_client_mstime();
+    slot->connects++;
+    pool->nconnected++;
+    he_client_notify(slot, 0);
+}
+
+/* An answer only belongs to an attempt still waiting for one. One left
+ * over from an attempt that timed out may serve the next attempt: both
+ * asked for the same host. Successive attempts walk the addresses. */
+static void he_client_resolved(he_resolver *resolver, int err,
+    const struct sockaddr_storage *addrs, int naddrs, void *client_data)
+{
+    he_client_slot *slot = client_data;
+    he_client_pool *pool = slot->pool;
+    HE_NOTUSED(resolver);
+
+    if (slot->state != HE_CLIENT_CONNECTING || slot->fd != -1) return;
+    if (err || naddrs == 0) {
+        he_client_fail(slot, EHOSTUNREACH);
+        return;
+    }
+    slot->fd = hnet_tcp_nonblock_connect_addr(NULL, &addrs[slot->attempts % naddrs]);
+    if (slot->fd == HNET_ERR) {
+        slot->fd = -1;
+        he_client_fail(slot, errno);
+        return;
+    }
+    if (he_create_file_event(pool->event_loop, slot->fd, HE_WRITABLE,
+        he_client_connect_handler, slot) == HE_ERR)
+        he_client_fail(slot, errno);
+}
+
+/* The connect timeout covers resolving host as well. */
+static void he_client_connect(he_client_slot *slot)
+{
+    he_client_pool *pool = slot->pool;
+
+    slot->state = HE_CLIENT_CONNECTING;
+    /* An attempt without its connect timeout could hang forever. */
+    if (he_client_set_timer(slot, pool->connect_timeout) == HE_ERR) {
+        he_client_fail(slot, ENOMEM);
+        return;
+    }
+    if (he_resolve(pool->resolver, pool->host, pool->port, AF_UNSPEC,
+        he_client_resolved, slot) == HE_ERR)
+        he_client_fail(slot, errno);
+}
+
+static void he_client_retry_proc(he_event_loop *event_loop, void *arg)
+{
+    he_client_slot *slot = arg;
+    HE_NOTUSED(event_loop);
+
+    if (slot->state == HE_CLIENT_BACKOFF) he_client_connect(slot);
+}
+
+static long long he_client_timer_proc(he_event_loop *event_loop, he_timer *timer,
+    void *client_data)
+{
+    he_client_slot *slot = client_data;
+    HE_NOTUSED(event_loop);
+    HE_NOTUSED(timer);
+
+    slot->timer = NULL;
+    if (slot->state == HE_CLIENT_CONNECTING)
+        he_client_fail(slot, ETIMEDOUT);
+    else if (slot->state != HE_CLIENT_CONNECTED)
+        he_client_connect(slot);
+    return HE_NOMORE;
+}
+
+/* The first connects are started from the loop, so state_proc never runs
+ * before this returns. host is resolved by the pool's own he_resolver,
+ * whose answers are cached for HE_CLIENT_RESOLVE_TTL, so reconnects never
+ * block the loop on DNS. */
+he_client_pool *he_create_client_pool(he_event_loop *event_loop, const char *host,
+    int port, int size, he_conn_proc *read_proc, he_client_state_proc *state_proc,
+    void *client_data)
+{
+    he_client_pool *pool;
+    int i;
+
+    if (size <= 0 || host == NULL || read_proc == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((pool = calloc(1, sizeof(*pool))) == NULL) return NULL;
+    pool->event_loop = event_loop;
+    pool->port = port;
+    pool->size = size;
+    pool->policy = HE_CLIENT_ROUND_ROBIN;
+    pool->connect_timeout = HE_CLIENT_CONNECT_TIMEOUT;
+    pool->backoff_min = HE_CLIENT_BACKOFF_MIN;
+    pool->backoff_max = HE_CLIENT_BACKOFF_MAX;
+    pool->seed = (unsigned int)time(NULL) ^ (unsigned int)(size_t)pool;
+    pool->read_proc = read_proc;
+    pool->state_proc = state_proc;
+    pool->client_data = client_data;
+    if ((pool->host = strdup(host)) == NULL) goto err;
+    pool->resolver = he_create_resolver(event_loop, 1, HE_CLIENT_RESOLVE_TTL);
+    if (pool->resolver == NULL) goto err;
+    if ((pool->slots = calloc(size, sizeof(he_client_slot))) == NULL) goto err;
+    for (i = 0; i < size; i++) {
+        he_client_slot *slot = &pool->slots[i];
+
+        slot->pool = pool;
+        slot->index = i;
+        slot->fd = -1;
+        slot->state = HE_CLIENT_DISCONNECTED;
+        slot->retry_task.proc = he_client_retry_proc;
+        slot->retry_task.arg = slot;
+    }
+    for (i = 0; i < size; i++)
+        if (he_client_set_timer(&pool->slots[i], 0) == HE_ERR) goto err;
+    return pool;
+
+err:
+    he_delete_client_pool(pool);
+    return NULL;
+}
+
+/* Closes every connection without calling state_proc. */
+void he_delete_client_pool(he_client_pool *pool)
+{
+    int i;
+
+    if (pool->resolver) he_delete_resolver(pool->resolver);
+    for (i = 0; pool->slots && i < pool->size; i++) {
+        he_client_slot *slot = &pool->slots[i];
+
+        if (slot->timer) he_delete_timer(pool->event_loop, slot->timer);
+        he_cancel_defer(pool->event_loop, &slot->retry_task);
+        if (slot->conn) {
+            he_conn_close(slot->conn);
+        } else if (slot->fd != -1) {
+            he_delete_file_event(pool->event_loop, slot->fd, HE_READABLE|HE_WRITABLE);
+            close(slot->fd);
+        }
+    }
+    free(pool->slots);
+    free(pool->host);
+    free(pool);
+}
+
+void he_client_pool_set_policy(he_client_pool *pool, int policy)
+{
+    pool->policy = policy;
+}
+
+/* Values <= 0 leave the corresponding setting unchanged. */
+void he_client_pool_set_timeouts(he_client_pool *pool, long long connect_timeout,
+    long long backoff_min, long long backoff_max)
+{
+    if (connect_timeout > 0) pool->connect_timeout = connect_timeout;
+    if (backoff_min > 0) pool->backoff_min = backoff_min;
+    if (backoff_max > 0) pool->backoff_max = backoff_max;
+    if (pool->backoff_max < pool->backoff_min) pool->backoff_max = pool->backoff_min;
+}
+
+/* Returns a connected slot's connection, or NULL while none is up.
+ * HE_CLIENT_LEAST_PENDING picks the one with the least queued output. */
+he_conn *he_client_pool_get(he_client_pool *pool)
+{
+    he_client_slot *best = NULL;
+    size_t pending, best_pending = 0;
+    int i;
+
+    if (pool->nconnected == 0) return NULL;
+    for (i = 0; i < pool->size; i++) {
+        he_client_slot *slot = &pool->slots[(pool->next + i) % pool->size];
+
+        if (slot->state != HE_CLIENT_CONNECTED) continue;
+        if (pool->policy == HE_CLIENT_ROUND_ROBIN) {
+            best = slot;
+            break;
+        }
+        pending = he_conn_pending(slot->conn);
+        if (best == NULL || pending < best_pending) {
+            best = slot;
+            best_pending = pending;
+        }
+    }
+    if (best == NULL) return NULL;
+    pool->next = (best->index + 1) % pool->size;
+    return best->conn;
+}
@@ -0,0 +1,629 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "he.h"
+#include "he_conn.h"
+#include "he_pool.h"
+#include "hnet.h"
+
+#define HE_CONN_MAX_READS 16
+#define HE_CONN_ZC_POLL_MS 10
+#define HE_CONN_ZC_LINGER_MS 5000
+
+#define HE_CONN_READING (1<<0)
+#define HE_CONN_WRITING (1<<1)
+#define HE_CONN_ABOVE_HIGH (1<<2)
+#define HE_CONN_IN_CALLBACK (1<<3)
+#define HE_CONN_CLOSED (1<<4)
+#define HE_CONN_COALESCE (1<<5)
+
+static void he_conn_write_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask);
+static void he_conn_zc_complete(he_conn *conn);
+static long long he_conn_zc_timer_proc(he_event_loop *event_loop, he_timer *timer,
+    void *client_data);
+
+static void he_conn_free_chunk(he_conn *conn, he_chunk *chunk)
+{
+    if (chunk->free_proc) {
+        chunk->free_proc(chunk->data, chunk->free_arg);
+        he_pool_free(conn->pool, chunk, sizeof(*chunk));
+    } else {
+        he_pool_free(conn->pool, chunk, sizeof(*chunk) + chunk->size);
+    }
+}
+
+/* A conn closed with zerocopy sends in flight lingers: the fd stays open
+ * until the kernel reports them complete, so their buffers are not handed
+ * back while TCP may still send from them. Buffers still unacknowledged
+ * after HE_CONN_ZC_LINGER_MS are released anyway and must not be reused
+ * by the caller until the peer has the data. */
+static void he_conn_free(he_conn *conn)
+{
+    he_chunk *chunk = conn->ohead;
+    unsigned int seq;
+
+    if (conn->fd != -1 && conn->zc_base != conn->zc_seq && conn->zc_linger > 0) {
+        if (conn->zc_timer == NULL)
+            conn->zc_timer = he_create_timer(conn->event_loop, HE_CONN_ZC_POLL_MS,
+                he_conn_zc_timer_proc, conn);
+        if (conn->zc_timer) return;
+    }
+    if (conn->zc_timer) he_delete_timer(conn->event_loop, conn->zc_timer);
+    if (conn->fd != -1) close(conn->fd);
+    for (seq = conn->zc_base; seq != conn->zc_seq; seq++) {
+        he_chunk *zc = conn->zc_ring[seq & (conn->zc_ring_size - 1)];
+
+        if (zc && --zc->zc_refs == 0 && zc->pos == zc->len)
+            he_conn_free_chunk(conn, zc);
+    }
+    free(conn->zc_ring);
+    while (chunk) {
+        he_chunk *next = chunk->next;
+        he_conn_free_chunk(conn, chunk);
+        chunk = next;
+    }
+    he_pool_free(conn->pool, conn->ibuf, conn->isize);
+    free(conn);
+}
+
+/* With zerocopy sends in flight only the write side is shut down, the fd
+ * is needed to collect their completions (see he_conn_free). */
+static void he_conn_release(he_conn *conn)
+{
+    he_cancel_defer(conn->event_loop, &conn->flush_task);
+    he_delete_file_event(conn->event_loop, conn->fd, HE_READABLE|HE_WRITABLE);
+    if (conn->zc_base != conn->zc_seq) {
+        shutdown(conn->fd, SHUT_WR);
+        conn->zc_linger = HE_CONN_ZC_LINGER_MS;
+    } else {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->flags |= HE_CONN_CLOSED;
+}
+
+/* Called on EOF or on a read/write error. The conn is freed once the
+ * outermost callback running on it returns. */
+static void he_conn_abort(he_conn *conn, int err)
+{
+    if (conn->flags & HE_CONN_CLOSED) return;
+    he_conn_release(conn);
+    if (conn->close_proc) conn->close_proc(conn, err, conn->client_data);
+}
+
+static int he_conn_enter(he_conn *conn)
+{
+    int nested = conn->flags & HE_CONN_IN_CALLBACK;
+
+    conn->flags |= HE_CONN_IN_CALLBACK;
+    return nested;
+}
+
+static void he_conn_leave(he_conn *conn, int nested)
+{
+    if (nested) return;
+    conn->flags &= ~HE_CONN_IN_CALLBACK;
+    if (conn->flags & HE_CONN_CLOSED) he_conn_free(conn);
+}
+
+static int he_conn_reserve(he_conn *conn, size_t need)
+{
+    char *ibuf;
+    size_t size, usable;
+
+    if (conn->isize - conn->wpos >= need) return HE_OK;
+    if (conn->rpos) {
+        memmove(conn->ibuf, conn->ibuf + conn->rpos, conn->wpos - conn->rpos);
+        conn->wpos -= conn->rpos;
+        conn->rpos = 0;
+        if (conn->isize - conn->wpos >= need) return HE_OK;
+    }
+    size = conn->isize ? conn->isize * 2 : HE_CONN_READ_MIN * 4;
+    while (size - conn->wpos < need) size *= 2;
+    ibuf = he_pool_realloc(conn->pool, conn->ibuf, conn->isize, size, &usable);
+    if (ibuf == NULL) return HE_ERR;
+    conn->ibuf = ibuf;
+    conn->isize = usable;
+    return HE_OK;
+}
+
+/* Completions are only noticed as HE_ERROR on a registered fd. A conn
+ * that neither reads nor writes has no registration, so while zerocopy
+ * sends are in flight their completions are polled from a timer. */
+static void he_conn_zc_watch(he_conn *conn)
+{
+    if (conn->flags & (HE_CONN_READING|HE_CONN_WRITING)) return;
+    if (conn->zc_base == conn->zc_seq) return;
+    he_conn_zc_complete(conn);
+    if (conn->zc_base != conn->zc_seq && conn->zc_timer == NULL)
+        conn->zc_timer = he_create_timer(conn->event_loop, HE_CONN_ZC_POLL_MS,
+            he_conn_zc_timer_proc, conn);
+}
+
+static long long he_conn_zc_timer_proc(he_event_loop *event_loop, he_timer *timer,
+    void *client_data)
+{
+    he_conn *conn = client_data;
+    HE_NOTUSED(event_loop);
+    HE_NOTUSED(timer);
+
+    he_conn_zc_complete(conn);
+    if (conn->flags & HE_CONN_CLOSED) {
+        conn->zc_linger -= HE_CONN_ZC_POLL_MS;
+        if (conn->zc_base != conn->zc_seq && conn->zc_linger > 0)
+            return HE_CONN_ZC_POLL_MS;
+        conn->zc_timer = NULL;
+        conn->zc_linger = 0;
+        he_conn_free(conn);
+        return HE_NOMORE;
+    }
+    if (conn->zc_base != conn->zc_seq &&
+        !(conn->flags & (HE_CONN_READING|HE_CONN_WRITING)))
+        return HE_CONN_ZC_POLL_MS;
+    conn->zc_timer = NULL;
+    return HE_NOMORE;
+}
+
+/* Queued output without write interest would never be sent, so a conn
+ * whose fd cannot be watched for writing is aborted. Returns HE_ERR if it
+ * was. */
+static int he_conn_update_writing(he_conn *conn)
+{
+    if (conn->olen && !(conn->flags & HE_CONN_WRITING)) {
+        if (he_create_file_event(conn->event_loop, conn->fd, HE_WRITABLE,
+            he_conn_write_handler, conn) == HE_ERR) {
+            he_conn_abort(conn, errno ? errno : ENOMEM);
+            return HE_ERR;
+        }
+        conn->flags |= HE_CONN_WRITING;
+    } else if (!conn->olen && (conn->flags & HE_CONN_WRITING)) {
+        he_delete_file_event(conn->event_loop, conn->fd, HE_WRITABLE);
+        conn->flags &= ~HE_CONN_WRITING;
+    }
+    he_conn_zc_watch(conn);
+    return HE_OK;
+}
+
+/* A coalescing conn leaves the queue to flush_task unless the socket is
+ * already known to be full. */
+static int he_conn_schedule(he_conn *conn)
+{
+    if ((conn->flags & HE_CONN_COALESCE) && !(conn->flags & HE_CONN_WRITING))
+        return he_defer(conn->event_loop, &conn->flush_task);
+    return he_conn_update_writing(conn);
+}
+
+static void he_conn_check_water(he_conn *conn)
+{
+    if (!conn->high_water) return;
+    if (!(conn->flags & HE_CONN_ABOVE_HIGH) && conn->olen >= conn->high_water) {
+        conn->flags |= HE_CONN_ABOVE_HIGH;
+        if (conn->high_water_proc) conn->high_water_proc(conn, conn->client_data);
+    } else if ((conn->flags & HE_CONN_ABOVE_HIGH) && conn->olen <= conn->low_water) {
+        conn->flags &= ~HE_CONN_ABOVE_HIGH;
+        if (conn->low_water_proc) conn->low_water_proc(conn, conn->client_data);
+    }
+}
+
+static int he_conn_zc_track(he_conn *conn, he_chunk *chunk)
+{
+    unsigned int inflight = conn->zc_seq - conn->zc_base;
+
+    if (inflight == conn->zc_ring_size) {
+        unsigned int size = conn->zc_ring_size * 2, seq;
+        he_chunk **ring = malloc(sizeof(he_chunk*) * size);
+
+        if (ring == NULL) return HE_ERR;
+        for (seq = conn->zc_base; seq != conn->zc_seq; seq++)
+            ring[seq & (size - 1)] = conn->zc_ring[seq & (conn->zc_ring_size - 1)];
+        free(conn->zc_ring);
+        conn->zc_ring = ring;
+        conn->zc_ring_size = size;
+    }
+    conn->zc_ring[conn->zc_seq++ & (conn->zc_ring_size - 1)] = chunk;
+    chunk->zc_refs++;
+    return HE_OK;
+}
+
+/* Completions arrive on the socket error queue, which the loop reports as
+ * HE_ERROR. If the kernel had to copy anyway (e.g. loopback) zerocopy is
+ * turned off for the conn since it only adds notification overhead. */
+static void he_conn_zc_complete(he_conn *conn)
+{
+    unsigned int lo, hi, seq;
+    int copied;
+
+    while (hnet_read_zerocopy(conn->fd, &lo, &hi, &copied) == 1) {
+        for (seq = lo; seq != hi + 1; seq++) {
+            he_chunk **slot = &conn->zc_ring[seq & (conn->zc_ring_size - 1)];
+            he_chunk *chunk = *slot;
+
+            if (seq - conn->zc_base >= conn->zc_seq - conn->zc_base || !chunk)
+                continue;
+            *slot = NULL;
+            if (--chunk->zc_refs == 0 && chunk->pos == chunk->len)
+                he_conn_free_chunk(conn, chunk);
+        }
+        while (conn->zc_base != conn->zc_seq &&
+            conn->zc_ring[conn->zc_base & (conn->zc_ring_size - 1)] == NULL)
+            conn->zc_base++;
+        if (copied) conn->zc_threshold = 0;
+    }
+}
+
+/* Write as much of the output queue as the socket takes. Copied chunks
+ * are gathered up to IOV_MAX per writev, caller buffers queued for
+ * zerocopy go out one per MSG_ZEROCOPY send. Returns HE_ERR if the conn
+ * was aborted. */
+static int he_conn_flush(he_conn *conn)
+{
+    struct iovec iov[IOV_MAX];
+    he_chunk *chunk;
+    ssize_t nwritten;
+    int iovcnt, zerocopy;
+
+    while (conn->olen) {
+        chunk = conn->ohead;
+        zerocopy = chunk->free_proc && conn->zc_threshold;
+        if (zerocopy) {
+            nwritten = hnet_send_zerocopy(conn->fd, chunk->data + chunk->pos,
+                chunk->len - chunk->pos);
+            if (nwritten == -1 && errno == ENOBUFS)
+                nwritten = write(conn->fd, chunk->data + chunk->pos,
+                    chunk->len - chunk->pos);
+            else if (nwritten > 0 && he_conn_zc_track(conn, chunk) == HE_ERR) {
+                he_conn_abort(conn, ENOMEM);
+                return HE_ERR;
+            }
+        } else {
+            for (iovcnt = 0; chunk && iovcnt < IOV_MAX &&
+                !(chunk->free_proc && conn->zc_threshold);
+                chunk = chunk->next, iovcnt++) {
+                iov[iovcnt].iov_base = chunk->data + chunk->pos;
+                iov[iovcnt].iov_len = chunk->len - chunk->pos;
+            }
+            nwritten = writev(conn->fd, iov, iovcnt);
+        }
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            he_conn_abort(conn, errno);
+            return HE_ERR;
+        }
+        conn->olen -= nwritten;
+        while (nwritten > 0) {
+            chunk = conn->ohead;
+            if ((size_t)nwritten < chunk->len - chunk->pos) {
+                chunk->pos += nwritten;
+                break;
+            }
+            nwritten -= chunk->len - chunk->pos;
+            chunk->pos = chunk->len;
+            conn->ohead = chunk->next;
+            if (chunk->zc_refs == 0) he_conn_free_chunk(conn, chunk);
+        }
+        if (conn->ohead == NULL) conn->otail = NULL;
+    }
+    return HE_OK;
+}
+
+static void he_conn_write_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask)
+{
+    he_conn *conn = client_data;
+    int nested = he_conn_enter(conn);
+    HE_NOTUSED(event_loop);
+    HE_NOTUSED(fd);
+
+    if ((mask & HE_ERROR) && conn->zc_ring) he_conn_zc_complete(conn);
+    if (he_conn_flush(conn) == HE_OK && he_conn_update_writing(conn) == HE_OK)
+        he_conn_check_water(conn);
+    he_conn_leave(conn, nested);
+}
+
+static void he_conn_flush_task(he_event_loop *event_loop, void *arg)
+{
+    he_conn *conn = arg;
+    int nested = he_conn_enter(conn);
+    HE_NOTUSED(event_loop);
+
+    if (he_conn_flush(conn) == HE_OK && he_conn_update_writing(conn) == HE_OK)
+        he_conn_check_water(conn);
+    he_conn_leave(conn, nested);
+}
+
+static void he_conn_read_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask)
+{
+    he_conn *conn = client_data;
+    int nested = he_conn_enter(conn), nreads = 0;
+    size_t received = 0;
+    ssize_t nread;
+
+    if ((mask & HE_ERROR) && conn->zc_ring) he_conn_zc_complete(conn);
+    while (nreads++ < HE_CONN_MAX_READS) {
+        size_t avail;
+
+        if (he_conn_reserve(conn, HE_CONN_READ_MIN) == HE_ERR) {
+            he_conn_abort(conn, ENOMEM);
+            goto end;
+        }
+        avail = conn->isize - conn->wpos;
+        nread = read(fd, conn->ibuf + conn->wpos, avail);
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            he_conn_abort(conn, errno);
+            goto end;
+        }
+        if (nread == 0) {
+            if (received && conn->read_proc)
+                conn->read_proc(conn, conn->client_data);
+            he_conn_abort(conn, 0);
+            goto end;
+        }
+        conn->wpos += nread;
+        received += nread;
+        if ((size_t)nread < avail) break;
+    }
+    /* Stopped on the read budget with data possibly left in the socket;
+     * an edge-triggered fd will not report it again by itself. */
+    if (nreads > HE_CONN_MAX_READS)
+        he_set_file_ready(event_loop, fd, HE_READABLE);
+    if (received && conn->read_proc)
+        conn->read_proc(conn, conn->client_data);
+
+end:
+    he_conn_leave(conn, nested);
+}
+
+he_conn *he_create_conn(he_event_loop *event_loop, int fd, he_conn_proc *read_proc,
+    he_conn_close_proc *close_proc, void *client_data)
+{
+    he_conn *conn;
+
+    if ((conn = calloc(1, sizeof(*conn))) == NULL) return NULL;
+    if ((conn->pool = he_get_loop_pool(event_loop)) == NULL) {
+        free(conn);
+        return NULL;
+    }
+    conn->event_loop = event_loop;
+    conn->fd = fd;
+    conn->read_proc = read_proc;
+    conn->close_proc = close_proc;
+    conn->client_data = client_data;
+    conn->flush_task.proc = he_conn_flush_task;
+    conn->flush_task.arg = conn;
+    if (he_create_file_event(event_loop, fd, HE_READABLE,
+        he_conn_read_handler, conn) == HE_ERR) {
+        free(conn);
+        return NULL;
+    }
+    conn->flags |= HE_CONN_READING;
+    return conn;
+}
+
+/* high_water_proc runs once the queued output reaches high_water and
+ * low_water_proc once it drains back to low_water. A zero high_water
+ * disables both. */
+void he_conn_set_water_marks(he_conn *conn, size_t low_water, size_t high_water,
+    he_conn_proc *high_water_proc, he_conn_proc *low_water_proc)
+{
+    conn->low_water = low_water;
+    conn->high_water = high_water;
+    conn->high_water_proc = high_water_proc;
+    conn->low_water_proc = low_water_proc;
+}
+
+int he_conn_set_reading(he_conn *conn, int enable)
+{
+    if (conn->flags & HE_CONN_CLOSED) return HE_ERR;
+    if (enable && !(conn->flags & HE_CONN_READING)) {
+        if (he_create_file_event(conn->event_loop, conn->fd, HE_READABLE,
+            he_conn_read_handler, conn) == HE_ERR)
+            return HE_ERR;
+        conn->flags |= HE_CONN_READING;
+    } else if (!enable && (conn->flags & HE_CONN_READING)) {
+        he_delete_file_event(conn->event_loop, conn->fd, HE_READABLE);
+        conn->flags &= ~HE_CONN_READING;
+        he_conn_zc_watch(conn);
+    }
+    return HE_OK;
+}
+
+/* Buffer every write until the end of the current loop iteration, so
+ * many small writes issued by different handlers go out in one writev. */
+void he_conn_set_coalesce(he_conn *conn, int enable)
+{
+    if (enable) conn->flags |= HE_CONN_COALESCE;
+    else conn->flags &= ~HE_CONN_COALESCE;
+}
+
+char *he_conn_input(he_conn *conn, size_t *len)
+{
+    *len = conn->wpos - conn->rpos;
+    return conn->ibuf + conn->rpos;
+}
+
+void he_conn_consume(he_conn *conn, size_t len)
+{
+    if (len > conn->wpos - conn->rpos) len = conn->wpos - conn->rpos;
+    conn->rpos += len;
+    if (conn->rpos == conn->wpos) conn->rpos = conn->wpos = 0;
+}
+
+/* Makes room for len more input bytes up front, for a reader that knows
+ * how large the message it is waiting for is. Compacts the buffer, so
+ * pointers from he_conn_input are invalid afterwards. A no-op once the
+ * conn is closed. */
+int he_conn_reserve_input(he_conn *conn, size_t len)
+{
+    if (conn->flags & HE_CONN_CLOSED) return HE_OK;
+    return he_conn_reserve(conn, len);
+}
+
+static int he_conn_queue(he_conn *conn, const char *buf, size_t len)
+{
+    he_chunk *chunk = conn->otail;
+    size_t size;
+
+    if (chunk && !chunk->free_proc && chunk->size > chunk->len) {
+        size_t n = chunk->size - chunk->len;
+
+        if (n > len) n = len;
+        memcpy(chunk->data + chunk->len, buf, n);
+        chunk->len += n;
+        conn->olen += n;
+        buf += n;
+        len -= n;
+    }
+    if (len == 0) return HE_OK;
+    size = sizeof(*chunk) + len;
+    if (size < HE_CONN_CHUNK_SIZE) size = HE_CONN_CHUNK_SIZE;
+    if ((chunk = he_pool_alloc(conn->pool, size, &size)) == NULL) return HE_ERR;
+    chunk->next = NULL;
+    chunk->data = (char*)(chunk + 1);
+    chunk->pos = 0;
+    chunk->len = len;
+    chunk->size = size - sizeof(*chunk);
+    chunk->zc_refs = 0;
+    chunk->free_proc = NULL;
+    chunk->free_arg = NULL;
+    memcpy(chunk->data, buf, len);
+    if (conn->otail) conn->otail->next = chunk;
+    else conn->ohead = chunk;
+    conn->otail = chunk;
+    conn->olen += len;
+    return HE_OK;
+}
+
+/* With an empty queue the data is written straight to the socket and only
+ * the part the kernel did not take is copied, unless the conn coalesces
+ * writes. */
+int he_conn_write(he_conn *conn, const void *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    return he_conn_writev(conn, &iov, 1);
+}
+
+/* he_conn_write for a gather list: one writev with an empty queue, e.g. a
+ * protocol header and its payload without joining them first. */
+int he_conn_writev(he_conn *conn, const struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten = 0;
+    size_t len;
+    int i, nested, closed, queued = 0;
+
+    if (conn->flags & HE_CONN_CLOSED) return HE_ERR;
+    if (conn->olen == 0 && !(conn->flags & HE_CONN_COALESCE) && iovcnt <= IOV_MAX) {
+        if ((nwritten = writev(conn->fd, iov, iovcnt)) == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                nested = he_conn_enter(conn);
+                he_conn_abort(conn, errno);
+                he_conn_leave(conn, nested);
+                return HE_ERR;
+            }
+            nwritten = 0;
+        }
+    }
+    for (i = 0; i < iovcnt; i++) {
+        len = iov[i].iov_len;
+        if ((size_t)nwritten >= len) {
+            nwritten -= len;
+            continue;
+        }
+        /* Part of the data may be on the wire already: dropping the rest
+         * would corrupt the stream. */
+        if (he_conn_queue(conn, (const char*)iov[i].iov_base + nwritten,
+            len - nwritten) == HE_ERR) {
+            nested = he_conn_enter(conn);
+            he_conn_abort(conn, ENOMEM);
+            he_conn_leave(conn, nested);
+            return HE_ERR;
+        }
+        nwritten = 0;
+        queued = 1;
+    }
+    if (!queued) return HE_OK;
+    nested = he_conn_enter(conn);
+    if (he_conn_schedule(conn) == HE_OK) he_conn_check_water(conn);
+    closed = conn->flags & HE_CONN_CLOSED;
+    he_conn_leave(conn, nested);
+    return closed ? HE_ERR : HE_OK;
+}
+
+/* Sends of at least threshold bytes (HE_CONN_ZEROCOPY_MIN if 0) through
+ * he_conn_write_zc use MSG_ZEROCOPY. */
+int he_conn_enable_zerocopy(he_conn *conn, size_t threshold)
+{
+    if (conn->zc_ring == NULL) {
+        if (hnet_enable_zerocopy(NULL, conn->fd) == HNET_ERR) return HE_ERR;
+        if ((conn->zc_ring = malloc(sizeof(he_chunk*) * 64)) == NULL) return HE_ERR;
+        conn->zc_ring_size = 64;
+    }
+    conn->zc_threshold = threshold ? threshold : HE_CONN_ZEROCOPY_MIN;
+    return HE_OK;
+}
+
+/* Queue buf without copying it. free_proc(buf, arg) runs once the kernel
+ * no longer references the memory, i.e. after the zerocopy completion.
+ * Small writes, or a conn without zerocopy, are copied and release buf
+ * right away. */
+int he_conn_write_zc(he_conn *conn, const void *buf, size_t len,
+    he_conn_free_proc *free_proc, void *arg)
+{
+    he_chunk *chunk;
+    int nested, closed, ret;
+
+    if (conn->flags & HE_CONN_CLOSED) return HE_ERR;
+    if (!conn->zc_threshold || len < conn->zc_threshold) {
+        ret = he_conn_write(conn, buf, len);
+        free_proc((void*)buf, arg);
+        return ret;
+    }
+    if ((chunk = he_pool_alloc(conn->pool, sizeof(*chunk), NULL)) == NULL)
+        return HE_ERR;
+    chunk->next = NULL;
+    chunk->data = (char*)buf;
+    chunk->pos = 0;
+    chunk->len = len;
+    chunk->size = len;
+    chunk->zc_refs = 0;
+    chunk->free_proc = free_proc;
+    chunk->free_arg = arg;
+    if (conn->otail) conn->otail->next = chunk;
+    else conn->ohead = chunk;
+    conn->otail = chunk;
+    conn->olen += len;
+    nested = he_conn_enter(conn);
+    if (((conn->flags & HE_CONN_COALESCE) || conn->olen != len ||
+        he_conn_flush(conn) == HE_OK) && he_conn_schedule(conn) == HE_OK)
+        he_conn_check_water(conn);
+    closed = conn->flags & HE_CONN_CLOSED;
+    he_conn_leave(conn, nested);
+    return closed ? HE_ERR : HE_OK;
+}
+
+size_t he_conn_pending(he_conn *conn)
+{
+    return conn->olen;
+}
+
+/* Closes the fd and drops any unsent output. close_proc is not called. */
+void he_conn_close(he_conn *conn)
+{
+    if (conn->flags & HE_CONN_CLOSED) return;
+    he_conn_release(conn);
+    if (!(conn->flags & HE_CONN_IN_CALLBACK)) he_conn_free(conn);
+}
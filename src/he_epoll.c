@@ -1,78 +1,189 @@
 #include <sys/epoll.h>
 
-typedef struct he_api_state {
+/* Interest changes on a registered fd (EPOLL_CTL_MOD) are not issued
+ * right away: the fd is put on the dirty list and reconciled with what the
+ * kernel has once, right before epoll_wait. Toggling HE_WRITABLE on and off
+ * within one iteration then costs no syscall at all. ADD and DEL still go
+ * straight to the kernel, since the fd may be closed right after a DEL. */
+typedef struct he_epoll_fd {
+    unsigned int events;
+    int dirty;
+} he_epoll_fd;
+
+typedef struct he_epoll_state {
     int epfd;
     struct epoll_event *events;
-} he_api_state;
+    he_epoll_fd *fds;
+    int *dirty;
+    int ndirty;
+} he_epoll_state;
 
-static int he_api_create(he_event_loop *event_loop) 
+static int he_epoll_create(he_event_loop *event_loop) 
 {
-    he_api_state *state = malloc(sizeof(he_api_state));
+    he_epoll_state *state = calloc(1, sizeof(he_epoll_state));
 
     if (!state) return -1;
-    state->events = malloc(sizeof(struct epoll_event) * event_loop->setsize);
-    if (!state->events) {
-        free(state);
-        return -1;
-    }
+    state->events = malloc(sizeof(struct epoll_event) * event_loop->maxevents);
+    state->fds = calloc(event_loop->setsize, sizeof(he_epoll_fd));
+    state->dirty = malloc(sizeof(int) * event_loop->setsize);
+    if (!state->events || !state->fds || !state->dirty) goto err;
     state->epfd = epoll_create(1024);
-    if (state->epfd == -1) {
+    if (state->epfd == -1) goto err;
+    event_loop->apidata = state;
+    return 0;
+
+err:
+    free(state->events);
+    free(state->fds);
+    free(state->dirty);
+    free(state);
+    return -1;
+}
+
+static int he_epoll_resize(he_event_loop *event_loop, int setsize, int maxevents)
+{
+    he_epoll_state *state = event_loop->apidata;
+    struct epoll_event *events = NULL;
+    he_epoll_fd *fds;
+    int *dirty, j, n = 0;
+
+    if (maxevents != event_loop->maxevents) {
+        events = malloc(sizeof(struct epoll_event) * maxevents);
+        if (events == NULL) return -1;
+    }
+    if (setsize != event_loop->setsize) {
+        if ((dirty = malloc(sizeof(int) * setsize)) == NULL) {
+            free(events);
+            return -1;
+        }
+        if ((fds = realloc(state->fds, sizeof(he_epoll_fd) * setsize)) == NULL) {
+            free(events);
+            free(dirty);
+            return -1;
+        }
+        if (setsize > event_loop->setsize)
+            memset(fds + event_loop->setsize, 0,
+                sizeof(he_epoll_fd) * (setsize - event_loop->setsize));
+        for (j = 0; j < state->ndirty; j++)
+            if (state->dirty[j] < setsize) dirty[n++] = state->dirty[j];
+        free(state->dirty);
+        state->dirty = dirty;
+        state->ndirty = n;
+        state->fds = fds;
+    }
+    if (events) {
         free(state->events);
-        free(state);
-        return -1;
+        state->events = events;
     }
-    event_loop->apidata = state;
     return 0;
 }
 
-static void he_api_free(he_event_loop *event_loop) 
+static void he_epoll_free(he_event_loop *event_loop) 
 {
-    he_api_state *state = event_loop->apidata;
+    he_epoll_state *state = event_loop->apidata;
 
     close(state->epfd);
     free(state->events);
+    free(state->fds);
+    free(state->dirty);
     free(state);
 }
 
-static int he_api_add_event(he_event_loop *event_loop, int fd, int mask) 
+static unsigned int he_epoll_mask_to_events(int mask)
+{
+    unsigned int events = 0;
+
+    /* Edge-triggered fds are registered for both directions once and
+     * only filtered in user space afterwards. */
+    if (mask & HE_EDGE) mask |= HE_READABLE | HE_WRITABLE;
+    if (mask & HE_READABLE) events |= EPOLLIN;
+    if (mask & HE_WRITABLE) events |= EPOLLOUT;
+    if (mask & HE_EDGE) events |= EPOLLET;
+    if (mask & HE_EXCLUSIVE) events |= EPOLLEXCLUSIVE;
+    return events;
+}
+
+static void he_epoll_mark_dirty(he_epoll_state *state, int fd)
 {
-    he_api_state *state = event_loop->apidata;
+    if (state->fds[fd].dirty) return;
+    state->fds[fd].dirty = 1;
+    state->dirty[state->ndirty++] = fd;
+}
+
+static int he_epoll_add_event(he_event_loop *event_loop, int fd, int mask) 
+{
+    he_epoll_state *state = event_loop->apidata;
     struct epoll_event ee = {0};
-    int op = event_loop->events[fd].mask == HE_NONE ?
-            EPOLL_CTL_ADD : EPOLL_CTL_MOD;
-
-    ee.events = 0;
-    mask |= event_loop->events[fd].mask;
-    if (mask & HE_READABLE) ee.events |= EPOLLIN;
-    if (mask & HE_WRITABLE) ee.events |= EPOLLOUT;
-    ee.data.fd = fd;
-    if (epoll_ctl(state->epfd, op, fd, &ee) == -1) return -1;
+    int oldmask = event_loop->events[fd].mask;
+
+    if (oldmask != HE_NONE) {
+        if (!(oldmask & HE_EDGE)) he_epoll_mark_dirty(state, fd);
+        return 0;
+    }
+    ee.events = he_epoll_mask_to_events(mask);
+    ee.data.u64 = HE_HANDLE(fd, event_loop->events[fd].gen);
+    if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, fd, &ee) == -1) return -1;
+    state->fds[fd].events = ee.events;
     return 0;
 }
 
-static void he_api_del_event(he_event_loop *event_loop, int fd, int delmask) 
+static void he_epoll_del_event(he_event_loop *event_loop, int fd, int delmask) 
 {
-    he_api_state *state = event_loop->apidata;
+    he_epoll_state *state = event_loop->apidata;
     struct epoll_event ee = {0};
     int mask = event_loop->events[fd].mask & (~delmask);
 
-    ee.events = 0;
-    if (mask & HE_READABLE) ee.events |= EPOLLIN;
-    if (mask & HE_WRITABLE) ee.events |= EPOLLOUT;
-    ee.data.fd = fd;
-    if (mask != HE_NONE) {
-        epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);
-    } else {
-        epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
+    if (mask & (HE_READABLE|HE_WRITABLE)) {
+        if (!(mask & HE_EDGE)) he_epoll_mark_dirty(state, fd);
+        return;
     }
+    epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
+    state->fds[fd].events = 0;
 }
 
-static int he_api_poll(he_event_loop *event_loop, int timeout) 
+/* Apply the pending interest changes, skipping the ones that ended up
+ * where they started. */
+static void he_epoll_flush(he_event_loop *event_loop)
 {
-    he_api_state *state = event_loop->apidata;
+    he_epoll_state *state = event_loop->apidata;
+    int j;
+
+    for (j = 0; j < state->ndirty; j++) {
+        int fd = state->dirty[j];
+        he_epoll_fd *f = &state->fds[fd];
+        struct epoll_event ee = {0};
+
+        f->dirty = 0;
+        if (event_loop->events[fd].mask == HE_NONE) continue;
+        ee.events = he_epoll_mask_to_events(event_loop->events[fd].mask);
+        if (ee.events == f->events) continue;
+        ee.data.u64 = HE_HANDLE(fd, event_loop->events[fd].gen);
+        /* The kernel refuses EPOLL_CTL_MOD on an EPOLLEXCLUSIVE fd. */
+        if (f->events & EPOLLEXCLUSIVE) {
+            struct epoll_event del = {0};
+
+            epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &del);
+            f->events = 0;
+            if (epoll_ctl(state->epfd, EPOLL_CTL_ADD, fd, &ee) == 0)
+                f->events = ee.events;
+            else
+                event_loop->ctl_errors++;
+        } else if (epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee) == 0) {
+            f->events = ee.events;
+        } else {
+            event_loop->ctl_errors++;
+        }
+    }
+    state->ndirty = 0;
+}
+
+static int he_epoll_poll(he_event_loop *event_loop, int timeout) 
+{
+    he_epoll_state *state = event_loop->apidata;
     int retval, numevents = 0;
 
-    retval = epoll_wait(state->epfd, state->events, event_loop->setsize, timeout);
+    he_epoll_flush(event_loop);
+    retval = epoll_wait(state->epfd, state->events, event_loop->maxevents, timeout);
     if (retval > 0) {
         int j;
 
@@ -83,11 +194,22 @@ static int he_api_poll(he_event_loop *event_loop, int timeout)
 
             if (e->events & EPOLLIN) mask |= HE_READABLE;
             if (e->events & EPOLLOUT) mask |= HE_WRITABLE;
-            if (e->events & EPOLLERR) mask |= HE_WRITABLE | HE_READABLE;
+            if (e->events & EPOLLERR) mask |= HE_WRITABLE | HE_READABLE | HE_ERROR;
             if (e->events & EPOLLHUP) mask |= HE_WRITABLE | HE_READABLE;
-            event_loop->fired[j].fd = e->data.fd;
+            event_loop->fired[j].fd = HE_HANDLE_FD(e->data.u64);
             event_loop->fired[j].mask = mask;
+            event_loop->fired[j].gen = HE_HANDLE_GEN(e->data.u64);
         }
     }
     return numevents;
 }
+
+static const he_api he_epoll_api = {
+    "epoll",
+    he_epoll_create,
+    he_epoll_free,
+    he_epoll_add_event,
+    he_epoll_del_event,
+    he_epoll_poll,
+    he_epoll_resize
+};
@@ -0,0 +1,148 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "he.h"
+#include "he_conn.h"
+#include "he_frame.h"
+
+static size_t he_frame_decode(const he_frame_codec *codec, const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    size_t len = 0;
+    int i;
+
+    if (codec->byte_order == HE_FRAME_BIG_ENDIAN) {
+        for (i = 0; i < codec->header_size; i++) len = (len << 8) | u[i];
+    } else {
+        for (i = codec->header_size - 1; i >= 0; i--) len = (len << 8) | u[i];
+    }
+    return len;
+}
+
+static void he_frame_encode(const he_frame_codec *codec, char *p, size_t len)
+{
+    unsigned char *u = (unsigned char *)p;
+    int i;
+
+    for (i = 0; i < codec->header_size; i++) {
+        int shift = codec->byte_order == HE_FRAME_BIG_ENDIAN ?
+            codec->header_size - 1 - i : i;
+
+        u[shift] = (unsigned char)(len >> (8 * i));
+    }
+}
+
+static int he_frame_grow(he_frame_codec *codec)
+{
+    int size = codec->views_size * 2;
+    he_frame_view *views = realloc(codec->views, sizeof(he_frame_view) * size);
+
+    if (views == NULL) return HE_ERR;
+    codec->views = views;
+    codec->views_size = size;
+    return HE_OK;
+}
+
+/* header_size is 2 or 4. max_frame is the largest payload accepted or
+ * sent; 0 means the most the header can express. */
+he_frame_codec *he_create_frame_codec(int header_size, int byte_order,
+    size_t max_frame)
+{
+    he_frame_codec *codec;
+    size_t limit = header_size == 2 ? 0xffff : 0xffffffff;
+
+    if ((header_size != 2 && header_size != 4) ||
+        (byte_order != HE_FRAME_BIG_ENDIAN && byte_order != HE_FRAME_LITTLE_ENDIAN) ||
+        max_frame > limit) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((codec = calloc(1, sizeof(*codec))) == NULL) return NULL;
+    if ((codec->views = malloc(sizeof(he_frame_view) * HE_FRAME_BATCH)) == NULL) {
+        free(codec);
+        return NULL;
+    }
+    codec->header_size = header_size;
+    codec->byte_order = byte_order;
+    codec->max_frame = max_frame ? max_frame : limit;
+    codec->views_size = HE_FRAME_BATCH;
+    return codec;
+}
+
+void he_delete_frame_codec(he_frame_codec *codec)
+{
+    free(codec->views);
+    free(codec);
+}
+
+/* Call from conn's read proc. All complete frames in the input buffer go
+ * to proc in one call. Returns HE_ERR with errno EMSGSIZE when a header
+ * announces more than max_frame, after delivering the frames before it;
+ * the stream cannot be resynchronized and the caller should close conn. */
+int he_frame_read(he_frame_codec *codec, he_conn *conn, he_frame_proc *proc,
+    void *client_data)
+{
+    size_t len, off = 0, flen = 0, hs = codec->header_size;
+    char *buf = he_conn_input(conn, &len);
+    int count = 0, err = 0;
+
+    while (len - off >= hs) {
+        flen = he_frame_decode(codec, buf + off);
+        if (flen > codec->max_frame) {
+            err = EMSGSIZE;
+            break;
+        }
+        if (len - off - hs < flen) break;
+        if (count == codec->views_size && he_frame_grow(codec) == HE_ERR) {
+            err = ENOMEM;
+            break;
+        }
+        codec->views[count].data = buf + off + hs;
+        codec->views[count].len = flen;
+        count++;
+        off += hs + flen;
+    }
+    /* Consuming only moves rpos, the views stay valid; done before proc
+     * so a proc that closes conn cannot leave it half consumed. */
+    he_conn_consume(conn, off);
+    if (count) {
+        codec->frames += count;
+        codec->batches++;
+        proc(conn, codec->views, count, client_data);
+    }
+    if (err) {
+        errno = err;
+        return HE_ERR;
+    }
+    /* A large frame still arriving: size the buffer for all of it now
+     * rather than doubling and compacting it read by read. */
+    buf = he_conn_input(conn, &len);
+    if (len >= hs && (flen = he_frame_decode(codec, buf)) <= codec->max_frame &&
+        he_conn_reserve_input(conn, hs + flen - len) == HE_ERR) {
+        errno = ENOMEM;
+        return HE_ERR;
+    }
+    return HE_OK;
+}
+
+/* Header and payload go out with a single writev when nothing is queued. */
+int he_frame_write(he_frame_codec *codec, he_conn *conn, const void *buf,
+    size_t len)
+{
+    char header[4];
+    struct iovec iov[2];
+
+    if (len > codec->max_frame) {
+        errno = EMSGSIZE;
+        return HE_ERR;
+    }
+    he_frame_encode(codec, header, len);
+    iov[0].iov_base = header;
+    iov[0].iov_len = codec->header_size;
+    iov[1].iov_base = (void*)buf;
+    iov[1].iov_len = len;
+    return he_conn_writev(conn, iov, len ? 2 : 1);
+}
@@ -0,0 +1,233 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "he.h"
+#include "he_group.h"
+#include "hnet.h"
+
+typedef struct he_group_thread {
+    pthread_t tid;
+    int started;
+    he_loop_group *group;
+    int index;
+    int first_cpu;
+    int ncpus;
+} he_group_thread;
+
+typedef struct he_group_setup {
+    he_group_thread *thread;
+    int setsize;
+    long long update_ms;
+    he_update_proc *proc;
+    void *client_data;
+} he_group_setup;
+
+/* Creates the loop from a thread that is already pinned to the loop's
+ * CPUs, so the fd table and fired array are first touched, and thus
+ * placed, on their NUMA node. */
+static void *he_group_setup_thread(void *arg)
+{
+    he_group_setup *setup = arg;
+    he_group_thread *thread = setup->thread;
+    he_loop_group *group = thread->group;
+    const int *cpus = group->cpus + thread->first_cpu;
+    he_event_loop *event_loop;
+
+    if (he_set_thread_affinity(cpus, thread->ncpus) == HE_ERR) return NULL;
+    event_loop = he_create_event_loop(setup->setsize, setup->update_ms,
+        setup->proc, setup->client_data);
+    if (event_loop && he_pin_loop(event_loop, cpus, thread->ncpus) == HE_ERR) {
+        he_delete_event_loop(event_loop);
+        event_loop = NULL;
+    }
+    group->loops[thread->index] = event_loop;
+    return NULL;
+}
+
+he_loop_group *he_create_loop_group(int nloops, int setsize, long long update_ms,
+    he_update_proc *proc, void *client_data)
+{
+    return he_create_loop_group_cpus(nloops, setsize, update_ms, proc,
+        client_data, NULL, 0);
+}
+
+/* Like he_create_loop_group, with every loop pinned to part of cpus. With
+ * ncpus >= nloops each loop gets its own contiguous slice of the array,
+ * e.g. the CPUs of one node, otherwise loops share the CPUs one each,
+ * round-robin. Each loop is created on its pinned thread and its buffer
+ * pool prefers the local node. */
+he_loop_group *he_create_loop_group_cpus(int nloops, int setsize, long long update_ms,
+    he_update_proc *proc, void *client_data, const int *cpus, int ncpus)
+{
+    he_loop_group *group;
+    he_group_setup setup;
+    pthread_t tid;
+    int i;
+
+    if (nloops <= 0 || (cpus && ncpus <= 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((group = calloc(1, sizeof(*group))) == NULL) return NULL;
+    group->nloops = nloops;
+    group->loops = calloc(nloops, sizeof(he_event_loop*));
+    group->threads = calloc(nloops, sizeof(he_group_thread));
+    group->listeners = malloc(sizeof(int) * nloops);
+    if (!group->loops || !group->threads || !group->listeners) goto err;
+    if (cpus) {
+        if ((group->cpus = malloc(sizeof(int) * ncpus)) == NULL) goto err;
+        memcpy(group->cpus, cpus, sizeof(int) * ncpus);
+        group->ncpus = ncpus;
+    }
+    for (i = 0; i < nloops; i++) {
+        he_group_thread *thread = &group->threads[i];
+
+        thread->group = group;
+        thread->index = i;
+        if (ncpus >= nloops) {
+            thread->first_cpu = i * ncpus / nloops;
+            thread->ncpus = (i + 1) * ncpus / nloops - thread->first_cpu;
+        } else if (ncpus > 0) {
+            thread->first_cpu = i % ncpus;
+            thread->ncpus = 1;
+        }
+    }
+    for (i = 0; i < nloops; i++) {
+        if (group->cpus == NULL) {
+            group->loops[i] = he_create_event_loop(setsize, update_ms, proc, client_data);
+        } else {
+            setup.thread = &group->threads[i];
+            setup.setsize = setsize;
+            setup.update_ms = update_ms;
+            setup.proc = proc;
+            setup.client_data = client_data;
+            if (pthread_create(&tid, NULL, he_group_setup_thread, &setup) != 0)
+                goto err;
+            pthread_join(tid, NULL);
+        }
+        if (group->loops[i] == NULL) goto err;
+    }
+    return group;
+
+err:
+    he_delete_loop_group(group);
+    return NULL;
+}
+
+void he_delete_loop_group(he_loop_group *group)
+{
+    int i;
+
+    if (group->loops) {
+        for (i = 0; i < group->nloops; i++)
+            if (group->loops[i]) he_delete_event_loop(group->loops[i]);
+    }
+    for (i = 0; i < group->nlisteners; i++)
+        close(group->listeners[i]);
+    free(group->loops);
+    free(group->threads);
+    free(group->listeners);
+    free(group->cpus);
+    free(group);
+}
+
+he_event_loop *he_loop_group_get(he_loop_group *group, int index)
+{
+    if (index < 0 || index >= group->nloops) return NULL;
+    return group->loops[index];
+}
+
+/* HE_GROUP_REUSEPORT gives every loop its own SO_REUSEPORT listener and lets
+ * the kernel hash connections across them. HE_GROUP_EXCLUSIVE shares one
+ * listener between all loops and registers it with EPOLLEXCLUSIVE so a new
+ * connection wakes only one of them. */
+int he_loop_group_tcp_server(char *err, he_loop_group *group, int port,
+    char *bindaddr, int backlog, int mode, he_file_proc *proc, void *client_data)
+{
+    int i, s = HNET_ERR, nlisteners = 0;
+
+    if (group->running || group->nlisteners) {
+        errno = EBUSY;
+        return HE_ERR;
+    }
+    for (i = 0; i < group->nloops; i++) {
+        if (mode == HE_GROUP_REUSEPORT || i == 0) {
+            if ((s = hnet_tcp_server(err, port, bindaddr, backlog,
+                mode == HE_GROUP_REUSEPORT)) == HNET_ERR)
+                goto err;
+            group->listeners[nlisteners++] = s;
+            if (hnet_nonblock(err, s) == HNET_ERR) goto err;
+        }
+        if (he_create_file_event(group->loops[i], s,
+            mode == HE_GROUP_EXCLUSIVE ? HE_READABLE|HE_EXCLUSIVE : HE_READABLE,
+            proc, client_data) == HE_ERR)
+            goto err;
+    }
+    group->nlisteners = nlisteners;
+    return HE_OK;
+
+err:
+    while (i-- > 0)
+        he_delete_file_event(group->loops[i], mode == HE_GROUP_EXCLUSIVE ?
+            group->listeners[0] : group->listeners[i], HE_READABLE);
+    while (nlisteners--)
+        close(group->listeners[nlisteners]);
+    return HE_ERR;
+}
+
+static void *he_loop_group_thread(void *arg)
+{
+    he_group_thread *thread = arg;
+    he_event_loop *event_loop = thread->group->loops[thread->index];
+
+    if (thread->group->cpus)
+        he_pin_loop(event_loop, thread->group->cpus + thread->first_cpu, thread->ncpus);
+    he_main(event_loop);
+    return NULL;
+}
+
+int he_loop_group_start(he_loop_group *group)
+{
+    int i;
+
+    if (group->running) {
+        errno = EBUSY;
+        return HE_ERR;
+    }
+    for (i = 0; i < group->nloops; i++) {
+        if (pthread_create(&group->threads[i].tid, NULL,
+            he_loop_group_thread, &group->threads[i]) != 0) {
+            he_loop_group_stop(group);
+            he_loop_group_join(group);
+            return HE_ERR;
+        }
+        group->threads[i].started = 1;
+    }
+    group->running = 1;
+    return HE_OK;
+}
+
+void he_loop_group_stop(he_loop_group *group)
+{
+    int i;
+
+    for (i = 0; i < group->nloops; i++)
+        if (group->threads[i].started) he_stop(group->loops[i]);
+}
+
+void he_loop_group_join(he_loop_group *group)
+{
+    int i;
+
+    for (i = 0; i < group->nloops; i++) {
+        if (!group->threads[i].started) continue;
+        pthread_join(group->threads[i].tid, NULL);
+        group->threads[i].started = 0;
+    }
+    group->running = 0;
+}
@@ -0,0 +1,211 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "he.h"
+#include "he_pool.h"
+
+#define HE_POOL_REGION_SIZE (256 * 1024)
+#define HE_POOL_HUGE_REGION_SIZE (2 * 1024 * 1024)
+#define HE_POOL_MPOL_PREFERRED 1
+
+static int he_pool_class(size_t size)
+{
+    int shift = HE_POOL_MIN_SHIFT;
+
+    while (((size_t)1 << shift) < size) shift++;
+    return shift - HE_POOL_MIN_SHIFT;
+}
+
+he_pool *he_create_pool(int flags)
+{
+    he_pool *pool;
+
+    if ((pool = calloc(1, sizeof(*pool))) == NULL) return NULL;
+    pool->flags = flags;
+    pool->node = -1;
+    return pool;
+}
+
+void he_delete_pool(he_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nregions; i++)
+        munmap(pool->regions[i], pool->region_sizes[i]);
+    free(pool->regions);
+    free(pool->region_sizes);
+    free(pool);
+}
+
+void he_pool_set_node(he_pool *pool, int node)
+{
+    pool->node = node;
+}
+
+/* mbind through syscall(2) so there is no libnuma dependency. Failure
+ * (no NUMA support, seccomp) only loses the placement hint. */
+static void he_pool_bind(he_pool *pool, void *region, size_t size)
+{
+#ifdef SYS_mbind
+    unsigned long mask;
+
+    if (pool->node < 0 || pool->node >= (int)(sizeof(mask) * 8)) return;
+    mask = 1UL << pool->node;
+    syscall(SYS_mbind, region, size, HE_POOL_MPOL_PREFERRED, &mask,
+        sizeof(mask) * 8 + 1, 0);
+#else
+    HE_NOTUSED(pool);
+    HE_NOTUSED(region);
+    HE_NOTUSED(size);
+#endif
+}
+
+/* Hugepage regions try MAP_HUGETLB first and fall back to normal pages
+ * with a transparent hugepage hint. */
+static int he_pool_add_region(he_pool *pool)
+{
+    size_t size = (pool->flags & HE_POOL_HUGEPAGE) ?
+        HE_POOL_HUGE_REGION_SIZE : HE_POOL_REGION_SIZE;
+    void *region = MAP_FAILED;
+
+    /* Hand the tail of the current region to the largest classes that
+     * fit so it is not wasted. */
+    while (pool->end - pool->cur >= (1 << HE_POOL_MIN_SHIFT)) {
+        size_t left = pool->end - pool->cur;
+        int c = HE_POOL_CLASSES - 1;
+        he_pool_block *block = (he_pool_block*)pool->cur;
+
+        while (((size_t)1 << (c + HE_POOL_MIN_SHIFT)) > left) c--;
+        block->next = pool->free[c];
+        pool->free[c] = block;
+        pool->cur += (size_t)1 << (c + HE_POOL_MIN_SHIFT);
+    }
+
+    if (pool->nregions == pool->regions_size) {
+        int n = pool->regions_size ? pool->regions_size * 2 : 16;
+        void **regions = realloc(pool->regions, sizeof(void*) * n);
+        size_t *sizes;
+
+        if (regions == NULL) return HE_ERR;
+        pool->regions = regions;
+        if ((sizes = realloc(pool->region_sizes, sizeof(size_t) * n)) == NULL)
+            return HE_ERR;
+        pool->region_sizes = sizes;
+        pool->regions_size = n;
+    }
+#ifdef MAP_HUGETLB
+    if (pool->flags & HE_POOL_HUGEPAGE)
+        region = mmap(NULL, size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+    if (region == MAP_FAILED) {
+        region = mmap(NULL, size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) return HE_ERR;
+#ifdef MADV_HUGEPAGE
+        if (pool->flags & HE_POOL_HUGEPAGE) madvise(region, size, MADV_HUGEPAGE);
+#endif
+    }
+    he_pool_bind(pool, region, size);
+    pool->regions[pool->nregions] = region;
+    pool->region_sizes[pool->nregions++] = size;
+    pool->cur = region;
+    pool->end = (char*)region + size;
+    pool->stats.resident += size;
+    return HE_OK;
+}
+
+/* Sizes above the largest class go to malloc. *usable, when given, is
+ * set to the size actually reserved for the caller. */
+void *he_pool_alloc(he_pool *pool, size_t size, size_t *usable)
+{
+    size_t bsize;
+    he_pool_block *block;
+    int c;
+
+    if (size > ((size_t)1 << HE_POOL_MAX_SHIFT)) {
+        pool->stats.oversize++;
+        if (usable) *usable = size;
+        return malloc(size);
+    }
+    c = he_pool_class(size);
+    bsize = (size_t)1 << (c + HE_POOL_MIN_SHIFT);
+    if ((block = pool->free[c]) != NULL) {
+        pool->free[c] = block->next;
+        pool->stats.hits++;
+    } else {
+        pool->stats.misses++;
+        if ((size_t)(pool->end - pool->cur) < bsize &&
+            he_pool_add_region(pool) == HE_ERR)
+            return NULL;
+        block = (he_pool_block*)pool->cur;
+        pool->cur += bsize;
+    }
+    pool->stats.in_use += bsize;
+    if (usable) *usable = bsize;
+    return block;
+}
+
+void he_pool_free(he_pool *pool, void *ptr, size_t size)
+{
+    he_pool_block *block = ptr;
+    int c;
+
+    if (ptr == NULL) return;
+    if (size > ((size_t)1 << HE_POOL_MAX_SHIFT)) {
+        free(ptr);
+        return;
+    }
+    c = he_pool_class(size);
+    block->next = pool->free[c];
+    pool->free[c] = block;
+    pool->stats.in_use -= (size_t)1 << (c + HE_POOL_MIN_SHIFT);
+}
+
+void *he_pool_realloc(he_pool *pool, void *ptr, size_t oldsize, size_t size,
+    size_t *usable)
+{
+    void *newptr;
+    size_t max = (size_t)1 << HE_POOL_MAX_SHIFT;
+
+    if (ptr && oldsize > max && size > max) {
+        pool->stats.oversize++;
+        if ((newptr = realloc(ptr, size)) == NULL) return NULL;
+        if (usable) *usable = size;
+        return newptr;
+    }
+    if ((newptr = he_pool_alloc(pool, size, usable)) == NULL) return NULL;
+    if (ptr) {
+        memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+        he_pool_free(pool, ptr, oldsize);
+    }
+    return newptr;
+}
+
+void he_pool_get_stats(he_pool *pool, he_pool_stats *stats)
+{
+    *stats = pool->stats;
+}
+
+int he_init_loop_pool(he_event_loop *event_loop, int flags)
+{
+    if (event_loop->pool) {
+        errno = EBUSY;
+        return HE_ERR;
+    }
+    if ((event_loop->pool = he_create_pool(flags)) == NULL) return HE_ERR;
+    if (event_loop->pinned) he_pool_set_node(event_loop->pool, event_loop->numa_node);
+    return HE_OK;
+}
+
+he_pool *he_get_loop_pool(he_event_loop *event_loop)
+{
+    if (event_loop->pool == NULL) he_init_loop_pool(event_loop, 0);
+    return event_loop->pool;
+}
@@ -0,0 +1,436 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "he.h"
+#include "he_resolver.h"
+
+typedef struct he_resolve_req {
+    he_task task;
+    struct he_resolve_req *next;
+    he_resolver *resolver;
+    char *host;
+    int port;
+    int family;
+    int err;
+    int cached;
+    int naddrs;
+    struct sockaddr_storage addrs[HE_RESOLVE_MAX_ADDRS];
+    he_resolve_proc *proc;
+    void *client_data;
+} he_resolve_req;
+
+/* Requests waiting for a helper thread. Only the queue is shared with the
+ * threads; everything else in the resolver is touched by the loop only.
+ * The helpers are detached and hold a reference each, so the queue
+ * outlives a resolver deleted while a lookup is still running. running
+ * counts the requests the helpers hold. Once stop is set they drop those
+ * instead of posting them. */
+typedef struct he_resolve_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    he_event_loop *event_loop;
+    he_resolve_req *head;
+    he_resolve_req *tail;
+    int running;
+    int stop;
+    int refs;
+} he_resolve_queue;
+
+typedef struct he_resolve_entry {
+    struct he_resolve_entry *next;
+    char *host;
+    int family;
+    long long expires;
+    int naddrs;
+    struct sockaddr_storage addrs[HE_RESOLVE_MAX_ADDRS];
+} he_resolve_entry;
+
+static long long he_resolve_mstime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned int he_resolve_hash(const char *host, int family)
+{
+    unsigned int h = 5381;
+
+    while (*host) h = h * 33 + (unsigned char)*host++;
+    return (h ^ (unsigned int)family) % HE_RESOLVE_CACHE_BUCKETS;
+}
+
+static void he_resolve_set_port(struct sockaddr_storage *addrs, int naddrs, int port)
+{
+    int i;
+
+    for (i = 0; i < naddrs; i++) {
+        if (addrs[i].ss_family == AF_INET)
+            ((struct sockaddr_in *)&addrs[i])->sin_port = htons(port);
+        else if (addrs[i].ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)&addrs[i])->sin6_port = htons(port);
+    }
+}
+
+static void he_resolve_free_req(he_resolve_req *req)
+{
+    free(req->host);
+    free(req);
+}
+
+static he_resolve_entry *he_cache_find(he_resolver *resolver, const char *host,
+    int family, long long now)
+{
+    he_resolve_entry **prev, *e;
+
+    if (!resolver->cache) return NULL;
+    prev = &resolver->cache[he_resolve_hash(host, family)];
+    while ((e = *prev) != NULL) {
+        if (e->expires <= now) {
+            *prev = e->next;
+            free(e->host);
+            free(e);
+            resolver->cache_count--;
+            continue;
+        }
+        if (e->family == family && !strcmp(e->host, host)) return e;
+        prev = &e->next;
+    }
+    return NULL;
+}
+
+static void he_cache_purge(he_resolver *resolver, long long now)
+{
+    he_resolve_entry **prev, *e;
+    int i;
+
+    for (i = 0; i < HE_RESOLVE_CACHE_BUCKETS; i++) {
+        prev = &resolver->cache[i];
+        while ((e = *prev) != NULL) {
+            if (e->expires <= now) {
+                *prev = e->next;
+                free(e->host);
+                free(e);
+                resolver->cache_count--;
+            } else {
+                prev = &e->next;
+            }
+        }
+    }
+}
+
+static void he_cache_insert(he_resolver *resolver, he_resolve_req *req)
+{
+    long long now = he_resolve_mstime();
+    he_resolve_entry *e;
+    unsigned int h;
+
+    if (!resolver->cache) return;
+    if ((e = he_cache_find(resolver, req->host, req->family, now)) == NULL) {
+        if (resolver->cache_count >= HE_RESOLVE_CACHE_MAX) {
+            he_cache_purge(resolver, now);
+            if (resolver->cache_count >= HE_RESOLVE_CACHE_MAX) return;
+        }
+        if ((e = malloc(sizeof(*e))) == NULL) return;
+        if ((e->host = strdup(req->host)) == NULL) {
+            free(e);
+            return;
+        }
+        e->family = req->family;
+        h = he_resolve_hash(req->host, req->family);
+        e->next = resolver->cache[h];
+        resolver->cache[h] = e;
+        resolver->cache_count++;
+    }
+    e->expires = now + resolver->ttl_ms;
+    e->naddrs = req->naddrs;
+    memcpy(e->addrs, req->addrs, sizeof(req->addrs[0]) * req->naddrs);
+}
+
+/* Runs on a helper thread. Addresses are stored with port 0 so that they
+ * can be cached independently of the port asked for. */
+static void he_resolve_lookup(he_resolve_req *req)
+{
+    struct addrinfo hints, *res, *p;
+    int rv;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = req->family;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(req->host, NULL, &hints, &res)) != 0) {
+        req->err = rv;
+        return;
+    }
+    for (p = res; p && req->naddrs < HE_RESOLVE_MAX_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+        memset(&req->addrs[req->naddrs], 0, sizeof(struct sockaddr_storage));
+        memcpy(&req->addrs[req->naddrs++], p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(res);
+    if (req->naddrs == 0) req->err = EAI_NONAME;
+}
+
+/* Literal addresses never leave the loop thread. */
+static int he_resolve_numeric(he_resolve_req *req)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&req->addrs[0];
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&req->addrs[0];
+
+    memset(&req->addrs[0], 0, sizeof(req->addrs[0]));
+    if (req->family != AF_INET6 && inet_pton(AF_INET, req->host, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+    } else if (req->family != AF_INET &&
+        inet_pton(AF_INET6, req->host, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+    } else {
+        return 0;
+    }
+    req->naddrs = 1;
+    return 1;
+}
+
+/* Called with the queue locked; unlocks it. */
+static void he_resolve_queue_release(he_resolve_queue *queue)
+{
+    int refs = --queue->refs;
+
+    pthread_mutex_unlock(&queue->lock);
+    if (refs) return;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+}
+
+static void he_resolver_free(he_resolver *resolver)
+{
+    if (resolver->cache) {
+        he_resolver_flush_cache(resolver);
+        free(resolver->cache);
+    }
+    free(resolver);
+}
+
+static void he_resolve_unlink_deferred(he_resolver *resolver, he_resolve_req *req)
+{
+    he_resolve_req **prev = &resolver->deferred;
+
+    while (*prev && *prev != req) prev = &(*prev)->next;
+    if (*prev) *prev = req->next;
+}
+
+static void he_resolve_done(he_event_loop *event_loop, void *arg)
+{
+    he_resolve_req *req = arg;
+    he_resolver *resolver = req->resolver;
+    HE_NOTUSED(event_loop);
+
+    if (req->cached) he_resolve_unlink_deferred(resolver, req);
+    if (!resolver->closing) {
+        if (!req->err && !req->cached) he_cache_insert(resolver, req);
+        he_resolve_set_port(req->addrs, req->naddrs, req->port);
+        req->proc(resolver, req->err, req->addrs, req->naddrs, req->client_data);
+    }
+    /* Counted until proc returned, so a proc deleting the resolver does
+     * not free it under us. */
+    resolver->pending--;
+    he_resolve_free_req(req);
+    if (resolver->closing && resolver->pending == 0) he_resolver_free(resolver);
+}
+
+/* The loop is being deleted with this completion still queued. */
+static void he_resolve_drop(he_event_loop *event_loop, void *arg)
+{
+    he_resolve_req *req = arg;
+    he_resolver *resolver = req->resolver;
+    HE_NOTUSED(event_loop);
+
+    resolver->pending--;
+    he_resolve_free_req(req);
+    if (resolver->closing && resolver->pending == 0) he_resolver_free(resolver);
+}
+
+/* Posting under the lock orders it against he_delete_resolver: a request
+ * finished after the resolver is gone is freed here, never posted. */
+static void *he_resolver_thread(void *arg)
+{
+    he_resolve_queue *queue = arg;
+    he_resolve_req *req;
+
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while (!queue->head && !queue->stop)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        if (queue->stop) break;
+        req = queue->head;
+        queue->head = req->next;
+        if (!queue->head) queue->tail = NULL;
+        queue->running++;
+        pthread_mutex_unlock(&queue->lock);
+        he_resolve_lookup(req);
+        pthread_mutex_lock(&queue->lock);
+        queue->running--;
+        if (queue->stop) {
+            he_resolve_free_req(req);
+            break;
+        }
+        he_post_task(queue->event_loop, &req->task);
+    }
+    he_resolve_queue_release(queue);
+    return NULL;
+}
+
+/* ttl_ms <= 0 disables the cache. */
+he_resolver *he_create_resolver(he_event_loop *event_loop, int nthreads, long long ttl_ms)
+{
+    he_resolver *resolver;
+    he_resolve_queue *queue;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int i;
+
+    if (nthreads <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((resolver = calloc(1, sizeof(*resolver))) == NULL) return NULL;
+    resolver->event_loop = event_loop;
+    resolver->ttl_ms = ttl_ms;
+    if (ttl_ms > 0) {
+        resolver->cache = calloc(HE_RESOLVE_CACHE_BUCKETS, sizeof(he_resolve_entry*));
+        if (!resolver->cache) goto err;
+    }
+    if ((queue = calloc(1, sizeof(*queue))) == NULL) goto err;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    queue->event_loop = event_loop;
+    queue->refs = 1;
+    resolver->queue = queue;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_mutex_lock(&queue->lock);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, &attr, he_resolver_thread, queue) != 0) break;
+        queue->refs++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    pthread_attr_destroy(&attr);
+    resolver->nthreads = i;
+    if (resolver->nthreads == 0) goto err;
+    return resolver;
+
+err:
+    if (resolver->queue) {
+        pthread_mutex_lock(&resolver->queue->lock);
+        he_resolve_queue_release(resolver->queue);
+    }
+    he_resolver_free(resolver);
+    return NULL;
+}
+
+/* Drops the queued lookups and never waits for running ones: a helper
+ * still inside getaddrinfo frees its request when it returns and then
+ * exits. May be called from a resolve proc. No callback runs after this
+ * returns. Completions that were
+ * already posted to the loop are released by its next iteration, or by
+ * he_delete_event_loop. Must be called from the loop thread, and before
+ * the loop is deleted. */
+void he_delete_resolver(he_resolver *resolver)
+{
+    he_resolve_queue *queue = resolver->queue;
+    he_resolve_req *req, *next;
+
+    for (req = resolver->deferred; req; req = next) {
+        next = req->next;
+        he_cancel_defer(resolver->event_loop, &req->task);
+        he_resolve_free_req(req);
+        resolver->pending--;
+    }
+    resolver->deferred = NULL;
+    pthread_mutex_lock(&queue->lock);
+    queue->stop = 1;
+    pthread_cond_broadcast(&queue->cond);
+    for (req = queue->head; req; req = next) {
+        next = req->next;
+        he_resolve_free_req(req);
+        resolver->pending--;
+    }
+    queue->head = queue->tail = NULL;
+    resolver->pending -= queue->running;
+    he_resolve_queue_release(queue);
+    resolver->queue = NULL;
+    resolver->closing = 1;
+    if (resolver->pending == 0) he_resolver_free(resolver);
+}
+
+/* Resolve host for family (AF_INET, AF_INET6 or AF_UNSPEC). proc is never
+ * called from within he_resolve. Cache hits and literal addresses are
+ * answered with he_defer before the loop next sleeps, lookups from a later
+ * iteration once a helper posts them back. */
+int he_resolve(he_resolver *resolver, const char *host, int port, int family,
+    he_resolve_proc *proc, void *client_data)
+{
+    he_resolve_queue *queue = resolver->queue;
+    he_resolve_entry *e;
+    he_resolve_req *req;
+
+    if (resolver->closing || host == NULL || proc == NULL) {
+        errno = EINVAL;
+        return HE_ERR;
+    }
+    if ((req = calloc(1, sizeof(*req))) == NULL) return HE_ERR;
+    if ((req->host = strdup(host)) == NULL) {
+        free(req);
+        return HE_ERR;
+    }
+    req->task.proc = he_resolve_done;
+    req->task.drop = he_resolve_drop;
+    req->task.arg = req;
+    req->resolver = resolver;
+    req->port = port;
+    req->family = family;
+    req->proc = proc;
+    req->client_data = client_data;
+
+    if (he_resolve_numeric(req)) {
+        req->cached = 1;
+    } else if ((e = he_cache_find(resolver, host, family, he_resolve_mstime())) != NULL) {
+        req->cached = 1;
+        req->naddrs = e->naddrs;
+        memcpy(req->addrs, e->addrs, sizeof(e->addrs[0]) * e->naddrs);
+        resolver->hits++;
+    }
+    if (req->cached) {
+        he_defer(resolver->event_loop, &req->task);
+        req->next = resolver->deferred;
+        resolver->deferred = req;
+        resolver->pending++;
+        return HE_OK;
+    }
+    resolver->misses++;
+    resolver->pending++;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail) queue->tail->next = req;
+    else queue->head = req;
+    queue->tail = req;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+    return HE_OK;
+}
+
+void he_resolver_flush_cache(he_resolver *resolver)
+{
+    if (!resolver->cache) return;
+    he_cache_purge(resolver, LLONG_MAX);
+}
@@ -0,0 +1,132 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "he.h"
+#include "he_stats.h"
+
+long long he_ustime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int he_hist_index(unsigned long long value)
+{
+    int msb;
+
+    if (value < HE_HIST_SUB) return (int)value;
+    msb = 63 - __builtin_clzll(value);
+    if (msb >= HE_HIST_MAX_BITS) return HE_HIST_BUCKETS - 1;
+    return HE_HIST_SUB + (msb - HE_HIST_SUB_BITS) * HE_HIST_SUB +
+        (int)((value >> (msb - HE_HIST_SUB_BITS)) - HE_HIST_SUB);
+}
+
+/* Highest value that maps to bucket index. */
+static unsigned long long he_hist_value(int index)
+{
+    int shift;
+
+    if (index < HE_HIST_SUB) return index;
+    shift = (index - HE_HIST_SUB) / HE_HIST_SUB;
+    return (((unsigned long long)(HE_HIST_SUB + (index - HE_HIST_SUB) % HE_HIST_SUB))
+        << shift) + ((1ULL << shift) - 1);
+}
+
+void he_hist_record(he_hist *hist, unsigned long long value)
+{
+    if (hist->count == 0 || value < hist->min) hist->min = value;
+    if (value > hist->max) hist->max = value;
+    hist->count++;
+    hist->sum += value;
+    hist->buckets[he_hist_index(value)]++;
+}
+
+/* percentile is in [0, 100]. Returns 0 for an empty histogram. */
+unsigned long long he_hist_percentile(const he_hist *hist, double percentile)
+{
+    unsigned long long target, seen = 0, value;
+    int i;
+
+    if (hist->count == 0) return 0;
+    if (percentile >= 100) return hist->max;
+    target = (unsigned long long)(percentile / 100 * hist->count + 0.5);
+    if (target == 0) target = 1;
+    for (i = 0; i < HE_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) break;
+    }
+    value = he_hist_value(i < HE_HIST_BUCKETS ? i : HE_HIST_BUCKETS - 1);
+    if (value > hist->max) value = hist->max;
+    if (value < hist->min) value = hist->min;
+    return value;
+}
+
+void he_hist_reset(he_hist *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+void he_hist_merge(he_hist *dst, const he_hist *src)
+{
+    int i;
+
+    if (src->count == 0) return;
+    if (dst->count == 0 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (i = 0; i < HE_HIST_BUCKETS; i++) dst->buckets[i] += src->buckets[i];
+}
+
+int he_enable_stats(he_event_loop *event_loop, int enable)
+{
+    if (enable && event_loop->stats == NULL) {
+        if ((event_loop->stats = calloc(1, sizeof(he_loop_stats))) == NULL)
+            return HE_ERR;
+    } else if (!enable && event_loop->stats) {
+        free(event_loop->stats);
+        event_loop->stats = NULL;
+    }
+    return HE_OK;
+}
+
+/* NULL while stats are disabled. */
+he_loop_stats *he_get_stats(he_event_loop *event_loop)
+{
+    return event_loop->stats;
+}
+
+/* Clears counters and histograms; the slow threshold is kept. */
+void he_reset_stats(he_event_loop *event_loop)
+{
+    he_loop_stats *stats = event_loop->stats;
+    long long slow_usec;
+    he_slow_proc *slow_proc;
+    void *slow_data;
+
+    if (stats == NULL) return;
+    slow_usec = stats->slow_usec;
+    slow_proc = stats->slow_proc;
+    slow_data = stats->slow_data;
+    memset(stats, 0, sizeof(*stats));
+    stats->slow_usec = slow_usec;
+    stats->slow_proc = slow_proc;
+    stats->slow_data = slow_data;
+}
+
+/* proc runs after every callback that took usec or longer, with the
+ * handler that caused it. Enables stats; usec <= 0 turns reporting off. */
+int he_set_slow_threshold(he_event_loop *event_loop, long long usec,
+    he_slow_proc *proc, void *client_data)
+{
+    if (he_enable_stats(event_loop, 1) == HE_ERR) return HE_ERR;
+    event_loop->stats->slow_usec = usec > 0 ? usec : 0;
+    event_loop->stats->slow_proc = proc;
+    event_loop->stats->slow_data = client_data;
+    return HE_OK;
+}
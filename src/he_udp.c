@@ -0,0 +1,412 @@
+#include "fmacros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "he.h"
+#include "he_udp.h"
+#include "he_pool.h"
+#include "hnet.h"
+
+#define HE_UDP_WRITING (1<<0)
+#define HE_UDP_IN_CALLBACK (1<<1)
+#define HE_UDP_CLOSED (1<<2)
+
+static void he_udp_free(he_udp *udp)
+{
+    unsigned int i;
+
+    for (i = 0; i < udp->vlen; i++) {
+        if (udp->riovs) he_pool_free(udp->pool, udp->riovs[i].iov_base, udp->bufsize);
+        if (udp->wiovs) he_pool_free(udp->pool, udp->wiovs[i].iov_base, udp->bufsize);
+    }
+    free(udp->rmsgs);
+    free(udp->riovs);
+    free(udp->raddrs);
+    free(udp->wmsgs);
+    free(udp->wiovs);
+    free(udp->waddrs);
+    free(udp);
+}
+
+static int he_udp_alloc_slots(he_udp *udp, struct mmsghdr **msgs,
+    struct iovec **iovs, struct sockaddr_storage **addrs)
+{
+    unsigned int i;
+
+    *msgs = calloc(udp->vlen, sizeof(struct mmsghdr));
+    *iovs = calloc(udp->vlen, sizeof(struct iovec));
+    *addrs = calloc(udp->vlen, sizeof(struct sockaddr_storage));
+    if (!*msgs || !*iovs || !*addrs) return HE_ERR;
+    for (i = 0; i < udp->vlen; i++) {
+        if (((*iovs)[i].iov_base = he_pool_alloc(udp->pool, udp->bufsize, NULL)) == NULL)
+            return HE_ERR;
+        (*iovs)[i].iov_len = udp->bufsize;
+        (*msgs)[i].msg_hdr.msg_iov = &(*iovs)[i];
+        (*msgs)[i].msg_hdr.msg_iovlen = 1;
+        (*msgs)[i].msg_hdr.msg_name = &(*addrs)[i];
+        (*msgs)[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+    return HE_OK;
+}
+
+static void he_udp_write_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask)
+{
+    he_udp *udp = client_data;
+    HE_NOTUSED(event_loop);
+    HE_NOTUSED(fd);
+    HE_NOTUSED(mask);
+
+    he_udp_flush(udp);
+}
+
+static void he_udp_flush_task(he_event_loop *event_loop, void *arg)
+{
+    HE_NOTUSED(event_loop);
+
+    he_udp_flush(arg);
+}
+
+static void he_udp_read_handler(he_event_loop *event_loop, int fd,
+    void *client_data, int mask)
+{
+    he_udp *udp = client_data;
+    int rounds = 0, n;
+    HE_NOTUSED(mask);
+
+    udp->flags |= HE_UDP_IN_CALLBACK;
+    while (rounds++ < HE_UDP_MAX_ROUNDS) {
+        n = hnet_recvmmsg_flags(fd, udp->rmsgs, udp->vlen, MSG_DONTWAIT);
+        if (n == HNET_ERR) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (udp->read_proc) udp->read_proc(udp, udp->rmsgs, n, udp->client_data);
+        if (udp->flags & HE_UDP_CLOSED) break;
+        if ((unsigned int)n < udp->vlen) break;
+    }
+    udp->flags &= ~HE_UDP_IN_CALLBACK;
+    if (udp->flags & HE_UDP_CLOSED) {
+        he_udp_free(udp);
+        return;
+    }
+    if (rounds > HE_UDP_MAX_ROUNDS)
+        he_set_file_ready(event_loop, fd, HE_READABLE);
+}
+
+he_udp *he_create_udp(he_event_loop *event_loop, int fd, unsigned int vlen,
+    size_t bufsize, he_udp_proc *read_proc, void *client_data)
+{
+    he_udp *udp;
+
+    if (vlen == 0 || bufsize == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((udp = calloc(1, sizeof(*udp))) == NULL) return NULL;
+    udp->event_loop = event_loop;
+    udp->fd = fd;
+    udp->vlen = vlen;
+    udp->bufsize = bufsize;
+    udp->read_proc = read_proc;
+    udp->client_data = client_data;
+    udp->flush_task.proc = he_udp_flush_task;
+    udp->flush_task.arg = udp;
+    if ((udp->pool = he_get_loop_pool(event_loop)) == NULL) goto err;
+    if (he_udp_alloc_slots(udp, &udp->rmsgs, &udp->riovs, &udp->raddrs) == HE_ERR)
+        goto err;
+    if (he_udp_alloc_slots(udp, &udp->wmsgs, &udp->wiovs, &udp->waddrs) == HE_ERR)
+        goto err;
+    if (he_create_file_event(event_loop, fd, HE_READABLE,
+        he_udp_read_handler, udp) == HE_ERR)
+        goto err;
+    return udp;
+
+err:
+    he_udp_free(udp);
+    return NULL;
+}
+
+/* Closes the fd and drops queued datagrams. */
+void he_udp_close(he_udp *udp)
+{
+    if (udp->flags & HE_UDP_CLOSED) return;
+    he_cancel_defer(udp->event_loop, &udp->flush_task);
+    he_delete_file_event(udp->event_loop, udp->fd, HE_READABLE|HE_WRITABLE);
+    close(udp->fd);
+    udp->flags |= HE_UDP_CLOSED;
+    if (!(udp->flags & HE_UDP_IN_CALLBACK)) he_udp_free(udp);
+}
+
+/* Send the queued datagrams with sendmmsg. A datagram the kernel rejects
+ * is dropped and counted in send_errors so it cannot stall the rest.
+ * Returns HE_ERR with EAGAIN if the socket buffer is full. */
+int he_udp_flush(he_udp *udp)
+{
+    unsigned int sent = 0;
+    int n;
+
+    while (sent < udp->wcount) {
+        n = hnet_sendmmsg(udp->fd, udp->wmsgs + sent, udp->wcount - sent, MSG_DONTWAIT);
+        if (n == HNET_ERR) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            udp->send_errors++;
+            n = 1;
+        }
+        sent += n;
+    }
+    if (sent && sent < udp->wcount) {
+        unsigned int i;
+        struct iovec iov;
+
+        /* Move the pending datagrams to the front. The pool buffers are
+         * swapped rather than copied so every slot keeps one buffer. */
+        for (i = 0; i < udp->wcount - sent; i++) {
+            iov = udp->wiovs[i];
+            udp->wiovs[i] = udp->wiovs[i + sent];
+            udp->wiovs[i + sent] = iov;
+            udp->waddrs[i] = udp->waddrs[i + sent];
+            udp->wmsgs[i].msg_hdr.msg_namelen = udp->wmsgs[i + sent].msg_hdr.msg_namelen;
+            udp->wmsgs[i].msg_hdr.msg_name = udp->wmsgs[i + sent].msg_hdr.msg_name ?
+                &udp->waddrs[i] : NULL;
+        }
+    }
+    udp->wcount -= sent;
+    if (udp->wcount && !(udp->flags & HE_UDP_WRITING)) {
+        if (he_create_file_event(udp->event_loop, udp->fd, HE_WRITABLE,
+            he_udp_write_handler, udp) == HE_OK)
+            udp->flags |= HE_UDP_WRITING;
+    } else if (!udp->wcount && (udp->flags & HE_UDP_WRITING)) {
+        he_delete_file_event(udp->event_loop, udp->fd, HE_WRITABLE);
+        udp->flags &= ~HE_UDP_WRITING;
+    }
+    if (udp->wcount) {
+        errno = EAGAIN;
+        return HE_ERR;
+    }
+    return HE_OK;
+}
+
+/* Copy a datagram into the next outbound slot. sa may be NULL on a
+ * connected socket. The queue is flushed once per loop iteration, before
+ * the loop sleeps, or right away once all vlen slots are in use. After a
+ * short send the rest waits for the fd to become writable. */
+int he_udp_send(he_udp *udp, const void *buf, size_t len,
+    const struct sockaddr_storage *sa)
+{
+    struct msghdr *hdr;
+    unsigned int i;
+
+    if (udp->flags & HE_UDP_CLOSED) return HE_ERR;
+    if (len > udp->bufsize) {
+        errno = EMSGSIZE;
+        return HE_ERR;
+    }
+    if (udp->wcount == udp->vlen && he_udp_flush(udp) == HE_ERR &&
+        udp->wcount == udp->vlen)
+        return HE_ERR;
+    i = udp->wcount++;
+    hdr = &udp->wmsgs[i].msg_hdr;
+    memcpy(udp->wiovs[i].iov_base, buf, len);
+    udp->wiovs[i].iov_len = len;
+    if (sa) {
+        udp->waddrs[i] = *sa;
+        hdr->msg_name = &udp->waddrs[i];
+        hdr->msg_namelen = sa->ss_family == AF_INET6 ?
+            sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    } else {
+        hdr->msg_name = NULL;
+        hdr->msg_namelen = 0;
+    }
+    if (!(udp->flags & HE_UDP_WRITING))
+        he_defer(udp->event_loop, &udp->flush_task);
+    return HE_OK;
+}
+
+typedef struct he_udp_peer {
+    struct he_udp_peer *hnext;
+    struct he_udp_peer *prev;
+    struct he_udp_peer *next;
+    struct sockaddr_storage addr;
+    he_udp *udp;
+} he_udp_peer;
+
+static int he_udp_addr_equal(const struct sockaddr_storage *a,
+    const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family) return 0;
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+
+        return x->sin_port == y->sin_port &&
+            x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+
+        return x->sin6_port == y->sin6_port &&
+            x->sin6_scope_id == y->sin6_scope_id &&
+            !memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr));
+    }
+    return 0;
+}
+
+static unsigned int he_udp_addr_hash(const struct sockaddr_storage *sa)
+{
+    const unsigned char *p;
+    unsigned int h = 2166136261u, i, len;
+
+    if (sa->ss_family == AF_INET6) {
+        p = (const unsigned char *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+        len = sizeof(struct in6_addr);
+        h = (h ^ ((const struct sockaddr_in6 *)sa)->sin6_port) * 16777619u;
+    } else {
+        p = (const unsigned char *)&((const struct sockaddr_in *)sa)->sin_addr;
+        len = sizeof(struct in_addr);
+        h = (h ^ ((const struct sockaddr_in *)sa)->sin_port) * 16777619u;
+    }
+    for (i = 0; i < len; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static void he_udp_lru_unlink(he_udp_cache *cache, he_udp_peer *peer)
+{
+    if (peer->prev) peer->prev->next = peer->next;
+    else cache->lru_head = peer->next;
+    if (peer->next) peer->next->prev = peer->prev;
+    else cache->lru_tail = peer->prev;
+}
+
+static void he_udp_lru_push(he_udp_cache *cache, he_udp_peer *peer)
+{
+    peer->prev = NULL;
+    peer->next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->prev = peer;
+    cache->lru_head = peer;
+    if (!cache->lru_tail) cache->lru_tail = peer;
+}
+
+/* Datagrams the socket buffer cannot take right away are dropped along
+ * with the socket, as they would be by the network. */
+static void he_udp_cache_remove(he_udp_cache *cache, he_udp_peer *peer)
+{
+    he_udp_peer **p = &cache->table[he_udp_addr_hash(&peer->addr) & (cache->table_size - 1)];
+
+    while (*p != peer) p = &(*p)->hnext;
+    *p = peer->hnext;
+    he_udp_lru_unlink(cache, peer);
+    he_udp_flush(peer->udp);
+    he_udp_close(peer->udp);
+    free(peer);
+    cache->count--;
+}
+
+he_udp_cache *he_create_udp_cache(he_event_loop *event_loop, int capacity,
+    unsigned int vlen, size_t bufsize, he_udp_proc *read_proc, void *client_data)
+{
+    he_udp_cache *cache;
+
+    if (capacity <= 0 || vlen == 0 || bufsize == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((cache = calloc(1, sizeof(*cache))) == NULL) return NULL;
+    cache->event_loop = event_loop;
+    cache->capacity = capacity;
+    cache->vlen = vlen;
+    cache->bufsize = bufsize;
+    cache->read_proc = read_proc;
+    cache->client_data = client_data;
+    cache->table_size = 1;
+    while (cache->table_size < (unsigned int)capacity * 2) cache->table_size <<= 1;
+    if ((cache->table = calloc(cache->table_size, sizeof(he_udp_peer*))) == NULL) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void he_delete_udp_cache(he_udp_cache *cache)
+{
+    while (cache->lru_head) he_udp_cache_remove(cache, cache->lru_head);
+    free(cache->table);
+    free(cache);
+}
+
+/* Returns the endpoint connected to sa, creating it if needed. The
+ * returned he_udp stays valid until the next call that may evict it, i.e.
+ * the next he_udp_cache_get or he_udp_cache_send for another address. */
+he_udp *he_udp_cache_get(he_udp_cache *cache, const struct sockaddr_storage *sa)
+{
+    unsigned int h = he_udp_addr_hash(sa) & (cache->table_size - 1);
+    he_udp_peer *peer;
+    int fd;
+
+    for (peer = cache->table[h]; peer; peer = peer->hnext) {
+        if (he_udp_addr_equal(&peer->addr, sa)) {
+            cache->hits++;
+            if (peer != cache->lru_head) {
+                he_udp_lru_unlink(cache, peer);
+                he_udp_lru_push(cache, peer);
+            }
+            return peer->udp;
+        }
+    }
+    cache->misses++;
+    if (sa->ss_family != AF_INET && sa->ss_family != AF_INET6) {
+        errno = EAFNOSUPPORT;
+        return NULL;
+    }
+    if ((peer = calloc(1, sizeof(*peer))) == NULL) return NULL;
+    if ((fd = hnet_udp_connect(NULL, sa)) == HNET_ERR) {
+        free(peer);
+        return NULL;
+    }
+    peer->udp = he_create_udp(cache->event_loop, fd, cache->vlen, cache->bufsize,
+        cache->read_proc, cache->client_data);
+    if (peer->udp == NULL) {
+        close(fd);
+        free(peer);
+        return NULL;
+    }
+    /* Evict only once the new endpoint exists, so a failed create does
+     * not cost a live peer. */
+    if (cache->count == cache->capacity) {
+        he_udp_cache_remove(cache, cache->lru_tail);
+        cache->evictions++;
+    }
+    peer->addr = *sa;
+    peer->hnext = cache->table[h];
+    cache->table[h] = peer;
+    he_udp_lru_push(cache, peer);
+    cache->count++;
+    return peer->udp;
+}
+
+/* Queue buf for sa on its connected socket; it goes out with the other
+ * datagrams queued for the same peer in one sendmmsg. */
+int he_udp_cache_send(he_udp_cache *cache, const struct sockaddr_storage *sa,
+    const void *buf, size_t len)
+{
+    he_udp *udp = he_udp_cache_get(cache, sa);
+
+    if (udp == NULL) return HE_ERR;
+    return he_udp_send(udp, buf, len, NULL);
+}
+
+void he_udp_cache_flush(he_udp_cache *cache)
+{
+    he_udp_peer *peer;
+
+    for (peer = cache->lru_head; peer; peer = peer->next)
+        he_udp_flush(peer->udp);
+}
@@ -0,0 +1,347 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define HE_URING_ENTRIES 256
+#define HE_URING_CQ_ENTRIES 4096
+#define HE_URING_CANCEL_DATA (~0ULL)
+
+/* Per fd poll state. gen is part of user_data and is bumped whenever a
+ * poll request is cancelled, so completions of old requests are dropped. */
+typedef struct he_uring_fd {
+    unsigned int gen;
+    int mask;
+    int armed;
+    int queued;
+} he_uring_fd;
+
+typedef struct he_uring_state {
+    int ringfd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    he_uring_fd *fds;
+    int *rearm;
+    int nrearm;
+} he_uring_state;
+
+static int he_uring_enter(he_uring_state *state, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+    unsigned submit;
+
+    __atomic_store_n(state->sq_tail, state->sqe_tail, __ATOMIC_RELEASE);
+    submit = state->sqe_tail - __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+    return syscall(__NR_io_uring_enter, state->ringfd, submit, min_complete,
+        flags, arg, argsz);
+}
+
+static struct io_uring_sqe *he_uring_get_sqe(he_uring_state *state)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+
+    if (state->sqe_tail - head >= state->sq_entries) {
+        he_uring_enter(state, 0, 0, NULL, 0);
+        head = __atomic_load_n(state->sq_head, __ATOMIC_ACQUIRE);
+        if (state->sqe_tail - head >= state->sq_entries) return NULL;
+    }
+    sqe = &state->sqes[state->sqe_tail & state->sq_mask];
+    state->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static int he_uring_arm(he_uring_state *state, int fd)
+{
+    he_uring_fd *f = &state->fds[fd];
+    struct io_uring_sqe *sqe;
+    unsigned events = 0;
+
+    if ((sqe = he_uring_get_sqe(state)) == NULL) return -1;
+    if (f->mask & HE_READABLE) events |= POLLIN;
+    if (f->mask & HE_WRITABLE) events |= POLLOUT;
+    if (f->mask & HE_EXCLUSIVE) events |= EPOLLEXCLUSIVE;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    /* Edge-triggered fds keep one multishot request for their lifetime,
+     * level-triggered ones are re-armed after every completion. */
+    sqe->len = (f->mask & HE_EDGE) ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = ((unsigned long long)f->gen << 32) | (unsigned)fd;
+    f->armed = 1;
+    return 0;
+}
+
+static int he_uring_disarm(he_uring_state *state, int fd)
+{
+    he_uring_fd *f = &state->fds[fd];
+    struct io_uring_sqe *sqe;
+
+    if (!f->armed) return 0;
+    if ((sqe = he_uring_get_sqe(state)) == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ((unsigned long long)f->gen << 32) | (unsigned)fd;
+    sqe->user_data = HE_URING_CANCEL_DATA;
+    f->armed = 0;
+    f->gen++;
+    return 0;
+}
+
+static int he_uring_set_mask(he_uring_state *state, int fd, int mask)
+{
+    if (he_uring_disarm(state, fd) == -1) return -1;
+    state->fds[fd].mask = mask;
+    if (mask & (HE_READABLE|HE_WRITABLE))
+        return he_uring_arm(state, fd);
+    return 0;
+}
+
+static void he_uring_unmap(he_uring_state *state)
+{
+    if (state->sqes) munmap(state->sqes, state->sqes_size);
+    if (state->cq_ring && state->cq_ring != state->sq_ring)
+        munmap(state->cq_ring, state->cq_ring_size);
+    if (state->sq_ring) munmap(state->sq_ring, state->sq_ring_size);
+}
+
+static int he_uring_create(he_event_loop *event_loop)
+{
+    he_uring_state *state;
+    struct io_uring_params p;
+    unsigned i, *sq_array;
+
+    if ((state = calloc(1, sizeof(*state))) == NULL) return -1;
+    state->fds = calloc(event_loop->setsize, sizeof(he_uring_fd));
+    state->rearm = malloc(sizeof(int) * event_loop->setsize);
+    if (!state->fds || !state->rearm) goto err;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = HE_URING_CQ_ENTRIES;
+    state->ringfd = syscall(__NR_io_uring_setup, HE_URING_ENTRIES, &p);
+    if (state->ringfd == -1) goto err;
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        close(state->ringfd);
+        errno = ENOSYS;
+        goto err;
+    }
+
+    state->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    state->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_ring_size > state->sq_ring_size)
+            state->sq_ring_size = state->cq_ring_size;
+        state->cq_ring_size = state->sq_ring_size;
+    }
+    state->sq_ring = mmap(NULL, state->sq_ring_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+    if (state->sq_ring == MAP_FAILED) {
+        state->sq_ring = NULL;
+        goto err_ring;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ring = state->sq_ring;
+    } else {
+        state->cq_ring = mmap(NULL, state->cq_ring_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_CQ_RING);
+        if (state->cq_ring == MAP_FAILED) {
+            state->cq_ring = NULL;
+            goto err_ring;
+        }
+    }
+    state->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqes_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err_ring;
+    }
+
+    state->sq_head = (unsigned *)((char *)state->sq_ring + p.sq_off.head);
+    state->sq_tail = (unsigned *)((char *)state->sq_ring + p.sq_off.tail);
+    state->sq_mask = *(unsigned *)((char *)state->sq_ring + p.sq_off.ring_mask);
+    state->sq_entries = p.sq_entries;
+    sq_array = (unsigned *)((char *)state->sq_ring + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++) sq_array[i] = i;
+    state->sqe_tail = *state->sq_tail;
+    state->cq_head = (unsigned *)((char *)state->cq_ring + p.cq_off.head);
+    state->cq_tail = (unsigned *)((char *)state->cq_ring + p.cq_off.tail);
+    state->cq_mask = *(unsigned *)((char *)state->cq_ring + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)((char *)state->cq_ring + p.cq_off.cqes);
+    event_loop->apidata = state;
+    return 0;
+
+err_ring:
+    he_uring_unmap(state);
+    close(state->ringfd);
+err:
+    free(state->fds);
+    free(state->rearm);
+    free(state);
+    return -1;
+}
+
+static void he_uring_free(he_event_loop *event_loop)
+{
+    he_uring_state *state = event_loop->apidata;
+
+    he_uring_unmap(state);
+    close(state->ringfd);
+    free(state->fds);
+    free(state->rearm);
+    free(state);
+}
+
+static int he_uring_resize(he_event_loop *event_loop, int setsize, int maxevents)
+{
+    he_uring_state *state = event_loop->apidata;
+    he_uring_fd *fds;
+    int *rearm, j, n = 0;
+    HE_NOTUSED(maxevents);
+
+    if (setsize == event_loop->setsize) return 0;
+    if ((rearm = malloc(sizeof(int) * setsize)) == NULL) return -1;
+    if ((fds = realloc(state->fds, sizeof(he_uring_fd) * setsize)) == NULL) {
+        free(rearm);
+        return -1;
+    }
+    if (setsize > event_loop->setsize)
+        memset(fds + event_loop->setsize, 0,
+            sizeof(he_uring_fd) * (setsize - event_loop->setsize));
+    /* Deleted fds may still wait in the rearm list; drop the ones that
+     * fall outside the new table. */
+    for (j = 0; j < state->nrearm; j++)
+        if (state->rearm[j] < setsize) rearm[n++] = state->rearm[j];
+    free(state->rearm);
+    state->rearm = rearm;
+    state->nrearm = n;
+    state->fds = fds;
+    return 0;
+}
+
+static int he_uring_add_event(he_event_loop *event_loop, int fd, int mask)
+{
+    he_uring_state *state = event_loop->apidata;
+    he_uring_fd *f = &state->fds[fd];
+
+    if (f->mask & HE_EDGE) return 0;
+    mask |= f->mask;
+    if (mask & HE_EDGE) mask |= HE_READABLE | HE_WRITABLE;
+    if (mask == f->mask && f->armed) return 0;
+    return he_uring_set_mask(state, fd, mask);
+}
+
+static void he_uring_del_event(he_event_loop *event_loop, int fd, int delmask)
+{
+    he_uring_state *state = event_loop->apidata;
+    int mask = state->fds[fd].mask & (~delmask);
+
+    if ((mask & HE_EDGE) && (mask & (HE_READABLE|HE_WRITABLE))) return;
+    if (!(mask & (HE_READABLE|HE_WRITABLE))) mask = HE_NONE;
+    he_uring_set_mask(state, fd, mask);
+}
+
+/* Re-arms of the last round and any interest changes are submitted with
+ * the same io_uring_enter call that waits for completions. */
+static int he_uring_poll(he_event_loop *event_loop, int timeout)
+{
+    he_uring_state *state = event_loop->apidata;
+    struct io_uring_getevents_arg arg = {0};
+    struct __kernel_timespec ts;
+    unsigned head, tail;
+    int j, n = 0, numevents = 0;
+
+    /* An fd that finds the submission queue full stays on the list for
+     * the next round, and this round does not block so it comes soon. */
+    for (j = 0; j < state->nrearm; j++) {
+        int fd = state->rearm[j];
+        he_uring_fd *f = &state->fds[fd];
+
+        f->queued = 0;
+        if (!f->armed && (f->mask & (HE_READABLE|HE_WRITABLE)) &&
+            he_uring_arm(state, fd) == -1) {
+            f->queued = 1;
+            state->rearm[n++] = fd;
+        }
+    }
+    state->nrearm = n;
+    if (n) timeout = 0;
+
+    head = *state->cq_head;
+    if (head != __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (state->sqe_tail != *state->sq_tail)
+            he_uring_enter(state, 0, 0, NULL, 0);
+    } else {
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (unsigned long long)(uintptr_t)&ts;
+        }
+        he_uring_enter(state, timeout == 0 ? 0 : 1,
+            IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && numevents < event_loop->maxevents) {
+        struct io_uring_cqe *cqe = &state->cqes[head & state->cq_mask];
+        unsigned long long data = cqe->user_data;
+        int fd = (int)(data & 0xffffffff), mask = 0;
+        he_uring_fd *f;
+
+        head++;
+        if (data == HE_URING_CANCEL_DATA || fd >= event_loop->setsize) continue;
+        f = &state->fds[fd];
+        if (f->gen != (unsigned)(data >> 32) || !f->armed) continue;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            f->armed = 0;
+            /* A failed request is not re-armed; the handler sees the error
+             * on its next read or write and the fd stays quiet until its
+             * interest changes. */
+            if (cqe->res >= 0 && !f->queued) {
+                f->queued = 1;
+                state->rearm[state->nrearm++] = fd;
+            }
+        }
+        if (cqe->res < 0) {
+            if (cqe->res == -ECANCELED) continue;
+            mask = HE_READABLE | HE_WRITABLE;
+        } else {
+            if (cqe->res & POLLIN) mask |= HE_READABLE;
+            if (cqe->res & POLLOUT) mask |= HE_WRITABLE;
+            if (cqe->res & (POLLERR|POLLHUP)) mask |= HE_READABLE | HE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= HE_ERROR;
+        }
+        event_loop->fired[numevents].fd = fd;
+        event_loop->fired[numevents].mask = mask;
+        /* Stale polls were filtered by f->gen above, so this completion
+         * belongs to the current registration. */
+        event_loop->fired[numevents].gen = event_loop->events[fd].gen;
+        numevents++;
+    }
+    __atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+    return numevents;
+}
+
+static const he_api he_uring_api = {
+    "io_uring",
+    he_uring_create,
+    he_uring_free,
+    he_uring_add_event,
+    he_uring_del_event,
+    he_uring_poll,
+    he_uring_resize
+};
@@ -0,0 +1,1617 @@
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "he.h"
+#include "he_stats.h"
+#include "he_conn.h"
+#include "he_frame.h"
+#include "hnet.h"
+#include "he_acceptor.h"
+#include "he_resolver.h"
+#include "he_client.h"
+#include "he_udp.h"
+
+#define UNUSED(V) ((void) V)
+
+/* Behaviour checks for the deterministic parts of the library. Every test
+ * runs once per available backend and returns the number of failed
+ * checks. */
+typedef int test_proc(int backend);
+
+#define TEST_DEADLINE_US 10000000LL
+/* Kills a test blocked in he_main or the backend. */
+#define TEST_WATCHDOG_SEC 60
+
+typedef struct test_case {
+    const char *name;
+    test_proc *proc;
+} test_case;
+
+#define test_check(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failed++; \
+    } \
+} while (0)
+
+/* Runs the loop until cond holds. The deadline only bounds a test that
+ * is already failing; it is never what a check relies on. */
+#define test_wait(el, cond) do { \
+    long long test_deadline_ = he_ustime() + TEST_DEADLINE_US; \
+    while (!(cond) && he_ustime() < test_deadline_) he_process_events(el); \
+} while (0)
+
+/* Short cron period so an iteration with nothing to do returns quickly. */
+static he_event_loop *test_loop(int backend)
+{
+    return he_create_event_loop_backend(1024, 10, NULL, NULL, backend);
+}
+
+/* ------------------------------- Timers ------------------------------ */
+
+#define TEST_TIMERS 64
+
+typedef struct timer_order {
+    int fired[TEST_TIMERS];
+    int nfired;
+} timer_order;
+
+typedef struct timer_arg {
+    timer_order *order;
+    int id;
+    int runs;
+    long long ret;
+    int reset_ms;
+    int delete_self;
+} timer_arg;
+
+static long long timer_record_proc(he_event_loop *el, he_timer *timer, void *privdata)
+{
+    timer_arg *arg = privdata;
+
+    if (arg->order) arg->order->fired[arg->order->nfired++] = arg->id;
+    arg->runs++;
+    if (arg->delete_self) he_delete_timer(el, timer);
+    if (arg->reset_ms >= 0 && arg->runs == 1) he_reset_timer(el, timer, arg->reset_ms);
+    return arg->ret;
+}
+
+/* Timers fire by deadline, and timers with the same deadline in creation
+ * order. */
+static int test_timer_order(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    timer_order order = {{0}, 0};
+    timer_arg args[TEST_TIMERS];
+    int i, failed = 0;
+
+    if (el == NULL) return -1;
+    for (i = 0; i < TEST_TIMERS; i++) {
+        timer_arg *arg = &args[i];
+
+        arg->order = &order;
+        arg->id = i;
+        arg->runs = 0;
+        arg->ret = HE_NOMORE;
+        arg->reset_ms = -1;
+        arg->delete_self = 0;
+        /* Ids 0..7 share a deadline, the rest are created latest first. */
+        he_create_timer(el, i < 8 ? 5 : 5 + (TEST_TIMERS - i) * 2,
+            timer_record_proc, arg);
+    }
+    test_wait(el, order.nfired == TEST_TIMERS);
+    test_check(order.nfired == TEST_TIMERS);
+    for (i = 0; i < 8 && i < order.nfired; i++) test_check(order.fired[i] == i);
+    for (i = 8; i < order.nfired; i++)
+        test_check(order.fired[i] == TEST_TIMERS - 1 - (i - 8));
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* A timer deleting itself from its proc is gone whatever the proc
+ * returns; one deleted before it is due never fires. */
+static int test_timer_delete_self(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    timer_arg self = {NULL, 0, 0, 1, -1, 1}, other = {NULL, 1, 0, HE_NOMORE, -1, 0};
+    he_timer *t;
+    int failed = 0;
+
+    if (el == NULL) return -1;
+    he_create_timer(el, 1, timer_record_proc, &self);
+    t = he_create_timer(el, 5, timer_record_proc, &other);
+    he_delete_timer(el, t);
+    test_wait(el, self.runs > 0);
+    test_check(self.runs == 1);
+    test_check(other.runs == 0);
+    test_check(el->timers_count == 0);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* A reset from the proc wins over its HE_NOMORE, and a proc returning a
+ * period keeps the timer going. Once the reset timer ran twice it must be
+ * out of the heap, leaving only the periodic one. */
+static int test_timer_reset_self(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    timer_arg reset = {NULL, 0, 0, HE_NOMORE, 5, 0};
+    timer_arg periodic = {NULL, 1, 0, 5, -1, 0};
+    he_timer *t;
+    int failed = 0;
+
+    if (el == NULL) return -1;
+    he_create_timer(el, 1, timer_record_proc, &reset);
+    t = he_create_timer(el, 1, timer_record_proc, &periodic);
+    test_wait(el, reset.runs >= 2 && periodic.runs >= 3);
+    test_check(reset.runs == 2);
+    test_check(periodic.runs >= 3);
+    test_check(el->timers_count == 1);
+    he_delete_timer(el, t);
+    test_check(el->timers_count == 0);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* ------------------------------- Posts ------------------------------- */
+
+#define TEST_PRODUCERS 4
+#define TEST_POSTS 20000
+
+typedef struct post_state {
+    he_event_loop *el;
+    int next[TEST_PRODUCERS];
+    int received;
+    int out_of_order;
+    int expected;
+} post_state;
+
+typedef struct post_item {
+    post_state *state;
+    int producer;
+    int seq;
+} post_item;
+
+typedef struct post_producer {
+    post_state *state;
+    post_item *items;
+    int producer;
+    int count;
+    long long delay_us;
+} post_producer;
+
+static void post_record_proc(he_event_loop *el, void *arg)
+{
+    post_item *item = arg;
+    post_state *state = item->state;
+
+    if (item->seq != state->next[item->producer]) state->out_of_order++;
+    state->next[item->producer] = item->seq + 1;
+    if (++state->received == state->expected) he_stop(el);
+}
+
+static void *post_producer_main(void *arg)
+{
+    post_producer *p = arg;
+    int i;
+
+    if (p->delay_us) usleep(p->delay_us);
+    for (i = 0; i < p->count; i++) {
+        post_item *item = &p->items[i];
+
+        item->state = p->state;
+        item->producer = p->producer;
+        item->seq = i;
+        while (he_post(p->state->el, post_record_proc, item) == HE_ERR) usleep(100);
+    }
+    return NULL;
+}
+
+/* Tasks posted from the loop thread run in post order. */
+static int test_post_order(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    post_state state;
+    post_item *items;
+    int i, failed = 0;
+
+    if (el == NULL) return -1;
+    memset(&state, 0, sizeof(state));
+    state.el = el;
+    state.expected = TEST_POSTS;
+    items = malloc(sizeof(*items) * TEST_POSTS);
+    for (i = 0; i < TEST_POSTS; i++) {
+        items[i].state = &state;
+        items[i].producer = 0;
+        items[i].seq = i;
+        test_check(he_post(el, post_record_proc, &items[i]) == HE_OK);
+    }
+    he_main(el);
+    test_check(state.received == TEST_POSTS);
+    test_check(state.out_of_order == 0);
+    free(items);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* Producers racing on one loop: each producer's tasks still run in the
+ * order it posted them, and none are lost. */
+static int test_post_producers(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    post_state state;
+    post_producer producers[TEST_PRODUCERS];
+    pthread_t threads[TEST_PRODUCERS];
+    int i, failed = 0;
+
+    if (el == NULL) return -1;
+    memset(&state, 0, sizeof(state));
+    state.el = el;
+    state.expected = TEST_PRODUCERS * TEST_POSTS;
+    for (i = 0; i < TEST_PRODUCERS; i++) {
+        producers[i].state = &state;
+        producers[i].items = malloc(sizeof(post_item) * TEST_POSTS);
+        producers[i].producer = i;
+        producers[i].count = TEST_POSTS;
+        producers[i].delay_us = 0;
+        pthread_create(&threads[i], NULL, post_producer_main, &producers[i]);
+    }
+    he_main(el);
+    for (i = 0; i < TEST_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+        free(producers[i].items);
+    }
+    test_check(state.received == state.expected);
+    test_check(state.out_of_order == 0);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* A post wakes a loop blocked in the backend, and a stop issued before
+ * he_main is not lost. The cron period is an hour so neither he_main can
+ * return on its own; a missed wakeup trips the watchdog. */
+static int test_post_wakeup(int backend)
+{
+    he_event_loop *el = he_create_event_loop_backend(1024, 3600000, NULL, NULL, backend);
+    post_state state;
+    post_item item;
+    post_producer producer;
+    pthread_t thread;
+    int failed = 0;
+
+    if (el == NULL) return -1;
+    memset(&state, 0, sizeof(state));
+    state.el = el;
+    state.expected = 1;
+    producer.state = &state;
+    producer.items = &item;
+    producer.producer = 0;
+    producer.count = 1;
+    /* Gives the loop time to go to sleep first; not checked either way. */
+    producer.delay_us = 50000;
+    pthread_create(&thread, NULL, post_producer_main, &producer);
+    he_main(el);
+    pthread_join(thread, NULL);
+    test_check(state.received == 1);
+
+    he_stop(el);
+    he_main(el);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* ------------------------------- Frames ------------------------------ */
+
+/* One end of a socketpair runs a codec on a conn, the test writes raw
+ * bytes into the other end. fed counts bytes written, consumed the header
+ * and payload bytes of delivered frames. */
+typedef struct frame_state {
+    he_frame_codec *codec;
+    he_conn *conn;
+    int peer;
+    size_t fed;
+    size_t consumed;
+    int frames;
+    int batches;
+    int read_err;
+    char payload[256];
+    size_t payload_len;
+} frame_state;
+
+static void frame_record_proc(he_conn *conn, he_frame_view *frames, int count,
+    void *client_data)
+{
+    frame_state *state = client_data;
+    int i;
+
+    UNUSED(conn);
+    state->batches++;
+    for (i = 0; i < count; i++) {
+        if (state->payload_len + frames[i].len <= sizeof(state->payload)) {
+            memcpy(state->payload + state->payload_len, frames[i].data, frames[i].len);
+            state->payload_len += frames[i].len;
+        }
+        state->consumed += state->codec->header_size + frames[i].len;
+        state->frames++;
+    }
+}
+
+static void frame_read_proc(he_conn *conn, void *client_data)
+{
+    frame_state *state = client_data;
+
+    if (he_frame_read(state->codec, conn, frame_record_proc, state) == HE_ERR) {
+        state->read_err = errno;
+        state->conn = NULL;
+        he_conn_close(conn);
+    }
+}
+
+static int frame_setup(frame_state *state, he_event_loop *el, int header_size,
+    int byte_order, size_t max_frame)
+{
+    int fds[2];
+
+    memset(state, 0, sizeof(*state));
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) return HE_ERR;
+    state->codec = he_create_frame_codec(header_size, byte_order, max_frame);
+    state->conn = he_create_conn(el, fds[0], frame_read_proc, NULL, state);
+    state->peer = fds[1];
+    return state->codec && state->conn ? HE_OK : HE_ERR;
+}
+
+static void frame_teardown(frame_state *state)
+{
+    if (state->conn) he_conn_close(state->conn);
+    close(state->peer);
+    he_delete_frame_codec(state->codec);
+}
+
+static size_t frame_buffered(frame_state *state)
+{
+    size_t len;
+
+    if (state->conn == NULL) return 0;
+    he_conn_input(state->conn, &len);
+    return len;
+}
+
+/* Returns once every byte written so far was read, as a frame or as
+ * input still buffered, or the conn was closed. */
+static void frame_feed(frame_state *state, he_event_loop *el, const char *buf,
+    size_t len)
+{
+    if (write(state->peer, buf, len) != (ssize_t)len) return;
+    state->fed += len;
+    test_wait(el, state->conn == NULL ||
+        state->consumed + frame_buffered(state) == state->fed);
+}
+
+/* A header split across reads waits for the rest of itself and then for
+ * its payload; nothing is delivered early and no byte is lost. */
+static int test_frame_partial_header(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    frame_state state;
+    int failed = 0;
+
+    if (el == NULL) return -1;
+    test_check(frame_setup(&state, el, 4, HE_FRAME_BIG_ENDIAN, 0) == HE_OK);
+    frame_feed(&state, el, "\0\0\0", 3);
+    test_check(state.frames == 0);
+    test_check(frame_buffered(&state) == 3);
+    frame_feed(&state, el, "\5he", 3);
+    test_check(state.frames == 0);
+    test_check(frame_buffered(&state) == 6);
+    frame_feed(&state, el, "llo", 3);
+    test_check(state.frames == 1);
+    test_check(state.payload_len == 5 && memcmp(state.payload, "hello", 5) == 0);
+    test_check(frame_buffered(&state) == 0);
+    test_check(state.read_err == 0);
+    frame_teardown(&state);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* Frames cut at arbitrary points come out whole and in order, and the
+ * frames complete in one read reach the proc as one batch. */
+static int test_frame_split(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    /* Little endian 2 byte headers: "ab", "", "cdefg". */
+    const char stream[] = "\2\0ab\0\0\5\0cdefg";
+    size_t cuts[] = {1, 3, 5, 8, sizeof(stream) - 1};
+    frame_state state;
+    size_t off = 0;
+    int i, failed = 0;
+
+    if (el == NULL) return -1;
+    test_check(frame_setup(&state, el, 2, HE_FRAME_LITTLE_ENDIAN, 0) == HE_OK);
+    for (i = 0; i < (int)(sizeof(cuts) / sizeof(cuts[0])); i++) {
+        frame_feed(&state, el, stream + off, cuts[i] - off);
+        off = cuts[i];
+    }
+    test_check(state.frames == 3);
+    test_check(state.payload_len == 7 && memcmp(state.payload, "abcdefg", 7) == 0);
+    test_check(frame_buffered(&state) == 0);
+
+    state.frames = state.batches = 0;
+    state.payload_len = 0;
+    state.fed = state.consumed = 0;
+    frame_feed(&state, el, stream, sizeof(stream) - 1);
+    test_check(state.frames == 3);
+    test_check(state.batches == 1);
+    test_check(state.payload_len == 7 && memcmp(state.payload, "abcdefg", 7) == 0);
+    frame_teardown(&state);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* A length over max_frame fails the read with EMSGSIZE, after the frames
+ * ahead of it were delivered. */
+static int test_frame_oversized(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    const char stream[] = "\0\3abc\0\21";
+    frame_state state;
+    int failed = 0;
+
+    if (el == NULL) return -1;
+    test_check(frame_setup(&state, el, 2, HE_FRAME_BIG_ENDIAN, 16) == HE_OK);
+    frame_feed(&state, el, stream, sizeof(stream) - 1);
+    test_check(state.frames == 1);
+    test_check(state.payload_len == 3 && memcmp(state.payload, "abc", 3) == 0);
+    test_check(state.read_err == EMSGSIZE);
+    test_check(state.conn == NULL);
+    frame_teardown(&state);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* ------------------------------- Unix -------------------------------- */
+
+/* Socket files carry perm from the start, a second bind of the same path
+ * fails with EADDRINUSE and leaves the first file alone, and a datagram
+ * server bound through its private directory is reachable at path. */
+static int test_unix_perm(int backend)
+{
+    char dir[] = "/tmp/hetest-XXXXXX", stream[64], dgram[64], err[HNET_ERR_LEN];
+    struct stat st;
+    int s, d, c, failed = 0;
+
+    UNUSED(backend);
+    if (mkdtemp(dir) == NULL) return -1;
+    snprintf(stream, sizeof(stream), "%s/stream", dir);
+    snprintf(dgram, sizeof(dgram), "%s/dgram", dir);
+
+    s = hnet_unix_server(err, stream, 0600, 16);
+    test_check(s != HNET_ERR);
+    test_check(stat(stream, &st) == 0 && (st.st_mode & 0777) == 0600);
+    test_check(hnet_unix_server(err, stream, 0600, 16) == HNET_ERR && errno == EADDRINUSE);
+    test_check(stat(stream, &st) == 0);
+
+    d = hnet_unix_dgram_server(err, dgram, 0620);
+    test_check(d != HNET_ERR);
+    test_check(stat(dgram, &st) == 0 && (st.st_mode & 0777) == 0620);
+    test_check(hnet_unix_dgram_server(err, dgram, 0620) == HNET_ERR && errno == EADDRINUSE);
+    c = hnet_unix_dgram_connect(err, dgram);
+    test_check(c != HNET_ERR && send(c, "x", 1, 0) == 1);
+
+    if (c != HNET_ERR) close(c);
+    if (d != HNET_ERR) close(d);
+    if (s != HNET_ERR) close(s);
+    unlink(stream);
+    unlink(dgram);
+    test_check(rmdir(dir) == 0);
+    return failed;
+}
+
+/* ------------------------------ Acceptor ----------------------------- */
+
+#define TEST_ACCEPT_CLIENTS 8
+
+static void accept_close_proc(he_acceptor *acceptor, int *fds,
+    struct sockaddr_storage *addrs, int count, void *client_data)
+{
+    int i;
+
+    UNUSED(acceptor);
+    UNUSED(addrs);
+    UNUSED(client_data);
+    for (i = 0; i < count; i++) close(fds[i]);
+}
+
+/* With the fd table full the acceptor takes the listener out of the poll
+ * set instead of spinning on EMFILE, and once fds are available again it
+ * drains the backlog queued meanwhile, in edge-triggered mode too. */
+static int test_accept_emfile(int backend)
+{
+    char dir[] = "/tmp/hetest-XXXXXX", path[64], err[HNET_ERR_LEN];
+    int clients[TEST_ACCEPT_CLIENTS];
+    struct rlimit saved, rl;
+    int edge, i, s, fd, failed = 0;
+
+    if (mkdtemp(dir) == NULL) return -1;
+    snprintf(path, sizeof(path), "%s/sock", dir);
+    getrlimit(RLIMIT_NOFILE, &saved);
+    for (edge = 0; edge < 2; edge++) {
+        he_event_loop *el = test_loop(backend);
+        he_acceptor *acceptor;
+
+        if (el == NULL) {
+            failed = -1;
+            break;
+        }
+        he_set_edge_triggered(el, edge);
+        s = hnet_unix_server(err, path, 0600, 64);
+        test_check(s != HNET_ERR);
+        acceptor = he_create_acceptor(el, s, NULL, accept_close_proc, NULL);
+        test_check(acceptor != NULL);
+        for (i = 0; i < TEST_ACCEPT_CLIENTS; i++)
+            clients[i] = hnet_unix_nonblock_connect(err, path);
+
+        /* Every fd below the limit is in use, so accept4 gets EMFILE. */
+        fd = dup(0);
+        close(fd);
+        rl = saved;
+        rl.rlim_cur = fd;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        test_wait(el, acceptor->pauses > 0);
+        test_check(acceptor->pauses > 0);
+        test_check(acceptor->accepted == 0);
+        test_check(el->events[s].mask == HE_NONE);
+        setrlimit(RLIMIT_NOFILE, &saved);
+
+        test_wait(el, acceptor->accepted == TEST_ACCEPT_CLIENTS);
+        test_check(acceptor->accepted == TEST_ACCEPT_CLIENTS);
+        test_check(el->events[s].mask & HE_READABLE);
+
+        for (i = 0; i < TEST_ACCEPT_CLIENTS; i++)
+            if (clients[i] != HNET_ERR) close(clients[i]);
+        if (acceptor) he_acceptor_close(acceptor);
+        unlink(path);
+        he_delete_event_loop(el);
+    }
+    rmdir(dir);
+    return failed;
+}
+
+#define TEST_BUDGET_CLIENTS 200
+
+/* Records the largest budget seen while bursts were delivered. */
+static void accept_budget_proc(he_acceptor *acceptor, int *fds,
+    struct sockaddr_storage *addrs, int count, void *client_data)
+{
+    int *max_budget = client_data;
+
+    accept_close_proc(acceptor, fds, addrs, count, NULL);
+    if (acceptor->budget > *max_budget) *max_budget = acceptor->budget;
+}
+
+/* A backlog larger than the budget is spread over several passes, the
+ * budget doubling up to max_budget while the backlog lasts and halving
+ * again once accepting is easy. */
+static int test_accept_budget(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    char dir[] = "/tmp/hetest-XXXXXX", path[64], err[HNET_ERR_LEN];
+    int clients[TEST_BUDGET_CLIENTS + 1];
+    he_acceptor *acceptor;
+    int i, s, budget, max_budget = 0, failed = 0;
+
+    if (el == NULL) return -1;
+    if (mkdtemp(dir) == NULL) {
+        he_delete_event_loop(el);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/sock", dir);
+    s = hnet_unix_server(err, path, 0600, TEST_BUDGET_CLIENTS + 16);
+    test_check(s != HNET_ERR);
+    acceptor = he_create_acceptor(el, s, NULL, accept_budget_proc, &max_budget);
+    test_check(acceptor != NULL);
+    /* Clamps the current budget down to 8 first. */
+    he_acceptor_set_budget(acceptor, 8, 8);
+    he_acceptor_set_budget(acceptor, 8, 64);
+    for (i = 0; i < TEST_BUDGET_CLIENTS; i++)
+        clients[i] = hnet_unix_nonblock_connect(err, path);
+
+    /* One pass runs the handler at most twice: once for the poll, once
+     * from the ready list. */
+    he_process_events(el);
+    test_check(acceptor->accepted >= 8 && acceptor->accepted <= 8 + 16);
+    test_check(acceptor->budget > 8);
+    test_wait(el, acceptor->accepted == TEST_BUDGET_CLIENTS);
+    test_check(acceptor->accepted == TEST_BUDGET_CLIENTS);
+    test_check(max_budget == 64);
+
+    budget = acceptor->budget;
+    clients[TEST_BUDGET_CLIENTS] = hnet_unix_nonblock_connect(err, path);
+    test_wait(el, acceptor->accepted == TEST_BUDGET_CLIENTS + 1);
+    test_check(acceptor->budget < budget);
+
+    for (i = 0; i <= TEST_BUDGET_CLIENTS; i++)
+        if (clients[i] != HNET_ERR) close(clients[i]);
+    if (acceptor) he_acceptor_close(acceptor);
+    unlink(path);
+    rmdir(dir);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* ------------------------------ Resolver ----------------------------- */
+
+#define TEST_RESOLVES 64
+
+typedef struct resolve_state {
+    int calls;
+    int err;
+    int naddrs;
+    int port;
+} resolve_state;
+
+static void resolve_record_proc(he_resolver *resolver, int err,
+    const struct sockaddr_storage *addrs, int naddrs, void *client_data)
+{
+    resolve_state *state = client_data;
+
+    UNUSED(resolver);
+    state->calls++;
+    state->err = err;
+    state->naddrs = naddrs;
+    if (naddrs && addrs[0].ss_family == AF_INET)
+        state->port = ntohs(((const struct sockaddr_in *)addrs)->sin_port);
+}
+
+/* Deleting the resolver with lookups queued and running returns without
+ * waiting for them, no proc runs afterwards, and the helpers finishing
+ * later neither post into the loop nor leak their requests. */
+static int test_resolver_delete_inflight(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    he_resolver *resolver;
+    resolve_state state = {0, 0, 0, 0};
+    int i, failed = 0;
+
+    if (el == NULL) return -1;
+    resolver = he_create_resolver(el, 2, 0);
+    test_check(resolver != NULL);
+    for (i = 0; i < TEST_RESOLVES; i++)
+        test_check(he_resolve(resolver, "localhost", 80, AF_INET,
+            resolve_record_proc, &state) == HE_OK);
+    he_delete_resolver(resolver);
+    for (i = 0; i < 10; i++) he_process_events(el);
+    test_check(state.calls == 0);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+typedef struct resolve_hook {
+    resolve_state *state;
+    int calls_before_poll;
+} resolve_hook;
+
+static void resolve_before_sleep(he_event_loop *el, void *client_data)
+{
+    resolve_hook *hook = client_data;
+
+    UNUSED(el);
+    hook->calls_before_poll = hook->state->calls;
+}
+
+/* Cache hits and literal addresses are answered from the deferred queue
+ * before the loop polls, not through a post; a lookup is cached, and
+ * looked up again once ttl_ms passed. */
+static int test_resolver_cache(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    he_resolver *resolver;
+    resolve_state state = {0, 0, 0, 0};
+    resolve_hook hook = {&state, 0};
+    int failed = 0;
+
+    if (el == NULL) return -1;
+    resolver = he_create_resolver(el, 1, 200);
+    test_check(resolver != NULL);
+    he_set_before_sleep(el, resolve_before_sleep, &hook);
+
+    test_check(he_resolve(resolver, "localhost", 80, AF_INET,
+        resolve_record_proc, &state) == HE_OK);
+    test_check(state.calls == 0);
+    test_wait(el, state.calls == 1);
+    test_check(state.err == 0 && state.naddrs > 0 && state.port == 80);
+    test_check(resolver->misses == 1 && resolver->hits == 0);
+
+    test_check(he_resolve(resolver, "localhost", 81, AF_INET,
+        resolve_record_proc, &state) == HE_OK);
+    test_check(state.calls == 1);
+    he_process_events(el);
+    test_check(hook.calls_before_poll == 2);
+    test_check(state.port == 81);
+    test_check(resolver->misses == 1 && resolver->hits == 1);
+
+    test_check(he_resolve(resolver, "127.0.0.1", 82, AF_INET,
+        resolve_record_proc, &state) == HE_OK);
+    he_process_events(el);
+    test_check(hook.calls_before_poll == 3);
+    test_check(state.port == 82);
+    test_check(resolver->misses == 1 && resolver->hits == 1);
+
+    usleep(250000);
+    test_check(he_resolve(resolver, "localhost", 80, AF_INET,
+        resolve_record_proc, &state) == HE_OK);
+    test_wait(el, state.calls == 4);
+    test_check(resolver->misses == 2 && resolver->hits == 1);
+
+    /* Answers still deferred are dropped with the resolver. */
+    test_check(he_resolve(resolver, "localhost", 80, AF_INET,
+        resolve_record_proc, &state) == HE_OK);
+    he_delete_resolver(resolver);
+    he_process_events(el);
+    test_check(state.calls == 4);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* A proc may delete its resolver; answers still queued are dropped. */
+static void resolve_delete_proc(he_resolver *resolver, int err,
+    const struct sockaddr_storage *addrs, int naddrs, void *client_data)
+{
+    resolve_record_proc(resolver, err, addrs, naddrs, client_data);
+    he_delete_resolver(resolver);
+}
+
+static int test_resolver_delete_from_proc(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    he_resolver *resolver;
+    resolve_state state = {0, 0, 0, 0};
+    int failed = 0;
+
+    if (el == NULL) return -1;
+    resolver = he_create_resolver(el, 1, 0);
+    test_check(resolver != NULL);
+    test_check(he_resolve(resolver, "127.0.0.1", 80, AF_INET,
+        resolve_delete_proc, &state) == HE_OK);
+    test_check(he_resolve(resolver, "127.0.0.1", 81, AF_INET,
+        resolve_record_proc, &state) == HE_OK);
+    he_process_events(el);
+    he_process_events(el);
+    test_check(state.calls == 1 && state.port == 80);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* ------------------------------- Client ------------------------------- */
+
+typedef struct client_state {
+    int connected;
+    int backoffs;
+    int last_err;
+} client_state;
+
+static void client_read_proc(he_conn *conn, void *client_data)
+{
+    size_t len;
+
+    UNUSED(client_data);
+    he_conn_input(conn, &len);
+    he_conn_consume(conn, len);
+}
+
+static void client_state_proc(he_client_pool *pool, int index, he_conn *conn,
+    int state, int err, void *client_data)
+{
+    client_state *cs = client_data;
+
+    UNUSED(pool);
+    UNUSED(index);
+    UNUSED(conn);
+    if (state == HE_CLIENT_CONNECTED) cs->connected++;
+    if (state == HE_CLIENT_BACKOFF) {
+        cs->backoffs++;
+        cs->last_err = err;
+    }
+}
+
+/* A listening socket on an ephemeral loopback port. */
+static int test_tcp_listen(int *port)
+{
+    char err[HNET_ERR_LEN];
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int s = hnet_tcp_server(err, *port, "127.0.0.1", 64, 0);
+
+    if (s == HNET_ERR) return -1;
+    getsockname(s, (struct sockaddr *)&sa, &len);
+    *port = ntohs(sa.sin_port);
+    return s;
+}
+
+/* A hostname is resolved through the pool's resolver, not on the loop;
+ * refused attempts back off and keep retrying, and the slot connects
+ * once the upstream is back. */
+static int test_client_backoff(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    he_client_pool *pool;
+    client_state cs = {0, 0, 0};
+    int port = 0, s, c, failed = 0;
+
+    if (el == NULL) return -1;
+    s = test_tcp_listen(&port);
+    test_check(s != -1);
+    pool = he_create_client_pool(el, "localhost", port, 1, client_read_proc,
+        client_state_proc, &cs);
+    test_check(pool != NULL);
+    he_client_pool_set_timeouts(pool, 0, 5, 20);
+    test_wait(el, cs.connected == 1);
+    test_check(cs.connected == 1);
+    test_check(pool->resolver->misses >= 1);
+    test_check(he_client_pool_get(pool) != NULL);
+
+    /* The upstream goes away: the first backoff is for the dropped
+     * connection, the others for refused connects. */
+    c = accept(s, NULL, NULL);
+    test_check(c != -1);
+    close(s);
+    close(c);
+    test_wait(el, cs.backoffs >= 3);
+    test_check(cs.backoffs >= 3);
+    test_check(cs.last_err == ECONNREFUSED);
+    test_check(pool->slots[0].state != HE_CLIENT_CONNECTED);
+    test_check(he_client_pool_get(pool) == NULL);
+
+    s = test_tcp_listen(&port);
+    test_check(s != -1);
+    test_wait(el, cs.connected == 2);
+    test_check(cs.connected == 2);
+    test_check(pool->slots[0].failures == (unsigned long long)cs.backoffs);
+    he_delete_client_pool(pool);
+    if (s != -1) close(s);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* --------------------------- Edge and ready -------------------------- */
+
+#define TEST_REARM_PAIRS 300
+
+typedef struct edge_state {
+    int calls;
+    int bytes;
+    int requeue;
+    int drain;
+} edge_state;
+
+/* Reads one byte per call, or everything with drain set. requeue puts
+ * the fd on the ready list while bytes keep coming. */
+static void edge_read_proc(he_event_loop *el, int fd, void *client_data, int mask)
+{
+    edge_state *state = client_data;
+    char buf[64];
+    ssize_t n;
+
+    UNUSED(mask);
+    state->calls++;
+    do {
+        n = read(fd, buf, state->drain ? sizeof(buf) : 1);
+        if (n > 0) state->bytes += n;
+    } while (state->drain && n > 0);
+    if (state->requeue && n > 0) he_set_file_ready(el, fd, HE_READABLE);
+}
+
+/* An edge-triggered fd is reported once per edge however much is left
+ * unread, a level-triggered one until it is drained. */
+static int test_edge_trigger(int backend)
+{
+    int edge, i, fds[2], failed = 0;
+
+    for (edge = 0; edge < 2; edge++) {
+        he_event_loop *el = test_loop(backend);
+        edge_state state = {0, 0, 0, 0};
+
+        if (el == NULL) return -1;
+        he_set_edge_triggered(el, edge);
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        hnet_nonblock(NULL, fds[0]);
+        test_check(he_create_file_event(el, fds[0], HE_READABLE,
+            edge_read_proc, &state) == HE_OK);
+        test_check(write(fds[1], "abcd", 4) == 4);
+        if (edge) {
+            test_wait(el, state.calls == 1);
+            for (i = 0; i < 5; i++) he_process_events(el);
+            test_check(state.calls == 1 && state.bytes == 1);
+            test_check(write(fds[1], "e", 1) == 1);
+            test_wait(el, state.calls == 2);
+            test_check(state.calls == 2 && state.bytes == 2);
+        } else {
+            test_wait(el, state.bytes == 4);
+            test_check(state.calls == 4);
+        }
+        he_delete_file_event(el, fds[0], HE_READABLE);
+        close(fds[0]);
+        close(fds[1]);
+        he_delete_event_loop(el);
+    }
+    return failed;
+}
+
+/* A handler stopping early queues its fd with he_set_file_ready and is
+ * called again without a new edge, and without the loop going to sleep:
+ * the cron period is an hour, so a blocking poll trips the watchdog. */
+static int test_ready_list(int backend)
+{
+    he_event_loop *el = he_create_event_loop_backend(1024, 3600000, NULL, NULL, backend);
+    edge_state state = {0, 0, 1, 0};
+    int fds[2], failed = 0;
+
+    if (el == NULL) return -1;
+    he_set_edge_triggered(el, 1);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    hnet_nonblock(NULL, fds[0]);
+    test_check(he_create_file_event(el, fds[0], HE_READABLE,
+        edge_read_proc, &state) == HE_OK);
+    test_check(write(fds[1], "abcd", 4) == 4);
+    test_wait(el, state.bytes == 4);
+    test_check(state.bytes == 4 && state.calls == 4);
+    /* The requeue left by the last call dies with the registration. */
+    he_delete_file_event(el, fds[0], HE_READABLE);
+    he_process_events(el);
+    test_check(state.calls == 4);
+    close(fds[0]);
+    close(fds[1]);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* More fds firing at once than the io_uring SQ has entries: every one of
+ * them must be rearmed, or its next readiness is never reported. */
+static int test_rearm_many(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    edge_state state = {0, 0, 0, 1};
+    int fds[TEST_REARM_PAIRS][2];
+    int round, i, n = 0, failed = 0;
+
+    if (el == NULL) return -1;
+    for (i = 0; i < TEST_REARM_PAIRS; i++, n++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) == -1) break;
+        hnet_nonblock(NULL, fds[i][0]);
+        test_check(he_create_file_event(el, fds[i][0], HE_READABLE,
+            edge_read_proc, &state) == HE_OK);
+    }
+    test_check(n == TEST_REARM_PAIRS);
+    for (round = 1; round <= 3; round++) {
+        for (i = 0; i < n; i++) test_check(write(fds[i][1], "x", 1) == 1);
+        test_wait(el, state.bytes == round * n);
+        test_check(state.bytes == round * n);
+    }
+    for (i = 0; i < n; i++) {
+        he_delete_file_event(el, fds[i][0], HE_READABLE);
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* -------------------------------- Conn -------------------------------- */
+
+typedef struct conn_state {
+    int high;
+    int low;
+    int closed;
+    int close_err;
+} conn_state;
+
+static void conn_high_proc(he_conn *conn, void *client_data)
+{
+    UNUSED(conn);
+    ((conn_state *)client_data)->high++;
+}
+
+static void conn_low_proc(he_conn *conn, void *client_data)
+{
+    UNUSED(conn);
+    ((conn_state *)client_data)->low++;
+}
+
+static void conn_close_proc(he_conn *conn, int err, void *client_data)
+{
+    conn_state *state = client_data;
+
+    UNUSED(conn);
+    state->closed++;
+    state->close_err = err;
+}
+
+/* Reads whatever the peer end has, returns the byte count. */
+static size_t test_drain(int fd)
+{
+    char buf[16384];
+    size_t total = 0;
+    ssize_t n;
+
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) total += n;
+    return total;
+}
+
+static he_conn *test_conn_pair(he_event_loop *el, int *peer, conn_state *state)
+{
+    int fds[2];
+    he_conn *conn;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) return NULL;
+    hnet_nonblock(NULL, fds[0]);
+    conn = he_create_conn(el, fds[0], NULL, conn_close_proc, state);
+    *peer = fds[1];
+    return conn;
+}
+
+/* high_water_proc fires once when queued output crosses high_water and
+ * low_water_proc once when it drains back below low_water. */
+static int test_conn_water_marks(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    conn_state state = {0, 0, 0, 0};
+    char chunk[4096];
+    size_t sent = 0, received = 0;
+    he_conn *conn;
+    int peer, i, failed = 0;
+
+    if (el == NULL) return -1;
+    conn = test_conn_pair(el, &peer, &state);
+    test_check(conn != NULL);
+    he_conn_set_water_marks(conn, 16384, 65536, conn_high_proc, conn_low_proc);
+    memset(chunk, 'w', sizeof(chunk));
+    /* The socket buffer fills first, then the queue grows past high. */
+    for (i = 0; he_conn_pending(conn) < 65536 * 2 && i < 4096; i++) {
+        test_check(he_conn_write(conn, chunk, sizeof(chunk)) == HE_OK);
+        sent += sizeof(chunk);
+    }
+    test_check(state.high == 1 && state.low == 0);
+    test_wait(el, (received += test_drain(peer)) == sent);
+    test_check(received == sent);
+    test_check(he_conn_pending(conn) == 0);
+    test_check(state.high == 1 && state.low == 1);
+    test_check(state.closed == 0);
+    he_conn_close(conn);
+    close(peer);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* A coalescing conn sends nothing from he_conn_write; everything written
+ * during the iteration leaves in one go when the loop flushes it. */
+static int test_conn_coalesce(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    conn_state state = {0, 0, 0, 0};
+    he_conn *conn;
+    char buf[64];
+    int peer, i, failed = 0;
+
+    if (el == NULL) return -1;
+    conn = test_conn_pair(el, &peer, &state);
+    test_check(conn != NULL);
+    test_check(he_conn_write(conn, "direct", 6) == HE_OK);
+    test_check(he_conn_pending(conn) == 0);
+    test_check(recv(peer, buf, sizeof(buf), MSG_DONTWAIT) == 6);
+
+    he_conn_set_coalesce(conn, 1);
+    for (i = 0; i < 8; i++) test_check(he_conn_write(conn, "abcd", 4) == HE_OK);
+    test_check(he_conn_pending(conn) == 32);
+    test_check(recv(peer, buf, sizeof(buf), MSG_DONTWAIT) == -1 && errno == EAGAIN);
+    he_process_events(el);
+    test_check(he_conn_pending(conn) == 0);
+    test_check(recv(peer, buf, sizeof(buf), MSG_DONTWAIT) == 32);
+    he_conn_close(conn);
+    close(peer);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* ------------------------------ Zerocopy ----------------------------- */
+
+#define TEST_ZC_LEN (256 * 1024)
+
+static void zc_free_proc(void *buf, void *arg)
+{
+    UNUSED(buf);
+    (*(int *)arg)++;
+}
+
+/* MSG_ZEROCOPY needs TCP; a loopback pair does. */
+static he_conn *test_zc_pair(he_event_loop *el, int *peer, conn_state *state)
+{
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+    int port = 0, s, fd;
+    he_conn *conn;
+
+    if ((s = test_tcp_listen(&port)) == -1) return NULL;
+    getsockname(s, (struct sockaddr *)&sa, &len);
+    fd = hnet_tcp_nonblock_connect_addr(NULL, &sa);
+    *peer = accept(s, NULL, NULL);
+    close(s);
+    if (fd == HNET_ERR || *peer == -1) return NULL;
+    conn = he_create_conn(el, fd, NULL, conn_close_proc, state);
+    if (conn && he_conn_enable_zerocopy(conn, 1024) == HE_ERR) {
+        he_conn_close(conn);
+        close(*peer);
+        return NULL;
+    }
+    return conn;
+}
+
+/* A zerocopy buffer is handed back only once its completion arrived:
+ * with reading on, with reading paused and nothing else registered, and
+ * after the conn was closed with the send in flight. */
+static int test_zc_completion(int backend)
+{
+    static char buf[TEST_ZC_LEN];
+    int mode, peer, freed, failed = 0;
+    size_t received;
+
+    for (mode = 0; mode < 3; mode++) {
+        he_event_loop *el = test_loop(backend);
+        conn_state state = {0, 0, 0, 0};
+        he_conn *conn;
+
+        if (el == NULL) return -1;
+        if ((conn = test_zc_pair(el, &peer, &state)) == NULL) {
+            he_delete_event_loop(el);
+            return mode ? failed : -1;
+        }
+        if (mode == 1) he_conn_set_reading(conn, 0);
+        freed = 0;
+        received = 0;
+        test_check(he_conn_write_zc(conn, buf, sizeof(buf), zc_free_proc, &freed) == HE_OK);
+        if (conn->zc_seq != conn->zc_base) test_check(freed == 0);
+        if (mode == 2) he_conn_close(conn);
+        test_wait(el, (received += test_drain(peer)) == sizeof(buf) && freed);
+        test_check(received == sizeof(buf));
+        test_check(freed == 1);
+        if (mode != 2) {
+            test_check(conn->zc_seq == conn->zc_base);
+            he_conn_close(conn);
+        }
+        test_check(state.closed == 0);
+        close(peer);
+        he_delete_event_loop(el);
+    }
+    return failed;
+}
+
+/* ----------------------------- Generations ---------------------------- */
+
+typedef struct gen_state {
+    int rfds[2];
+    int wfds[2];
+    int reused[2];
+    int closer_calls;
+    int victim_calls;
+} gen_state;
+
+static void gen_victim_proc(he_event_loop *el, int fd, void *client_data, int mask)
+{
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+    ((gen_state *)client_data)->victim_calls++;
+}
+
+/* Closes the other readable fd and registers a fresh, idle socket that
+ * takes over its number. */
+static void gen_closer_proc(he_event_loop *el, int fd, void *client_data, int mask)
+{
+    gen_state *state = client_data;
+    int other = fd == state->rfds[0] ? 1 : 0;
+
+    UNUSED(mask);
+    if (state->closer_calls++) return;
+    he_delete_file_event(el, state->rfds[other], HE_READABLE);
+    close(state->rfds[other]);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, state->reused);
+    he_create_file_event(el, state->reused[0], HE_READABLE, gen_victim_proc, state);
+    state->rfds[other] = -1;
+}
+
+/* A handle names one registration: it dies with it and does not come
+ * back when the fd number is registered again. */
+static int test_gen_handles(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    he_handle h1, h2;
+    int fds[2], failed = 0;
+
+    if (el == NULL) return -1;
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    test_check(he_get_file_handle(el, fds[0]) == HE_HANDLE_NONE);
+    he_create_file_event(el, fds[0], HE_READABLE, gen_victim_proc, NULL);
+    h1 = he_get_file_handle(el, fds[0]);
+    test_check(HE_HANDLE_FD(h1) == fds[0]);
+    test_check(he_handle_valid(el, h1));
+    he_create_file_event(el, fds[0], HE_WRITABLE, gen_victim_proc, NULL);
+    test_check(he_get_file_handle(el, fds[0]) == h1);
+    he_delete_file_event(el, fds[0], HE_READABLE|HE_WRITABLE);
+    test_check(!he_handle_valid(el, h1));
+    he_create_file_event(el, fds[0], HE_READABLE, gen_victim_proc, NULL);
+    h2 = he_get_file_handle(el, fds[0]);
+    test_check(h2 != h1 && HE_HANDLE_FD(h2) == fds[0]);
+    test_check(he_handle_valid(el, h2) && !he_handle_valid(el, h1));
+    he_delete_file_event(el, fds[0], HE_READABLE);
+    close(fds[0]);
+    close(fds[1]);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* Two fds fire in one pass and the first handler closes the other, whose
+ * number goes to a new idle socket. The event fetched for the old socket
+ * must be dropped, not delivered to the new registration. */
+static int test_gen_stale_event(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    gen_state state;
+    int a[2], b[2], i, failed = 0;
+
+    if (el == NULL) return -1;
+    memset(&state, 0, sizeof(state));
+    socketpair(AF_UNIX, SOCK_STREAM, 0, a);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, b);
+    state.rfds[0] = a[0];
+    state.rfds[1] = b[0];
+    state.wfds[0] = a[1];
+    state.wfds[1] = b[1];
+    he_create_file_event(el, a[0], HE_READABLE, gen_closer_proc, &state);
+    he_create_file_event(el, b[0], HE_READABLE, gen_closer_proc, &state);
+    test_check(write(a[1], "x", 1) == 1 && write(b[1], "x", 1) == 1);
+    test_wait(el, state.closer_calls > 0);
+    test_check(state.closer_calls == 1);
+    /* Same number, or the case is not exercised. */
+    test_check(state.reused[0] == a[0] || state.reused[0] == b[0]);
+    test_check(state.victim_calls == 0);
+    for (i = 0; i < 2; i++) {
+        if (state.rfds[i] != -1) {
+            he_delete_file_event(el, state.rfds[i], HE_READABLE);
+            close(state.rfds[i]);
+        }
+        close(state.wfds[i]);
+    }
+    he_delete_file_event(el, state.reused[0], HE_READABLE);
+    close(state.reused[0]);
+    close(state.reused[1]);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* ---------------------------- Interest sets --------------------------- */
+
+typedef struct interest_state {
+    int reads;
+    int writes;
+    int oneshot;
+} interest_state;
+
+static void interest_read_proc(he_event_loop *el, int fd, void *client_data, int mask)
+{
+    interest_state *state = client_data;
+    char buf[64];
+
+    UNUSED(el);
+    UNUSED(mask);
+    while (read(fd, buf, sizeof(buf)) > 0);
+    state->reads++;
+}
+
+static void interest_write_proc(he_event_loop *el, int fd, void *client_data, int mask)
+{
+    interest_state *state = client_data;
+
+    UNUSED(mask);
+    state->writes++;
+    if (state->oneshot) he_delete_file_event(el, fd, HE_WRITABLE);
+}
+
+/* Write interest added and removed again before the loop polls never
+ * reaches the handler of an always writable socket; added and kept, it
+ * does, and read interest is unaffected either way. With exclusive set,
+ * epoll needs the change applied as DEL plus ADD, never as MOD. */
+static int test_interest_changes(int backend)
+{
+    int exclusive, i, fds[2], failed = 0;
+
+    for (exclusive = 0; exclusive < 2; exclusive++) {
+        he_event_loop *el = test_loop(backend);
+        interest_state state = {0, 0, 1};
+        int rmask = HE_READABLE | (exclusive ? HE_EXCLUSIVE : 0);
+
+        if (el == NULL) return -1;
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        hnet_nonblock(NULL, fds[0]);
+        test_check(he_create_file_event(el, fds[0], rmask,
+            interest_read_proc, &state) == HE_OK);
+        he_process_events(el);
+
+        for (i = 0; i < 3; i++) {
+            test_check(he_create_file_event(el, fds[0], HE_WRITABLE,
+                interest_write_proc, &state) == HE_OK);
+            he_delete_file_event(el, fds[0], HE_WRITABLE);
+            he_process_events(el);
+        }
+        test_check(state.writes == 0);
+
+        test_check(he_create_file_event(el, fds[0], HE_WRITABLE,
+            interest_write_proc, &state) == HE_OK);
+        test_wait(el, state.writes == 1);
+        test_check(state.writes == 1);
+        for (i = 0; i < 3; i++) he_process_events(el);
+        test_check(state.writes == 1);
+
+        test_check(write(fds[1], "r", 1) == 1);
+        test_wait(el, state.reads == 1);
+        test_check(state.reads == 1);
+        test_check(el->ctl_errors == 0);
+        he_delete_file_event(el, fds[0], HE_READABLE);
+        close(fds[0]);
+        close(fds[1]);
+        he_delete_event_loop(el);
+    }
+    return failed;
+}
+
+/* ------------------------------ Table sizes --------------------------- */
+
+#define SIZE_HIGH_FD 200
+#define SIZE_PAIRS 8
+
+static void size_read_proc(he_event_loop *el, int fd, void *client_data, int mask)
+{
+    int *reads = client_data;
+    char buf[64];
+
+    UNUSED(mask);
+    if (read(fd, buf, sizeof(buf)) > 0) (*reads)++;
+    he_delete_file_event(el, fd, HE_READABLE);
+}
+
+/* The fd table grows for an fd beyond setsize, refuses to shrink below a
+ * registered fd and shrinks once it is gone. */
+static int test_resize_setsize(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    int fds[2], high, reads = 0, failed = 0;
+
+    if (el == NULL) return -1;
+    test_check(he_resize_setsize(el, 16) == HE_OK);
+    test_check(el->setsize == 16);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    high = dup2(fds[0], SIZE_HIGH_FD);
+    test_check(high == SIZE_HIGH_FD);
+    hnet_nonblock(NULL, high);
+    test_check(he_create_file_event(el, high, HE_READABLE,
+        size_read_proc, &reads) == HE_OK);
+    test_check(el->setsize > SIZE_HIGH_FD);
+
+    errno = 0;
+    test_check(he_resize_setsize(el, 16) == HE_ERR && errno == EBUSY);
+    errno = 0;
+    test_check(he_resize_setsize(el, 0) == HE_ERR && errno == EINVAL);
+
+    test_check(write(fds[1], "x", 1) == 1);
+    test_wait(el, reads == 1);
+    test_check(reads == 1);
+    test_check(el->events[high].mask == HE_NONE);
+    test_check(he_resize_setsize(el, 16) == HE_OK);
+    test_check(el->setsize == 16);
+
+    /* The shrunk table still serves the fds below it. */
+    test_check(he_create_file_event(el, fds[0], HE_READABLE,
+        size_read_proc, &reads) == HE_OK);
+    test_check(write(fds[1], "y", 1) == 1);
+    test_wait(el, reads == 2);
+    test_check(reads == 2);
+    close(high);
+    close(fds[0]);
+    close(fds[1]);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* With fewer poll slots than ready fds every fd is still served, over
+ * several passes. */
+static int test_max_events(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    int fds[SIZE_PAIRS][2], j, reads = 0, failed = 0;
+
+    if (el == NULL) return -1;
+    errno = 0;
+    test_check(he_set_max_events(el, 0) == HE_ERR && errno == EINVAL);
+    test_check(he_set_max_events(el, 2) == HE_OK);
+    test_check(el->maxevents == 2);
+    for (j = 0; j < SIZE_PAIRS; j++) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds[j]);
+        hnet_nonblock(NULL, fds[j][0]);
+        test_check(he_create_file_event(el, fds[j][0], HE_READABLE,
+            size_read_proc, &reads) == HE_OK);
+        test_check(write(fds[j][1], "x", 1) == 1);
+    }
+    test_wait(el, reads == SIZE_PAIRS);
+    test_check(reads == SIZE_PAIRS);
+
+    test_check(he_set_max_events(el, 64) == HE_OK);
+    for (j = 0; j < SIZE_PAIRS; j++) {
+        test_check(he_create_file_event(el, fds[j][0], HE_READABLE,
+            size_read_proc, &reads) == HE_OK);
+        test_check(write(fds[j][1], "y", 1) == 1);
+    }
+    test_wait(el, reads == 2 * SIZE_PAIRS);
+    test_check(reads == 2 * SIZE_PAIRS);
+    for (j = 0; j < SIZE_PAIRS; j++) {
+        close(fds[j][0]);
+        close(fds[j][1]);
+    }
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* ------------------------------- UDP cache -------------------------- */
+
+#define UDP_PEERS 3
+
+static void udp_read_proc(he_udp *udp, struct mmsghdr *msgs, int count,
+    void *client_data)
+{
+    int *replies = client_data;
+
+    UNUSED(udp);
+    UNUSED(msgs);
+    *replies += count;
+}
+
+static int test_udp_listen(struct sockaddr_storage *sa)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in*)sa;
+    socklen_t len = sizeof(*sa);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(sa, 0, sizeof(*sa));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd == -1) return -1;
+    if (bind(fd, (struct sockaddr*)sin, sizeof(*sin)) == -1 ||
+        getsockname(fd, (struct sockaddr*)sa, &len) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* A hit moves the peer to the front, so the least recently used one is
+ * evicted, and its queued datagrams are sent before its socket closes.
+ * Replies from every peer reach the shared read_proc. */
+static int test_udp_cache_lru(int backend)
+{
+    he_event_loop *el = test_loop(backend);
+    struct sockaddr_storage sa[UDP_PEERS], local;
+    socklen_t len = sizeof(local);
+    int fds[UDP_PEERS], j, replies = 0, failed = 0;
+    he_udp_cache *cache;
+    he_udp *a, *udp;
+    char buf[16];
+
+    if (el == NULL) return -1;
+    for (j = 0; j < UDP_PEERS; j++) fds[j] = test_udp_listen(&sa[j]);
+    cache = he_create_udp_cache(el, 2, 4, 64, udp_read_proc, &replies);
+    test_check(cache != NULL);
+
+    a = he_udp_cache_get(cache, &sa[0]);
+    test_check(a != NULL);
+    test_check(he_udp_cache_get(cache, &sa[1]) != NULL);
+    test_check(he_udp_cache_get(cache, &sa[0]) == a);
+    test_check(cache->hits == 1 && cache->misses == 2);
+
+    /* sa[1] is the least recently used one. */
+    test_check(he_udp_cache_get(cache, &sa[2]) != NULL);
+    test_check(cache->evictions == 1 && cache->count == 2);
+    test_check(he_udp_cache_get(cache, &sa[0]) == a);
+    test_check(cache->hits == 2 && cache->misses == 3);
+
+    /* Now sa[2] is; its queued datagram goes out on eviction. */
+    test_check(he_udp_cache_send(cache, &sa[2], "c", 1) == HE_OK);
+    test_check(he_udp_cache_get(cache, &sa[0]) == a);
+    test_check(he_udp_cache_get(cache, &sa[1]) != NULL);
+    test_check(cache->evictions == 2 && cache->misses == 4);
+    test_check(recv(fds[2], buf, sizeof(buf), MSG_DONTWAIT) == 1 && buf[0] == 'c');
+
+    /* Another miss evicts sa[0] but, touched last, not sa[1]. */
+    udp = he_udp_cache_get(cache, &sa[1]);
+    test_check(he_udp_cache_get(cache, &sa[2]) != NULL);
+    test_check(cache->evictions == 3 && cache->hits == 5);
+    test_check(he_udp_cache_get(cache, &sa[1]) == udp);
+
+    /* Replies to the connected socket reach read_proc. */
+    test_check(getsockname(udp->fd, (struct sockaddr*)&local, &len) == 0);
+    test_check(sendto(fds[1], "r", 1, 0, (struct sockaddr*)&local, len) == 1);
+    test_wait(el, replies == 1);
+    test_check(replies == 1);
+
+    he_delete_udp_cache(cache);
+    for (j = 0; j < UDP_PEERS; j++) close(fds[j]);
+    he_delete_event_loop(el);
+    return failed;
+}
+
+/* -------------------------------- Main ------------------------------- */
+
+static test_case tests[] = {
+    {"timer_order", test_timer_order},
+    {"timer_delete_self", test_timer_delete_self},
+    {"timer_reset_self", test_timer_reset_self},
+    {"post_order", test_post_order},
+    {"post_producers", test_post_producers},
+    {"post_wakeup", test_post_wakeup},
+    {"edge_trigger", test_edge_trigger},
+    {"ready_list", test_ready_list},
+    {"rearm_many", test_rearm_many},
+    {"conn_water_marks", test_conn_water_marks},
+    {"conn_coalesce", test_conn_coalesce},
+    {"zc_completion", test_zc_completion},
+    {"gen_handles", test_gen_handles},
+    {"gen_stale_event", test_gen_stale_event},
+    {"interest_changes", test_interest_changes},
+    {"resize_setsize", test_resize_setsize},
+    {"max_events", test_max_events},
+    {"udp_cache_lru", test_udp_cache_lru},
+    {"frame_partial_header", test_frame_partial_header},
+    {"frame_split", test_frame_split},
+    {"frame_oversized", test_frame_oversized},
+    {"unix_perm", test_unix_perm},
+    {"accept_emfile", test_accept_emfile},
+    {"accept_budget", test_accept_budget},
+    {"resolver_delete_inflight", test_resolver_delete_inflight},
+    {"resolver_cache", test_resolver_cache},
+    {"resolver_delete_from_proc", test_resolver_delete_from_proc},
+    {"client_backoff", test_client_backoff},
+    {NULL, NULL}
+};
+
+int main(int argc, char **argv)
+{
+    int backends[] = {HE_BACKEND_EPOLL, HE_BACKEND_URING};
+    const char *names[] = {"epoll", "io_uring"};
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    int b, failed, total = 0;
+    test_case *tc;
+
+    for (tc = tests; tc->name; tc++) {
+        if (filter && strstr(tc->name, filter) == NULL) continue;
+        for (b = 0; b < 2; b++) {
+            alarm(TEST_WATCHDOG_SEC);
+            failed = tc->proc(backends[b]);
+            alarm(0);
+            if (failed < 0) {
+                printf("[skip] %s %s\n", tc->name, names[b]);
+                continue;
+            }
+            printf("[%s] %s %s\n", failed ? "fail" : "ok", tc->name, names[b]);
+            total += failed;
+        }
+    }
+    if (total) printf("%d checks failed\n", total);
+    else printf("all tests passed\n");
+    return total ? 1 : 0;
+}
@@ -7,6 +7,7 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -15,9 +16,32 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/errqueue.h>
 
 #include "hnet.h"
 
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
 static void hnet_set_error(char *err, const char *fmt, ...)
 {
     va_list ap;
@@ -179,6 +203,31 @@ end:
     return s;
 }
 
+/* Nonblocking connect to an already resolved address, e.g. one delivered
+ * by he_resolve, so the loop never waits on getaddrinfo. */
+int hnet_tcp_nonblock_connect_addr(char *err, const struct sockaddr_storage *sa)
+{
+    int s;
+    socklen_t len = sa->ss_family == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+    if ((s = socket(sa->ss_family, SOCK_STREAM, 0)) == -1) {
+        hnet_set_error(err, "creating socket: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    if (hnet_set_reuse_addr(err, s) == HNET_ERR) goto error;
+    if (hnet_nonblock(err, s) != HNET_OK) goto error;
+    if (connect(s, (const struct sockaddr*)sa, len) == -1 && errno != EINPROGRESS) {
+        hnet_set_error(err, "connect: %s", strerror(errno));
+        goto error;
+    }
+    return s;
+
+error:
+    close(s);
+    return HNET_ERR;
+}
+
 static int hnet_listen(char *err, int s, struct sockaddr *sa, socklen_t len, int backlog) 
 {
     if (bind(s, sa, len) == -1) {
@@ -277,6 +326,47 @@ int hnet_tcp_accept(char *err, int s, struct sockaddr_storage *sa)
     return fd;
 }
 
+/* Like hnet_tcp_accept but the new fd gets flags (SOCK_NONBLOCK,
+ * SOCK_CLOEXEC) atomically, which saves the fcntl round trips of
+ * hnet_nonblock. EAGAIN is returned without touching err so that draining
+ * a listener does not pay for formatting the last error. */
+int hnet_tcp_accept4(char *err, int s, struct sockaddr_storage *sa, int flags)
+{
+    int fd;
+    socklen_t salen;
+
+    while (1) {
+        salen = sizeof(*sa);
+        fd = accept4(s, (struct sockaddr*)sa, &salen, flags);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN)
+                hnet_set_error(err, "accept4: %s", strerror(errno));
+            return HNET_ERR;
+        }
+        break;
+    }
+    return fd;
+}
+
+int hnet_apply_sockopts(char *err, int fd, const hnet_sockopts *opts)
+{
+    if (opts->nodelay && hnet_enable_tcp_nodelay(err, fd) == HNET_ERR)
+        return HNET_ERR;
+    if (opts->keepalive > 0 && hnet_keep_alive(err, fd, opts->keepalive) == HNET_ERR)
+        return HNET_ERR;
+    if (opts->recv_buffer > 0 && hnet_set_recv_buffer(err, fd, opts->recv_buffer) == HNET_ERR)
+        return HNET_ERR;
+    if (opts->send_buffer > 0 && hnet_set_send_buffer(err, fd, opts->send_buffer) == HNET_ERR)
+        return HNET_ERR;
+    if (opts->busy_poll > 0 && hnet_set_busy_poll(err, fd, opts->busy_poll) == HNET_ERR)
+        return HNET_ERR;
+    if (opts->prefer_busy_poll &&
+        hnet_set_prefer_busy_poll(err, fd, 1, 0) == HNET_ERR)
+        return HNET_ERR;
+    return HNET_OK;
+}
+
 int hnet_set_recv_buffer(char *err, int fd, int buffsize)
 {
     if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffsize, sizeof(buffsize)) == -1)
@@ -313,6 +403,12 @@ void hnet_get_ip_port(struct sockaddr_storage *sa, char *ip, size_t ip_len, int
         struct sockaddr_in *s = (struct sockaddr_in *)sa;
         if (ip) inet_ntop(AF_INET, (void*)&(s->sin_addr), ip, ip_len);
         if (port) *port = ntohs(s->sin_port);
+    } else if (sa->ss_family == AF_UNIX) {
+        /* Peers of a unix listener are usually unnamed: empty path. */
+        struct sockaddr_un *s = (struct sockaddr_un *)sa;
+        if (ip && ip_len)
+            snprintf(ip, ip_len, "%.*s", (int)sizeof(s->sun_path), s->sun_path);
+        if (port) *port = 0;
     } else {
         struct sockaddr_in6 *s = (struct sockaddr_in6 *)sa;
         if (ip) inet_ntop(AF_INET6,(void*)&(s->sin6_addr), ip, ip_len);
@@ -365,6 +461,30 @@ int hnet_udp6_server(char *err, int port, char *bindaddr, int reuse_port)
     return hnet_generic_udp_server(err, port, bindaddr, AF_INET6, reuse_port);
 }
 
+/* A nonblocking UDP socket connected to sa. Sends on it skip the route
+ * and neighbour lookups done for every unconnected sendto. */
+int hnet_udp_connect(char *err, const struct sockaddr_storage *sa)
+{
+    int s;
+    socklen_t len = sa->ss_family == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+    if ((s = socket(sa->ss_family, SOCK_DGRAM, 0)) == -1) {
+        hnet_set_error(err, "creating socket: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    if (hnet_nonblock(err, s) != HNET_OK) goto error;
+    if (connect(s, (const struct sockaddr*)sa, len) == -1) {
+        hnet_set_error(err, "connect: %s", strerror(errno));
+        goto error;
+    }
+    return s;
+
+error:
+    close(s);
+    return HNET_ERR;
+}
+
 int hnet_udp_nonblock_sendto(char *err, char *addr, int port, 
     void *buf, size_t len, ssize_t *written)
 {
@@ -429,16 +549,480 @@ void hnet_set_mmsghdr(void *bufs, size_t len, unsigned int vlen,
         msgs[i].msg_hdr.msg_iovlen = 1;
         msgs[i].msg_hdr.msg_name = &sas[i];
         msgs[i].msg_hdr.msg_namelen = sizeof(sas[i]);
+        msgs[i].msg_hdr.msg_control = NULL;
+        msgs[i].msg_hdr.msg_controllen = 0;
+        msgs[i].msg_hdr.msg_flags = 0;
+        msgs[i].msg_len = 0;
+    }
+}
+
+/* recvmmsg overwrites msg_namelen and msg_flags of every message it
+ * fills, so they must be restored before the array is reused. */
+void hnet_reset_mmsghdr(struct mmsghdr *msgs, unsigned int vlen)
+{
+    unsigned int i;
+
+    for (i = 0; i < vlen; i++) {
+        if (msgs[i].msg_hdr.msg_name)
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        msgs[i].msg_hdr.msg_flags = 0;
+        msgs[i].msg_len = 0;
     }
 }
 
 int hnet_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen)
+{
+    return hnet_recvmmsg_flags(fd, msgs, vlen, 0);
+}
+
+int hnet_recvmmsg_flags(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+    int retval;
+
+    hnet_reset_mmsghdr(msgs, vlen);
+    retval = recvmmsg(fd, msgs, vlen, flags, NULL);
+    if (retval == -1) {
+        return HNET_ERR;
+    }
+    return retval;
+}
+
+int hnet_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
 {
     int retval;
 
-    retval = recvmmsg(fd, msgs, vlen, 0, NULL);
+    retval = sendmmsg(fd, msgs, vlen, flags);
     if (retval == -1) {
         return HNET_ERR;
     }
     return retval;
 }
+
+/* Default GSO segment size for every send on fd, 0 disables it. */
+int hnet_set_udp_segment(char *err, int fd, int gso_size)
+{
+    if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == -1) {
+        hnet_set_error(err, "setsockopt UDP_SEGMENT: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    return HNET_OK;
+}
+
+int hnet_enable_udp_gro(char *err, int fd)
+{
+    int val = 1;
+
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) == -1) {
+        hnet_set_error(err, "setsockopt UDP_GRO: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    return HNET_OK;
+}
+
+/* Send buf as len / gso_size datagrams of gso_size bytes (the last one may
+ * be shorter) with a single syscall. sa may be NULL on a connected socket.
+ * At most HNET_GSO_MAX_SEGS segments fit in one call. */
+ssize_t hnet_send_gso(int fd, const void *buf, size_t len, int gso_size,
+    struct sockaddr_storage *sa)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } control;
+    uint16_t seg = gso_size;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (sa) {
+        msg.msg_name = sa;
+        msg.msg_namelen = sa->ss_family == AF_INET6 ?
+            sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    }
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(seg));
+    memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+    return sendmsg(fd, &msg, 0);
+}
+
+/* Returns the GRO segment size carried by a message received with a
+ * control buffer, or 0 if the datagram was not coalesced. */
+int hnet_get_gro_size(struct msghdr *msg)
+{
+    struct cmsghdr *cm;
+    int gso_size;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+            return gso_size;
+        }
+    }
+    return 0;
+}
+
+/* Receive one possibly coalesced GRO buffer. On success *gso_size is the
+ * size of every segment but the last one; it equals the returned length
+ * when the kernel delivered a single datagram. len should be 64KB to
+ * hold a full GRO batch. */
+ssize_t hnet_recv_gro(int fd, void *buf, size_t len, struct sockaddr_storage *sa,
+    int *gso_size)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (sa) {
+        msg.msg_name = sa;
+        msg.msg_namelen = sizeof(*sa);
+    }
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if ((n = recvmsg(fd, &msg, 0)) == -1) return -1;
+    *gso_size = hnet_get_gro_size(&msg);
+    if (*gso_size == 0) *gso_size = n;
+    return n;
+}
+
+/* Let blocking receives and poll calls on fd spin on the device queue for
+ * up to usec microseconds (net.core.busy_read/busy_poll per socket).
+ * Raising it above the sysctl default needs CAP_NET_ADMIN on some kernels. */
+int hnet_set_busy_poll(char *err, int fd, int usec)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1) {
+        hnet_set_error(err, "setsockopt SO_BUSY_POLL: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    return HNET_OK;
+}
+
+/* Prefer busy polling over softirq processing for fd's NAPI context
+ * (Linux 5.11+). budget is the number of packets per busy poll, 0 keeps
+ * the kernel default. */
+int hnet_set_prefer_busy_poll(char *err, int fd, int enable, int budget)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &enable, sizeof(enable)) == -1) {
+        hnet_set_error(err, "setsockopt SO_PREFER_BUSY_POLL: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    if (budget > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) == -1) {
+        hnet_set_error(err, "setsockopt SO_BUSY_POLL_BUDGET: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    return HNET_OK;
+}
+
+int hnet_enable_zerocopy(char *err, int fd)
+{
+    int val = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) == -1) {
+        hnet_set_error(err, "setsockopt SO_ZEROCOPY: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    return HNET_OK;
+}
+
+/* Every call that returns > 0 consumes one notification sequence number;
+ * the pages of buf stay referenced by the kernel until that number is
+ * reported by hnet_read_zerocopy. */
+ssize_t hnet_send_zerocopy(int fd, const void *buf, size_t len)
+{
+    return send(fd, buf, len, MSG_ZEROCOPY);
+}
+
+/* Read one completion from the socket error queue. Returns 1 and the
+ * completed range [lo, hi] of sequence numbers, 0 if the queue is empty
+ * or HNET_ERR. copied is set when the kernel fell back to copying. */
+int hnet_read_zerocopy(int fd, unsigned int *lo, unsigned int *hi, int *copied)
+{
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    char control[128];
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+        if (errno == EAGAIN) return 0;
+        return HNET_ERR;
+    }
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        struct sock_extended_err *serr;
+
+        if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            continue;
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+        *lo = serr->ee_info;
+        *hi = serr->ee_data;
+        *copied = (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+        return 1;
+    }
+    errno = EPROTO;
+    return HNET_ERR;
+}
+
+/* path names a filesystem socket; a leading '@' selects the Linux
+ * abstract namespace, which needs no cleanup and ignores permissions. */
+static int hnet_unix_addr(char *err, const char *path, struct sockaddr_un *sa,
+    socklen_t *len)
+{
+    size_t plen = strlen(path);
+
+    if (plen == 0 || plen >= sizeof(sa->sun_path)) {
+        hnet_set_error(err, "invalid unix socket path: '%s'", path);
+        errno = EINVAL;
+        return HNET_ERR;
+    }
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    memcpy(sa->sun_path, path, plen);
+    if (path[0] == '@') {
+        sa->sun_path[0] = '\0';
+        *len = offsetof(struct sockaddr_un, sun_path) + plen;
+    } else {
+        *len = sizeof(*sa);
+    }
+    return HNET_OK;
+}
+
+/* Datagram sockets are usable as soon as they are bound, so the file is
+ * created in a fresh 0700 directory next to path, given perm there and
+ * only then moved into place. The move does not replace an existing file,
+ * keeping bind's EADDRINUSE for a stale socket. */
+static int hnet_unix_bind_private(char *err, int s, const char *path, mode_t perm)
+{
+    const char *slash = strrchr(path, '/');
+    struct sockaddr_un sa;
+    socklen_t len;
+    char dir[sizeof(sa.sun_path)], tmp[sizeof(sa.sun_path)];
+    int n, rv = HNET_ERR;
+
+    if (slash) n = snprintf(dir, sizeof(dir), "%.*s/.hnet-XXXXXX", (int)(slash - path), path);
+    else n = snprintf(dir, sizeof(dir), "./.hnet-XXXXXX");
+    if (n < 0 || (size_t)n + 2 >= sizeof(dir)) {
+        hnet_set_error(err, "unix socket path too long: '%s'", path);
+        errno = ENAMETOOLONG;
+        return HNET_ERR;
+    }
+    if (mkdtemp(dir) == NULL) {
+        hnet_set_error(err, "mkdtemp: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    memcpy(tmp, dir, n);
+    memcpy(tmp + n, "/s", 3);
+    if (hnet_unix_addr(err, tmp, &sa, &len) == HNET_ERR) goto out;
+    if (bind(s, (struct sockaddr*)&sa, len) == -1) {
+        hnet_set_error(err, "bind: %s", strerror(errno));
+        goto out;
+    }
+    if (chmod(tmp, perm) == -1) {
+        hnet_set_error(err, "chmod: %s", strerror(errno));
+    } else if (renameat2(AT_FDCWD, tmp, AT_FDCWD, path, RENAME_NOREPLACE) == -1) {
+        if (errno == EEXIST) errno = EADDRINUSE;
+        hnet_set_error(err, "bind: %s", strerror(errno));
+    } else {
+        rv = HNET_OK;
+    }
+    if (rv == HNET_ERR) unlink(tmp);
+out:
+    rmdir(dir);
+    return rv;
+}
+
+/* The socket file never exists with wider permissions than perm: a
+ * stream socket cannot be connected to before listen, so it is chmod'ed
+ * in between; a datagram socket is bound out of reach first. Once the file
+ * exists any later failure removes it again. */
+static int hnet_generic_unix_server(char *err, const char *path, mode_t perm,
+    int type, int backlog)
+{
+    int s, fsock = path[0] != '@';
+    struct sockaddr_un sa;
+    socklen_t len;
+
+    if (hnet_unix_addr(err, path, &sa, &len) == HNET_ERR) return HNET_ERR;
+    if ((s = socket(AF_UNIX, type|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1) {
+        hnet_set_error(err, "creating socket: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    if (perm && fsock && type == SOCK_DGRAM) {
+        if (hnet_unix_bind_private(err, s, path, perm) == HNET_ERR) {
+            close(s);
+            return HNET_ERR;
+        }
+        return s;
+    }
+    if (bind(s, (struct sockaddr*)&sa, len) == -1) {
+        hnet_set_error(err, "bind: %s", strerror(errno));
+        close(s);
+        return HNET_ERR;
+    }
+    if (perm && fsock && chmod(path, perm) == -1) {
+        hnet_set_error(err, "chmod: %s", strerror(errno));
+        goto error;
+    }
+    if (type == SOCK_STREAM && listen(s, backlog) == -1) {
+        hnet_set_error(err, "listen: %s", strerror(errno));
+        goto error;
+    }
+    return s;
+
+error:
+    if (fsock) unlink(path);
+    close(s);
+    return HNET_ERR;
+}
+
+/* A nonblocking listening AF_UNIX stream socket, for he_acceptor. A stale
+ * socket file left at path makes bind fail with EADDRINUSE; removing it is
+ * up to the caller. perm, if not 0, is the mode of the socket file. */
+int hnet_unix_server(char *err, const char *path, mode_t perm, int backlog)
+{
+    return hnet_generic_unix_server(err, path, perm, SOCK_STREAM, backlog);
+}
+
+/* A nonblocking AF_UNIX datagram socket bound to path. */
+int hnet_unix_dgram_server(char *err, const char *path, mode_t perm)
+{
+    return hnet_generic_unix_server(err, path, perm, SOCK_DGRAM, 0);
+}
+
+/* flags are accept4 flags; the peer address of a unix client is rarely
+ * worth anything, so it is not returned. */
+int hnet_unix_accept(char *err, int s, int flags)
+{
+    struct sockaddr_storage sa;
+
+    return hnet_tcp_accept4(err, s, &sa, flags);
+}
+
+static int hnet_generic_unix_connect(char *err, const char *path, int type)
+{
+    int s;
+    struct sockaddr_un sa;
+    socklen_t len;
+
+    if (hnet_unix_addr(err, path, &sa, &len) == HNET_ERR) return HNET_ERR;
+    if ((s = socket(AF_UNIX, type|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) == -1) {
+        hnet_set_error(err, "creating socket: %s", strerror(errno));
+        return HNET_ERR;
+    }
+    /* A full backlog fails a nonblocking unix connect with EAGAIN rather
+     * than leaving it in progress. */
+    if (connect(s, (struct sockaddr*)&sa, len) == -1 && errno != EINPROGRESS) {
+        hnet_set_error(err, "connect: %s", strerror(errno));
+        close(s);
+        return HNET_ERR;
+    }
+    return s;
+}
+
+/* Unix stream connects complete at once, so the fd can be wrapped in an
+ * he_conn right away. */
+int hnet_unix_nonblock_connect(char *err, const char *path)
+{
+    return hnet_generic_unix_connect(err, path, SOCK_STREAM);
+}
+
+/* A nonblocking datagram socket connected to path. It is unbound, so the
+ * server cannot reply to it. */
+int hnet_unix_dgram_connect(char *err, const char *path)
+{
+    return hnet_generic_unix_connect(err, path, SOCK_DGRAM);
+}
+
+/* Send len bytes of buf with nfds descriptors attached as SCM_RIGHTS. The
+ * receiver gets its own copies; the caller still owns and usually closes
+ * fds once this succeeds. len must be at least 1 on a stream socket, the
+ * fds travel with the first byte. At most HNET_MAX_PASS_FDS per call. */
+ssize_t hnet_send_fds(int fd, const void *buf, size_t len, const int *fds, int nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HNET_MAX_PASS_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    if (nfds < 0 || nfds > HNET_MAX_PASS_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/* Receive up to len bytes and the descriptors sent with them. *nfds is the
+ * capacity of fds on input and the number received on output; received
+ * fds are close-on-exec. Descriptors beyond the capacity are closed, and
+ * the kernel drops those that did not fit HNET_MAX_PASS_FDS. */
+ssize_t hnet_recv_fds(int fd, void *buf, size_t len, int *fds, int *nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HNET_MAX_PASS_FDS)];
+        struct cmsghdr align;
+    } control;
+    int max = *nfds, count = 0, i, n, passed;
+    ssize_t nread;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    *nfds = 0;
+    if ((nread = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1) return -1;
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++) {
+            memcpy(&passed, CMSG_DATA(cm) + sizeof(int) * i, sizeof(int));
+            if (count < max) fds[count++] = passed;
+            else close(passed);
+        }
+    }
+    *nfds = count;
+    return nread;
+}
@@ -0,0 +1,346 @@
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+
+#include "he.h"
+#include "he_stats.h"
+
+#define UNUSED(V) ((void) V)
+
+#define MICRO_MAX_RUNS 64
+#define MICRO_CHURN_FDS 64
+#define MICRO_DISPATCH_FDS 256
+
+/* Runs ops operations against a fresh loop on backend and returns the
+ * elapsed nanoseconds, setup excluded, or -1 if it could not run. */
+typedef long long micro_proc(int backend, long long ops);
+
+/* Keeps the clock loops from being optimized away. */
+static volatile long long micro_sink;
+
+typedef struct micro_bench {
+    const char *name;
+    int per_backend;
+    long long ops;
+    micro_proc *proc;
+} micro_bench;
+
+static long long micro_nstime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static int micro_open_eventfds(int *fds, int n, int readable)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if ((fds[i] = eventfd(readable, EFD_NONBLOCK|EFD_CLOEXEC)) == -1) {
+            while (i--) close(fds[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void micro_close_fds(int *fds, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) close(fds[i]);
+}
+
+static void micro_noop_handler(he_event_loop *el, int fd, void *privdata, int mask)
+{
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+
+    (*(long long *)privdata)++;
+}
+
+/* he_create_file_event + he_delete_file_event on a small set of fds. */
+static long long bench_file_event_churn(int backend, long long ops)
+{
+    he_event_loop *el = he_create_event_loop_backend(1024, 1000, NULL, NULL, backend);
+    int fds[MICRO_CHURN_FDS];
+    long long start, elapsed, i, fired = 0;
+
+    if (el == NULL) return -1;
+    if (micro_open_eventfds(fds, MICRO_CHURN_FDS, 0) == -1) {
+        he_delete_event_loop(el);
+        return -1;
+    }
+    start = micro_nstime();
+    for (i = 0; i < ops; i++) {
+        int fd = fds[i % MICRO_CHURN_FDS];
+
+        he_create_file_event(el, fd, HE_READABLE, micro_noop_handler, &fired);
+        he_delete_file_event(el, fd, HE_READABLE);
+    }
+    elapsed = micro_nstime() - start;
+    micro_close_fds(fds, MICRO_CHURN_FDS);
+    he_delete_event_loop(el);
+    return elapsed;
+}
+
+/* Cost per fired event: level-triggered eventfds that stay readable, so
+ * every he_process_events call fires all of them. */
+static long long bench_dispatch(int backend, long long ops)
+{
+    he_event_loop *el = he_create_event_loop_backend(1024, 1000, NULL, NULL, backend);
+    int fds[MICRO_DISPATCH_FDS], i;
+    long long start, elapsed, fired = 0;
+
+    if (el == NULL) return -1;
+    if (micro_open_eventfds(fds, MICRO_DISPATCH_FDS, 1) == -1) {
+        he_delete_event_loop(el);
+        return -1;
+    }
+    for (i = 0; i < MICRO_DISPATCH_FDS; i++)
+        he_create_file_event(el, fds[i], HE_READABLE, micro_noop_handler, &fired);
+    he_process_events(el);
+    fired = 0;
+    start = micro_nstime();
+    while (fired < ops) he_process_events(el);
+    elapsed = micro_nstime() - start;
+    micro_close_fds(fds, MICRO_DISPATCH_FDS);
+    he_delete_event_loop(el);
+    return elapsed * ops / fired;
+}
+
+static long long micro_timer_proc(he_event_loop *el, he_timer *timer, void *privdata)
+{
+    UNUSED(el);
+    UNUSED(timer);
+
+    (*(long long *)privdata)++;
+    return HE_NOMORE;
+}
+
+/* ops timers with spread out deadlines are created, then deleted in a
+ * different order. One op is one insert plus one cancel. */
+static long long bench_timer_insert_cancel(int backend, long long ops)
+{
+    he_event_loop *el = he_create_event_loop_backend(1024, 1000, NULL, NULL, backend);
+    he_timer **timers = malloc(sizeof(he_timer*) * ops);
+    long long start, elapsed, i, fired = 0;
+    unsigned int seed = 1;
+
+    if (el == NULL || timers == NULL) {
+        if (el) he_delete_event_loop(el);
+        free(timers);
+        return -1;
+    }
+    start = micro_nstime();
+    for (i = 0; i < ops; i++) {
+        seed = seed * 1103515245 + 12345;
+        timers[i] = he_create_timer(el, 1000 + (seed >> 16) % 100000,
+            micro_timer_proc, &fired);
+    }
+    for (i = 0; i < ops; i++)
+        he_delete_timer(el, timers[(i * 7919) % ops]);
+    elapsed = micro_nstime() - start;
+    free(timers);
+    he_delete_event_loop(el);
+    return elapsed;
+}
+
+/* Only the expiry is timed: ops timers already due when the loop runs. */
+static long long bench_timer_expire(int backend, long long ops)
+{
+    he_event_loop *el = he_create_event_loop_backend(1024, 1000, NULL, NULL, backend);
+    long long start, elapsed, i, fired = 0;
+
+    if (el == NULL) return -1;
+    for (i = 0; i < ops; i++) he_create_timer(el, 0, micro_timer_proc, &fired);
+    start = micro_nstime();
+    while (fired < ops) he_process_events(el);
+    elapsed = micro_nstime() - start;
+    he_delete_event_loop(el);
+    return elapsed;
+}
+
+static void micro_requeue_task(he_event_loop *el, void *arg)
+{
+    he_defer(el, arg);
+}
+
+/* A loop iteration with nothing to do: a deferred task that requeues
+ * itself keeps the poll timeout at zero. This is the fixed cost every
+ * wakeup pays (clock reads, timer and ready checks, one poll call). */
+static long long bench_empty_iteration(int backend, long long ops)
+{
+    he_event_loop *el = he_create_event_loop_backend(1024, 1000, NULL, NULL, backend);
+    he_task task;
+    long long start, elapsed, i;
+
+    if (el == NULL) return -1;
+    task.proc = micro_requeue_task;
+    task.arg = &task;
+    task.flags = 0;
+    he_defer(el, &task);
+    start = micro_nstime();
+    for (i = 0; i < ops; i++) he_process_events(el);
+    elapsed = micro_nstime() - start;
+    he_cancel_defer(el, &task);
+    he_delete_event_loop(el);
+    return elapsed;
+}
+
+/* The clocks the loop reads on every iteration. */
+static long long bench_gettimeofday(int backend, long long ops)
+{
+    struct timeval tv;
+    long long start, i, sum = 0;
+    UNUSED(backend);
+
+    start = micro_nstime();
+    for (i = 0; i < ops; i++) {
+        gettimeofday(&tv, NULL);
+        sum += tv.tv_usec;
+    }
+    micro_sink = sum;
+    return micro_nstime() - start;
+}
+
+static long long bench_clock_monotonic(int backend, long long ops)
+{
+    struct timespec ts;
+    long long start, i, sum = 0;
+    UNUSED(backend);
+
+    start = micro_nstime();
+    for (i = 0; i < ops; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        sum += ts.tv_nsec;
+    }
+    micro_sink = sum;
+    return micro_nstime() - start;
+}
+
+static long long bench_clock_monotonic_coarse(int backend, long long ops)
+{
+    struct timespec ts;
+    long long start, i, sum = 0;
+    UNUSED(backend);
+
+    start = micro_nstime();
+    for (i = 0; i < ops; i++) {
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        sum += ts.tv_nsec;
+    }
+    micro_sink = sum;
+    return micro_nstime() - start;
+}
+
+static long long bench_he_ustime(int backend, long long ops)
+{
+    long long start, i, sum = 0;
+    UNUSED(backend);
+
+    start = micro_nstime();
+    for (i = 0; i < ops; i++) sum += he_ustime();
+    micro_sink = sum;
+    return micro_nstime() - start;
+}
+
+static micro_bench benchmarks[] = {
+    {"file_event_churn", 1, 200000, bench_file_event_churn},
+    {"dispatch", 1, 2000000, bench_dispatch},
+    {"timer_insert_cancel", 1, 200000, bench_timer_insert_cancel},
+    {"timer_expire", 1, 200000, bench_timer_expire},
+    {"empty_iteration", 1, 200000, bench_empty_iteration},
+    {"gettimeofday", 0, 5000000, bench_gettimeofday},
+    {"clock_monotonic", 0, 5000000, bench_clock_monotonic},
+    {"clock_monotonic_coarse", 0, 5000000, bench_clock_monotonic_coarse},
+    {"he_ustime", 0, 5000000, bench_he_ustime},
+    {NULL, 0, 0, NULL}
+};
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: microbench [options]\n"
+        "  -f <format>    csv or json (default csv)\n"
+        "  -r <runs>      runs per benchmark, the median is reported (default 5)\n"
+        "  -b <backend>   epoll, uring or all (default all)\n"
+        "  -n <name>      only run benchmarks whose name contains name\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int json = 0, runs = 5, opt, b, r, first = 1;
+    int backends[] = {HE_BACKEND_EPOLL, HE_BACKEND_URING};
+    const char *names[] = {"epoll", "io_uring"};
+    int use[] = {1, 1};
+    const char *filter = NULL;
+    micro_bench *mb;
+
+    while ((opt = getopt(argc, argv, "f:r:b:n:")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (!strcasecmp(optarg, "json")) json = 1;
+            else if (strcasecmp(optarg, "csv")) usage();
+            break;
+        case 'r': runs = atoi(optarg); break;
+        case 'b':
+            if (!strcasecmp(optarg, "epoll")) use[1] = 0;
+            else if (!strcasecmp(optarg, "uring")) use[0] = 0;
+            else if (strcasecmp(optarg, "all")) usage();
+            break;
+        case 'n': filter = optarg; break;
+        default: usage();
+        }
+    }
+    if (runs <= 0 || runs > MICRO_MAX_RUNS) usage();
+
+    if (json) printf("{\"runs\": %d, \"results\": [\n", runs);
+    else printf("name,backend,ops,runs,ns_per_op_median,ns_per_op_min\n");
+    for (mb = benchmarks; mb->name; mb++) {
+        if (filter && strstr(mb->name, filter) == NULL) continue;
+        for (b = 0; b < (mb->per_backend ? 2 : 1); b++) {
+            long long elapsed[MICRO_MAX_RUNS];
+            const char *backend = mb->per_backend ? names[b] : "none";
+            double median, min;
+
+            if (mb->per_backend && !use[b]) continue;
+            for (r = 0; r < runs; r++)
+                if ((elapsed[r] = mb->proc(backends[b], mb->ops)) < 0) break;
+            if (r < runs) continue;
+            qsort(elapsed, runs, sizeof(long long), cmp_ll);
+            median = (double)elapsed[runs / 2] / mb->ops;
+            min = (double)elapsed[0] / mb->ops;
+            if (json) {
+                printf("%s  {\"name\": \"%s\", \"backend\": \"%s\", \"ops\": %lld, "
+                    "\"ns_per_op_median\": %.2f, \"ns_per_op_min\": %.2f}",
+                    first ? "" : ",\n", mb->name, backend, mb->ops, median, min);
+            } else {
+                printf("%s,%s,%lld,%d,%.2f,%.2f\n", mb->name, backend, mb->ops,
+                    runs, median, min);
+            }
+            first = 0;
+            fflush(stdout);
+        }
+    }
+    if (json) printf("\n]}\n");
+    return 0;
+}